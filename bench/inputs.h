@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+
+// Synthetic scripts of `lines` statements that the whole pipeline can compile and run
+inline std::string arithmetic_script(const size_t lines)
+{
+    std::string source = "var x0 = 1\n";
+    for (size_t i = 1; i < lines; i++) {
+        const auto name = "x" + std::to_string(i);
+        const auto previous = "x" + std::to_string(i - 1);
+        source += "var " + name + " = " + previous + " * 2 + " + std::to_string(i) + " / 3 - "
+                  + previous + "\n";
+    }
+    return source;
+}
+
+// A tight arithmetic loop running `iterations` times, where dispatch dominates
+inline std::string loop_script(const size_t iterations)
+{
+    return "var i = " + std::to_string(iterations) + "\n"
+           "var x = 0\n"
+           "var y = 1\n"
+           "while (i) {\n"
+           "    x = x + y * 2 - i / 3\n"
+           "    y = y + 1 - x / 1000\n"
+           "    i = i - 1\n"
+           "}\n"
+           "x + y\n";
+}
+
+// `iterations` runs of an inner loop of 16 under a branch that alternates, so loops are entered
+// and left all the time
+inline std::string nested_loop_script(const size_t iterations)
+{
+    return "var i = " + std::to_string(iterations) + "\n"
+           "var sum = 0\n"
+           "var odd = 0\n"
+           "while (i) {\n"
+           "    var j = 16\n"
+           "    while (j) {\n"
+           "        sum = sum + i * j / 7 - j\n"
+           "        j = j - 1\n"
+           "    }\n"
+           "    if (odd == 1) {\n"
+           "        sum = sum / 2\n"
+           "        odd = 0\n"
+           "    } else {\n"
+           "        odd = 1\n"
+           "    }\n"
+           "    i = i - 1\n"
+           "}\n"
+           "sum\n";
+}
+
+// A bundle of `functions` small function declarations, each separated by a top-level statement
+inline std::string function_bundle(const size_t functions)
+{
+    std::string source = "var total = 0\n";
+    for (size_t i = 0; i < functions; i++) {
+        const auto name = "f" + std::to_string(i);
+        source += "function " + name + "(a, b) {\n"
+                  "    var x = a * 2 + b / 3 - a\n"
+                  "    if (x == b) { x = x + 1 } else { x = x - 1 }\n"
+                  "    while (x) { x = " + name + "(x[0], b.y) }\n"
+                  "}\n"
+                  "total = total + " + std::to_string(i) + "\n";
+    }
+    return source;
+}
@@ -0,0 +1,294 @@
+#include "ast_arena.h"
+#include "bytecode_file.h"
+#include "inputs.h"
+#include "parallel_lexer.h"
+#include "parallel_parser.h"
+#include "parser.h"
+#include "peephole.h"
+#include "register_compiler.h"
+#include "runtime.h"
+
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <unistd.h>
+
+static size_t count_nodes(const ASTNode *node)
+{
+    switch (node->type) {
+    case ASTNode::Type::BinaryExpression: {
+        const auto expression = dynamic_cast<const BinaryExpression *>(node);
+        return 1 + count_nodes(expression->left) + count_nodes(expression->right);
+    }
+    case ASTNode::Type::ParenthesizedExpression:
+        return 1 + count_nodes(dynamic_cast<const ParenthesizedExpression *>(node)->expression);
+    default:
+        return 1;
+    }
+}
+
+static size_t count_nodes(const std::vector<ASTNode *> &ast)
+{
+    size_t count = 0;
+    for (const auto &node : ast)
+        count += count_nodes(node);
+    return count;
+}
+
+static OLRuntime::Program compile(const std::string &source)
+{
+    OLRuntime::Program program;
+    Lexer lexer(source, Lexer::Mode::View);
+    lexer.intern_into(program.atoms);
+    const auto ast = parse(lexer);
+    for (const auto &node : ast)
+        node->compile(program);
+    destroy_ast(ast);
+    return program;
+}
+
+static void BM_Lex(benchmark::State &state)
+{
+    const auto source = arithmetic_script(state.range(0));
+    size_t tokens = 0;
+    for (auto _ : state) {
+        Lexer lexer(source, Lexer::Mode::View);
+        while (lexer.next().type != Token::Type::EndOfFile)
+            tokens++;
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * source.size()));
+    state.counters["tokens"] = benchmark::Counter(tokens, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Lex)->RangeMultiplier(8)->Range(64, 1 << 15);
+
+static void BM_Parse(benchmark::State &state)
+{
+    const auto source = arithmetic_script(state.range(0));
+    size_t nodes = 0;
+    for (auto _ : state) {
+        const auto ast = parse(source, Lexer::Mode::View);
+        state.PauseTiming();
+        nodes += count_nodes(ast);
+        destroy_ast(ast);
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * source.size()));
+    state.counters["nodes"] = benchmark::Counter(nodes, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Parse)->RangeMultiplier(8)->Range(64, 1 << 15);
+
+static void BM_ParseArena(benchmark::State &state)
+{
+    const auto source = arithmetic_script(state.range(0));
+    size_t nodes = 0;
+    for (auto _ : state) {
+        AstArena arena;
+        Lexer lexer(source, Lexer::Mode::View);
+        const auto ast = parse(lexer, arena);
+        state.PauseTiming();
+        nodes += count_nodes(ast);
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * source.size()));
+    state.counters["nodes"] = benchmark::Counter(nodes, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_ParseArena)->RangeMultiplier(8)->Range(64, 1 << 15);
+
+static void BM_Compile(benchmark::State &state)
+{
+    const auto source = arithmetic_script(state.range(0));
+    AtomTable atoms;
+    Lexer lexer(source, Lexer::Mode::View);
+    lexer.intern_into(atoms);
+    const auto ast = parse(lexer);
+    const auto nodes = count_nodes(ast);
+    for (auto _ : state) {
+        state.PauseTiming();
+        OLRuntime::Program program;
+        program.atoms = atoms;
+        state.ResumeTiming();
+        for (const auto &node : ast)
+            node->compile(program);
+        benchmark::DoNotOptimize(program.instructions.data());
+    }
+    destroy_ast(ast);
+    state.counters["nodes"] = benchmark::Counter(
+        static_cast<double>(state.iterations() * nodes), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Compile)->RangeMultiplier(8)->Range(64, 1 << 15);
+
+static void BM_Execute(benchmark::State &state)
+{
+    auto program = compile(arithmetic_script(state.range(0)));
+    const auto instructions = program.instructions.size();
+    OLRuntime::OLRuntime runtime(std::move(program));
+    for (auto _ : state) {
+        runtime.execute();
+        benchmark::DoNotOptimize(runtime.getLastValue());
+    }
+    state.counters["instructions"] = benchmark::Counter(
+        static_cast<double>(state.iterations() * instructions), benchmark::Counter::kIsRate);
+    state.counters["program_size"] = static_cast<double>(instructions);
+}
+BENCHMARK(BM_Execute)->RangeMultiplier(8)->Range(64, 1 << 15);
+
+// the same scripts with the superinstructions of peephole()
+static void BM_ExecutePeephole(benchmark::State &state)
+{
+    auto program = compile(arithmetic_script(state.range(0)));
+    peephole(program);
+    const auto instructions = program.instructions.size();
+    OLRuntime::OLRuntime runtime(std::move(program));
+    for (auto _ : state) {
+        runtime.execute();
+        benchmark::DoNotOptimize(runtime.getLastValue());
+    }
+    state.counters["instructions"] = benchmark::Counter(
+        static_cast<double>(state.iterations() * instructions), benchmark::Counter::kIsRate);
+    state.counters["program_size"] = static_cast<double>(instructions);
+}
+BENCHMARK(BM_ExecutePeephole)->RangeMultiplier(8)->Range(64, 1 << 15);
+
+// the same scripts on the register machine, compare with BM_Execute
+static void BM_ExecuteRegisters(benchmark::State &state)
+{
+    const auto source = arithmetic_script(state.range(0));
+    OLRuntime::Program program;
+    Lexer lexer(source, Lexer::Mode::View);
+    lexer.intern_into(program.atoms);
+    const auto ast = parse(lexer);
+    auto registers = compile_registers(ast, program);
+    destroy_ast(ast);
+    const auto instructions = registers.instructions.size();
+    OLRuntime::OLRuntime runtime(std::move(program), std::move(registers));
+    for (auto _ : state) {
+        runtime.execute();
+        benchmark::DoNotOptimize(runtime.getLastValue());
+    }
+    state.counters["instructions"] = benchmark::Counter(
+        static_cast<double>(state.iterations() * instructions), benchmark::Counter::kIsRate);
+    state.counters["program_size"] = static_cast<double>(instructions);
+}
+BENCHMARK(BM_ExecuteRegisters)->RangeMultiplier(8)->Range(64, 1 << 15);
+
+// A loop of state.range(1) iterations with the dispatch of state.range(0), 0 for Switch and 1 for
+// Threaded. Run with --benchmark_perf_counters=BRANCH-MISSES,INSTRUCTIONS, on a benchmark library
+// built with libpfm, to see the mispredictions each one causes.
+static void BM_ExecuteDispatch(benchmark::State &state)
+{
+    OLRuntime::OLRuntime runtime;
+    runtime.run(loop_script(state.range(1)));
+    runtime.set_dispatch(state.range(0) == 0 ? OLRuntime::OLRuntime::Dispatch::Switch
+                                             : OLRuntime::OLRuntime::Dispatch::Threaded);
+    for (auto _ : state) {
+        runtime.execute();
+        benchmark::DoNotOptimize(runtime.getLastValue());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_ExecuteDispatch)->ArgsProduct({{0, 1}, {1 << 10, 1 << 16}});
+
+// the loop of BM_ExecuteDispatch as machine code, compare with its threaded dispatch
+static void BM_ExecuteJit(benchmark::State &state)
+{
+    OLRuntime::OLRuntime runtime;
+    runtime.run(loop_script(state.range(0)));
+    runtime.set_jit(true);
+    for (auto _ : state) {
+        runtime.execute();
+        benchmark::DoNotOptimize(runtime.getLastValue());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ExecuteJit)->Arg(1 << 10)->Arg(1 << 16);
+
+// Loop-heavy scripts, loop_script() for state.range(1) 0 and nested_loop_script() for 1, on the
+// interpreter for state.range(0) 0, the baseline JIT for 1 and with the loops traced for 2
+static void BM_ExecuteLoops(benchmark::State &state)
+{
+    constexpr size_t iterations = 1 << 14;
+    OLRuntime::OLRuntime runtime;
+    runtime.run(state.range(1) == 0 ? loop_script(iterations) : nested_loop_script(iterations));
+    runtime.set_jit(state.range(0) == 1);
+    runtime.set_tracing(state.range(0) == 2);
+    for (auto _ : state) {
+        runtime.execute();
+        benchmark::DoNotOptimize(runtime.getLastValue());
+    }
+    state.SetItemsProcessed(state.iterations() * iterations);
+}
+BENCHMARK(BM_ExecuteLoops)->ArgsProduct({{0, 1, 2}, {0, 1}});
+
+// startup of a worker: running a script from source, then from its compiled .olc file
+static void BM_StartupSource(benchmark::State &state)
+{
+    const auto source = arithmetic_script(state.range(0));
+    for (auto _ : state) {
+        OLRuntime::OLRuntime runtime;
+        runtime.run(source);
+        benchmark::DoNotOptimize(runtime.getLastValue());
+    }
+}
+BENCHMARK(BM_StartupSource)->RangeMultiplier(8)->Range(64, 1 << 15);
+
+static void BM_StartupBytecode(benchmark::State &state)
+{
+    const auto source = arithmetic_script(state.range(0));
+    // a name of its own, so benchmark runs sharing the temporary directory keep their files
+    auto path = (std::filesystem::temp_directory_path() / "objects_script_bench_XXXXXX").string();
+    const auto fd = mkstemp(path.data());
+    if (fd < 0) {
+        state.SkipWithError("cannot create a temporary file");
+        return;
+    }
+    close(fd);
+    OLRuntime::OLRuntime compiled;
+    compiled.run(source);
+    compiled.save_bytecode(path, source);
+    for (auto _ : state) {
+        OLRuntime::OLRuntime runtime;
+        runtime.run_bytecode(path);
+        benchmark::DoNotOptimize(runtime.getLastValue());
+    }
+    std::remove(path.c_str());
+}
+BENCHMARK(BM_StartupBytecode)->RangeMultiplier(8)->Range(64, 1 << 15);
+
+// startup of a script bundle: parsing its top-level units on state.range(0) threads
+static void BM_ParseParallel(benchmark::State &state)
+{
+    const auto source = function_bundle(4096);
+    const auto tokens = lex_parallel(source, Lexer::Mode::View, 1);
+    const auto threads = static_cast<size_t>(state.range(0));
+    for (auto _ : state) {
+        const auto ast = parse_parallel(tokens, threads);
+        state.PauseTiming();
+        destroy_ast(ast);
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * source.size()));
+}
+BENCHMARK(BM_ParseParallel)->RangeMultiplier(2)->Range(1, 8)->UseRealTime();
+
+static void BM_CompileParallel(benchmark::State &state)
+{
+    const auto source = arithmetic_script(1 << 15);
+    AtomTable atoms;
+    Lexer lexer(source, Lexer::Mode::View);
+    lexer.intern_into(atoms);
+    const auto ast = parse(lexer);
+    const auto threads = static_cast<size_t>(state.range(0));
+    for (auto _ : state) {
+        state.PauseTiming();
+        OLRuntime::Program program;
+        program.atoms = atoms;
+        state.ResumeTiming();
+        compile_parallel(ast, program, threads);
+        benchmark::DoNotOptimize(program.instructions.data());
+    }
+    destroy_ast(ast);
+}
+BENCHMARK(BM_CompileParallel)->RangeMultiplier(2)->Range(1, 8)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -3,6 +3,7 @@
 #include "lexer.h"
 #include "runtime.h"
 
+#include <memory_resource>
 #include <optional>
 #include <stdexcept>
 #include <vector>
@@ -34,6 +35,9 @@ struct ASTNode
     bool operator!=(const ASTNode &other) const { return !(*this == other); }
 };
 
+// Child lists draw their memory from the tree's AstArena when it has one
+using NodeList = std::pmr::vector<ASTNode *>;
+
 struct SingleNode final : ASTNode
 {
     Token token;
@@ -66,6 +70,7 @@ struct ParenthesizedExpression final : ASTNode
     ASTNode *expression;
     explicit ParenthesizedExpression(ASTNode *expression);
     ~ParenthesizedExpression() override;
+    void compile(OLRuntime::Program &program) const override;
     bool operator==(const ASTNode &other) const override;
 };
 
@@ -81,9 +86,9 @@ struct UnaryExpression final : ASTNode
 struct FunctionDeclaration final : ASTNode
 {
     Token name;
-    std::vector<ASTNode *> args;
+    NodeList args;
     ASTNode *body;
-    FunctionDeclaration(Token name, std::vector<ASTNode *> args, ASTNode *body);
+    FunctionDeclaration(Token name, NodeList args, ASTNode *body);
     ~FunctionDeclaration() override;
     bool operator==(const ASTNode &other) const override;
 };
@@ -91,17 +96,18 @@ struct FunctionDeclaration final : ASTNode
 struct FunctionCall final : ASTNode
 {
     ASTNode *name;
-    std::vector<ASTNode *> args;
-    FunctionCall(ASTNode *name, std::vector<ASTNode *> args);
+    NodeList args;
+    FunctionCall(ASTNode *name, NodeList args);
     ~FunctionCall() override;
     bool operator==(const ASTNode &other) const override;
 };
 
 struct ScopeBlock final : ASTNode
 {
-    std::vector<ASTNode *> statements;
-    explicit ScopeBlock(std::vector<ASTNode *> statements);
+    NodeList statements;
+    explicit ScopeBlock(NodeList statements);
     ~ScopeBlock() override;
+    void compile(OLRuntime::Program &program) const override;
     bool operator==(const ASTNode &other) const override;
 };
 
@@ -152,5 +158,10 @@ struct Constructor final : ASTNode
 };
 
 bool operator==(const std::vector<ASTNode *> &left, const std::vector<ASTNode *> &right);
+bool operator==(const NodeList &left, const NodeList &right);
+
+// the value of a true, false or null token, nullopt for the other tokens
+std::optional<OLRuntime::Value> literal_value(Token::Type type);
 
+// frees a heap allocated tree, trees parsed into an AstArena are released with the arena
 void destroy_ast(const std::vector<ASTNode *> &ast);
\ No newline at end of file
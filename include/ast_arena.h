@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstring>
+#include <memory_resource>
+#include <string_view>
+#include <utility>
+
+// Bump allocator owning every node and child list of a parsed tree. Nodes made here are never
+// deleted one by one: their destructors are skipped and the whole tree goes away with the arena.
+class AstArena
+{
+    std::pmr::monotonic_buffer_resource memory;
+
+public:
+    explicit AstArena(const size_t initial_size = 64 * 1024)
+        : memory(initial_size)
+    {}
+    AstArena(const AstArena &) = delete;
+    AstArena &operator=(const AstArena &) = delete;
+
+    template<typename T, typename... Args>
+    T *make(Args &&...args)
+    {
+        return new (memory.allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // copies `text` into the arena so it lives as long as the tree
+    std::string_view keep(const std::string_view text)
+    {
+        const auto data = static_cast<char *>(memory.allocate(text.size(), 1));
+        std::memcpy(data, text.data(), text.size());
+        return {data, text.size()};
+    }
+
+    std::pmr::memory_resource *resource() { return &memory; }
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Interns identifiers so each distinct name is stored once and referred to by a dense 32-bit id
+class AtomTable
+{
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, uint32_t> ids;
+
+public:
+    AtomTable() = default;
+    // copies re-point their index at their own names
+    AtomTable(const AtomTable &other);
+    AtomTable &operator=(const AtomTable &other);
+    AtomTable(AtomTable &&) = default;
+    AtomTable &operator=(AtomTable &&) = default;
+
+    uint32_t intern(std::string_view name);
+    [[nodiscard]] std::string_view name(uint32_t atom) const { return names[atom]; }
+    [[nodiscard]] size_t size() const { return names.size(); }
+};
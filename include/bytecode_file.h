@@ -0,0 +1,72 @@
+#pragma once
+
+#include "runtime.h"
+#include "source_file.h"
+
+#include <span>
+#include <string>
+#include <string_view>
+
+// A compiled program stored in a .olc file:
+// - a BytecodeHeader, checked against this build before anything else is read
+// - the instructions, laid out as in memory so the machine runs them from the mapping
+// - the symbol table, one BytecodeSymbol per atom
+// - the names of the atoms, one after the other
+// Numbers are operands of their LoadNumber instruction, booleans and null of their LoadValue
+// instruction, there is no separate constant pool.
+
+// bumped whenever the header, the sections or the instruction set change
+constexpr uint32_t bytecode_version = 5;
+
+struct BytecodeHeader
+{
+    char magic[4];
+    uint32_t version;
+    // files of a build with another instruction layout or byte order are refused
+    uint32_t instruction_size;
+    uint32_t byte_order;
+    // hash_text() of the source the program was compiled from
+    uint64_t source_hash;
+    // hash_text() of every byte after the header
+    uint64_t checksum;
+    uint64_t locals_count;
+    uint64_t frame_size;
+    uint64_t stack_size;
+    uint64_t instructions_offset;
+    uint64_t instructions_count;
+    uint64_t symbols_offset;
+    uint64_t symbols_count;
+    uint64_t names_offset;
+    uint64_t names_size;
+};
+
+struct BytecodeSymbol
+{
+    // local slot of the atom, Program::no_slot when it was never declared
+    uint64_t slot;
+    uint64_t name_offset;
+    uint64_t name_size;
+};
+
+// FNV-1a over the 64-bit words of `text`, used for source hashes and checksums
+uint64_t hash_text(std::string_view text);
+
+// Writes `program` to `path` through a temporary file renamed over it once complete, so
+// concurrent readers never map a partial file
+void write_bytecode(const std::string &path, const OLRuntime::Program &program,
+                    uint64_t source_hash);
+
+// Read-only mapping of a .olc file, validated when it is opened
+class BytecodeFile
+{
+    SourceFile file;
+    const BytecodeHeader *header = nullptr;
+
+public:
+    explicit BytecodeFile(const std::string &path);
+
+    [[nodiscard]] uint64_t source_hash() const { return header->source_hash; }
+    [[nodiscard]] std::span<const OLRuntime::Instruction> instructions() const;
+    // declares the variables of the file in `program`, which must not have any yet
+    void load_symbols(OLRuntime::Program &program) const;
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "ast.h"
+#include "lexer.h"
+#include "runtime.h"
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Token stored by value in a FlatAst, its text lives in the tree's text pool
+struct FlatToken
+{
+    Token::Type type;
+    uint32_t line;
+    uint32_t column;
+    uint32_t atom;
+    uint32_t text_offset;
+    uint32_t text_size;
+};
+static_assert(std::is_trivially_copyable_v<FlatToken>);
+
+// Struct-of-arrays AST: nodes are 32-bit indices into parallel arrays and every array holds
+// trivially copyable data, so a tree can be copied or written out with memcpy.
+//
+// Meaning of the per-node slots by node type:
+//   SingleNode, VarDeclaration   token
+//   BinaryExpression             token (operator), first (left), second (right)
+//   UnaryExpression              token (operator), first (operand)
+//   ParenthesizedExpression      first (expression)
+//   FunctionDeclaration          token (name), first (list of args), second (body)
+//   FunctionCall                 first (name), second (list of args)
+//   ScopeBlock                   first (list of statements)
+//   IfStatement                  first (condition), second (body), third (else body or none)
+//   WhileStatement               first (condition), second (body)
+//   ArrayAccess                  first (array), second (index)
+//   FieldAccess                  first (record), second (field)
+//   Constructor                  first (record)
+// A list is an offset into `lists`, holding the element count followed by the elements.
+struct FlatAst
+{
+    using Index = uint32_t;
+    static constexpr Index none = UINT32_MAX;
+
+    std::vector<ASTNode::Type> types;
+    std::vector<Index> tokens;
+    std::vector<Index> first;
+    std::vector<Index> second;
+    std::vector<Index> third;
+    std::vector<Index> lists;
+    std::vector<FlatToken> token_pool;
+    std::string text;
+    std::vector<Index> roots;
+
+    [[nodiscard]] size_t size() const { return types.size(); }
+    [[nodiscard]] Token token(Index node) const;
+    // elements of the list starting at `offset` in `lists`
+    [[nodiscard]] std::span<const Index> list(Index offset) const
+    {
+        return {lists.data() + offset + 1, lists[offset]};
+    }
+
+    // Appends the instructions of the tree to `program`, as the stack compiler does for the pointer
+    // tree. Covers numbers, true, false and null, variables, assignments, + - * / == and ===,
+    // blocks, if and while, a tree with any other node is rejected with std::runtime_error before
+    // anything is emitted.
+    void compile(OLRuntime::Program &program) const;
+    bool operator==(const FlatAst &other) const;
+};
+
+FlatAst flatten(const std::vector<ASTNode *> &ast);
+// Parses into a temporary arena and flattens the result. Both trees exist until it returns, the
+// arena is released then and only the flat tree is kept.
+FlatAst parse_flat(Lexer &lexer);
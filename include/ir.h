@@ -0,0 +1,73 @@
+#pragma once
+
+#include "ast.h"
+#include "runtime.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Mid-level IR in SSA form. Every IrValue is defined once, in one IrBlock, and reads of a
+// variable are resolved to the value it holds at that point, with phis where control flow joins.
+// It is built from the AST, simplified by the passes of ir_passes.h and lowered to instructions
+// of the stack machine.
+struct IrValue
+{
+    enum class Op
+    {
+        Number,    // `number`
+        Literal,   // the boolean or null whose raw_bits() are `bits`
+        Load,      // local `slot` as it was when the program started
+        Undefined, // a variable read before it was assigned, 0
+        Phi,       // operands[i] is the value coming from predecessor i of the block
+        Copy,      // operands[0], left by the passes until copies are propagated
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Equal, // whether the operands are equal, a boolean
+    } op;
+    uint32_t block;
+    std::vector<uint32_t> operands;
+    double number = 0;
+    uint64_t bits = 0;
+    size_t slot = 0;
+
+    // whether the value only depends on its operands, so it can be computed anywhere
+    [[nodiscard]] bool is_pure() const { return op != Op::Phi; }
+};
+
+struct IrBlock
+{
+    // phis first, then the other values in the order they are computed
+    std::vector<uint32_t> values;
+    std::vector<uint32_t> predecessors;
+    enum class End
+    {
+        Jump,   // to targets[0]
+        Branch, // to targets[0] when `condition` is not 0, to targets[1] otherwise
+        Exit,
+    } end = End::Exit;
+    uint32_t condition = 0;
+    uint32_t targets[2] = {0, 0};
+};
+
+struct IrProgram
+{
+    static constexpr uint32_t none = UINT32_MAX;
+    std::vector<IrValue> values;
+    // the entry is block 0, a single block ends with Exit
+    std::vector<IrBlock> blocks;
+    // value stored in the slot of each variable assigned by the program when it exits
+    std::vector<std::pair<size_t, uint32_t>> exports;
+    // value of the last expression statement that ran, left on the stack
+    uint32_t result = none;
+};
+
+// Builds the IR of the statements of `ast`, declaring their variables in `program`. Covers the
+// expressions the stack compiler supports, == and ===, assignments, and if and while statements.
+IrProgram build_ir(const std::vector<ASTNode *> &ast, OLRuntime::Program &program);
+
+// Appends the instructions of `ir` to `program`. Values used once, right where they are computed,
+// stay on the stack, the others get a local slot of their own.
+void lower_ir(const IrProgram &ir, OLRuntime::Program &program);
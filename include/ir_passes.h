@@ -0,0 +1,24 @@
+#pragma once
+
+#include "ir.h"
+
+// Passes over the IR of ir.h. Values they replace become copies of their replacement, which
+// propagate_copies() removes from the operands, and eliminate_dead_code() from the blocks.
+
+// Points every use of a copy, or of a phi whose incoming values are all the same one, at the value
+// it stands for.
+void propagate_copies(IrProgram &ir);
+
+// Replaces a value by an identical one computed in a block that dominates it, walking the
+// dominator tree with the values available on the way down.
+void eliminate_common_subexpressions(IrProgram &ir);
+
+// Moves the values a loop computes from values defined outside of it to the block before the
+// loop header, innermost loops first, so they are computed once per entry into the loop.
+void hoist_loop_invariants(IrProgram &ir);
+
+// Removes the values that no branch, export or result depends on.
+void eliminate_dead_code(IrProgram &ir);
+
+// Runs the passes above in an order where each one feeds the next.
+void optimize_ir(IrProgram &ir);
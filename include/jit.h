@@ -0,0 +1,82 @@
+#pragma once
+
+#include "runtime.h"
+
+#include <memory>
+#include <span>
+
+struct Trace;
+
+namespace OLRuntime {
+// Machine code copied to pages that can be executed but no longer written
+class ExecutableMemory
+{
+    void *memory = nullptr;
+    size_t size = 0;
+
+public:
+    explicit ExecutableMemory(std::span<const uint8_t> code);
+    ~ExecutableMemory();
+    ExecutableMemory(const ExecutableMemory &) = delete;
+    ExecutableMemory &operator=(const ExecutableMemory &) = delete;
+
+    template<typename Function>
+    [[nodiscard]] Function entry() const
+    {
+        return reinterpret_cast<Function>(memory);
+    }
+};
+
+// Machine code of a stack machine program, from a baseline template JIT for Linux x86-64 that
+// turns every instruction into a fixed snippet. The top operand lives in xmm0 and the others on
+// the operand stack of the interpreter, laid out as execute_stack() keeps them, so the code can
+// stop before any instruction and leave the rest of the program to the interpreter. It does so
+// when an operand is not a number, or an arithmetic result is NaN, which the snippets only check
+// for. Jumps go straight to the code of their target, loops run without leaving the code.
+class NativeCode
+{
+    ExecutableMemory code;
+
+public:
+#if defined(__x86_64__) && defined(__linux__)
+    static constexpr bool supported = true;
+#else
+    static constexpr bool supported = false;
+#endif
+
+    explicit NativeCode(std::span<const uint8_t> code)
+        : code(code)
+    {}
+
+    // nullptr when the JIT does not support the platform
+    static std::unique_ptr<const NativeCode> compile(std::span<const Instruction> instructions);
+
+    // Runs the program from its first instruction on `stack`, which has room for its stack size
+    // plus one, and `locals`. Returns the index of the instruction the interpreter has to go on
+    // from, the number of instructions when the program ended, and sets `depth` to the number of
+    // operands on the stack.
+    size_t run(Value *locals, Value *stack, size_t &depth) const;
+};
+
+// A loop trace of trace.h as machine code, running iterations until one of its guards fails. The
+// locals of the loop, and its constants, stay in registers until then, the values it computes in
+// between get the registers left over.
+class NativeTrace
+{
+    ExecutableMemory code;
+
+public:
+    explicit NativeTrace(std::span<const uint8_t> code)
+        : code(code)
+    {}
+
+    // nullptr when the JIT does not support the platform, or the trace needs more registers than
+    // there are
+    static std::unique_ptr<const NativeTrace> compile(const Trace &trace);
+
+    // Returns the instruction the interpreter goes on from, with the locals the loop stored up to
+    // the guard that failed. That is the header itself when the locals the loop reads are not all
+    // numbers, before anything ran.
+    size_t run(Value *locals) const;
+};
+} // namespace OLRuntime
@@ -1,6 +1,12 @@
 #pragma once
 
+#include "atoms.h"
+
+#include <array>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
 
 struct Token
 {
@@ -43,10 +49,25 @@ struct Token
     size_t line = 0;
     size_t column = 0;
 
+    // Set instead of `value` by lexers in view mode, points into the lexer's source buffer
+    std::string_view span;
+
+    // Interned name of identifiers when the lexer has an atom table
+    static constexpr uint32_t no_atom = UINT32_MAX;
+    uint32_t atom = no_atom;
+
+    // Byte offset of the token in the whole source
+    size_t offset = 0;
+
+    [[nodiscard]] inline std::string_view text() const
+    {
+        return span.data() != nullptr ? span : std::string_view(value);
+    }
+
     inline bool operator==(const Token &other) const
     {
         return type == other.type &&
-            value == other.value &&
+            text() == other.text() &&
             line == other.line &&
             column == other.column;
     }
@@ -54,20 +75,84 @@ struct Token
 
 class Lexer
 {
-    std::string source;
+public:
+    enum class Mode
+    {
+        // Every token owns a copy of its text
+        Copy,
+        // Tokens refer to the source buffer, only escaped strings are materialized.
+        // The source must outlive the tokens.
+        View,
+    };
+
+private:
+    std::string storage;
+    std::string_view source;
+    Mode mode;
     size_t position;
     size_t line;
     size_t column;
 
     Token last_token;
+    AtomTable *atoms = nullptr;
 
+    // ring buffer of scanned tokens that have not been consumed yet
+    static constexpr size_t lookahead = 4;
+    std::array<Token, lookahead> buffer;
+    size_t head = 0;
+    size_t buffered = 0;
+    size_t scanned_bytes = 0;
+
+    // streaming input, `storage` then holds a window of the bytes the scanner still needs
+    int input = -1;
+    size_t chunk_size = 0;
+    bool exhausted = true;
+    // bytes dropped from the front of the window, added to token offsets
+    size_t discarded = 0;
+
+    // tokens scanned ahead of time, e.g. by lex_parallel
+    std::vector<Token> replay;
+    size_t replay_index = 0;
+    bool replaying = false;
+
+    [[nodiscard]] inline char at(const size_t index) const
+    {
+        return index < source.size() ? source[index] : '\0';
+    }
+    void set_text(Token &, size_t start, size_t end) const;
+    // moves to `end`, keeping line and column in sync with the skipped bytes
+    void advance_to(size_t end);
+    Token scan();
+    Token fill();
+    // appends `size` bytes of input to the window, fewer at the end of the input
+    void read_chunk(size_t size);
     Token read_string();
     void handle_escape_sequence(Token &);
 
 public:
     explicit Lexer(std::string);
+    Lexer(std::string_view, Mode);
+    // Reads the source from `fd` in `chunk_size` pieces, the descriptor is not closed.
+    // Memory stays bounded by a couple of chunks plus twice the longest token or comment.
+    Lexer(int fd, size_t chunk_size);
+    // Hands out already scanned tokens, the last one being EndOfFile
+    explicit Lexer(std::vector<Token> tokens);
+    Lexer(const Lexer &) = delete;
+    Lexer &operator=(const Lexer &) = delete;
+
+    // identifiers get their atom from `table`, which must outlive the lexer
+    void intern_into(AtomTable &table) { atoms = &table; }
+
+    // restarts scanning at a token boundary, dropping any buffered lookahead
+    void seek(size_t position, size_t line, size_t column);
 
     Token next();
+    // last identifier, number or keyword returned by next()
     Token current();
-    Token peek();
-};
\ No newline at end of file
+    // look `offset` tokens past the next one without consuming anything
+    const Token &peek(size_t offset = 0);
+
+    // Number of source bytes the scanner went over. Each byte is counted once, except when
+    // streaming: a token running past the window is scanned again once more input is read.
+    [[nodiscard]] size_t bytes_scanned() const { return scanned_bytes; }
+};
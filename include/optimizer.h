@@ -0,0 +1,16 @@
+#pragma once
+
+#include "ast.h"
+
+class AstArena;
+
+// Simplifies the tree before it is compiled:
+// - constant subtrees of + - * / are folded into a number, following IEEE 754 arithmetic
+// - reads of a variable declared once as `var x = <constant>` and never assigned again are
+//   replaced by the constant, outside of function bodies where a parameter could shadow it
+// - operations that return their operand unchanged for every double, x * 1, 1 * x, x / 1,
+//   x - 0 and x + -0 (but not x + 0, which turns -0 into 0), are dropped when x is a number or
+//   arithmetic, a variable could hold a boolean or null that the operation turns into a number
+// Replaced nodes are deleted, or left to `arena` when the tree was parsed into it, and new
+// nodes are allocated the same way.
+void optimize(std::vector<ASTNode *> &ast, AstArena *arena = nullptr);
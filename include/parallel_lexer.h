@@ -0,0 +1,19 @@
+#pragma once
+
+#include "lexer.h"
+
+#include <vector>
+
+// Offsets that split `source` into at most `parts` ranges, always right after a newline that lies
+// outside strings and comments. The first offset is 0 and the last one is source.size().
+std::vector<size_t> find_split_points(std::string_view source, size_t parts);
+
+// Lexes `source` on up to `threads` threads, each getting at least `min_chunk_size` bytes.
+// The result is identical to draining a Lexer over the whole source, EndOfFile included.
+// Identifiers are interned into `atoms` after the threads have joined.
+std::vector<Token> lex_parallel(
+    std::string_view source,
+    Lexer::Mode mode,
+    size_t threads,
+    size_t min_chunk_size = 1 << 16,
+    AtomTable *atoms = nullptr);
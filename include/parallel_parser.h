@@ -0,0 +1,19 @@
+#pragma once
+
+#include "ast.h"
+#include "runtime.h"
+
+#include <vector>
+
+// Token indices that split `tokens` into top-level units: each top-level function declaration,
+// found by matching its braces, and each run of statements between them. The first index is 0
+// and the last one is the index of the EndOfFile token.
+std::vector<size_t> find_top_level_units(const std::vector<Token> &tokens);
+
+// Parses the units of `tokens`, which must end with EndOfFile, on up to `threads` threads.
+// The heap allocated result is identical to parsing the whole stream at once.
+std::vector<ASTNode *> parse_parallel(const std::vector<Token> &tokens, size_t threads);
+
+// Compiles contiguous runs of the statements of `ast` into separate programs on up to `threads`
+// threads, then links them in order into `program`. The instructions match a serial compile.
+void compile_parallel(const std::vector<ASTNode *> &ast, OLRuntime::Program &program, size_t threads);
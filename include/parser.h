@@ -3,4 +3,47 @@
 #include "lexer.h"
 #include "ast.h"
 
+class AstArena;
+
+// Deepest stack the parser may build, a nested parenthesis, block or right operand takes one or
+// two levels. Deeper input fails with a std::runtime_error instead of exhausting memory, which
+// also keeps the trees shallow enough to compare and walk recursively. Chains of left-associative
+// operators do not count, the walkers follow left operands in a loop.
+constexpr size_t default_max_parse_depth = 10000;
+void set_max_parse_depth(size_t depth);
+size_t max_parse_depth();
+
 std::vector<ASTNode *> parse(const std::string &source);
+// In view mode the returned tree refers to `source`, which must outlive it
+std::vector<ASTNode *> parse(std::string_view source, Lexer::Mode mode);
+std::vector<ASTNode *> parse(Lexer &lexer);
+// Allocates the tree in `arena`, do not pass the result to destroy_ast()
+std::vector<ASTNode *> parse(Lexer &lexer, AstArena &arena);
+
+// Keeps the top-level statements of a script with the position of their first token, so that an
+// edit only re-lexes and re-parses the statements around it and reuses every other subtree.
+class IncrementalParser
+{
+    struct Statement
+    {
+        ASTNode *node;
+        size_t offset;
+        size_t line;
+        size_t column;
+    };
+    std::string source;
+    std::vector<Statement> statements;
+
+public:
+    explicit IncrementalParser(std::string source);
+    ~IncrementalParser();
+    IncrementalParser(const IncrementalParser &) = delete;
+    IncrementalParser &operator=(const IncrementalParser &) = delete;
+
+    // Replaces `length` bytes at `offset` with `text`, returns the number of statements parsed again
+    size_t edit(size_t offset, size_t length, std::string_view text);
+
+    [[nodiscard]] const std::string &text() const { return source; }
+    // the tree stays owned by the parser
+    [[nodiscard]] std::vector<ASTNode *> ast() const;
+};
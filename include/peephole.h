@@ -0,0 +1,14 @@
+#pragma once
+
+#include "runtime.h"
+
+// Rewrites the instructions of `program` in place, fusing the pairs that pair_count() finds most
+// often on the stack machine. On arithmetic scripts every operator follows the load of its right
+// operand, and every declaration is followed by a read of the same variable:
+// - LoadNumber c; Add/Sub/Mul/Div becomes AddNumber c, ... DivNumber c
+// - LoadLocal x; Add/Sub/Mul/Div becomes AddLocal x, ... DivLocal x
+// - StoreLocal x; LoadLocal x becomes StoreLocalKeep x
+// - LoadLocal x; StoreLocal x is dropped
+// A pair is left alone when a jump lands on its second instruction, and the jumps are retargeted
+// to where their instructions moved.
+void peephole(OLRuntime::Program &program);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "ast.h"
+#include "runtime.h"
+
+#include <vector>
+
+// Compiles `ast` for the register machine as a new unit of `output`, against the variables
+// earlier units declared in `program`. Its local slots become the first registers, so arithmetic
+// reads and writes them without load and store instructions. Covers what the stack machine runs:
+// numbers, true, false and null, arithmetic, == and ===, assignments, blocks, if and while.
+void compile_registers(const std::vector<ASTNode *> &ast, OLRuntime::Program &program,
+                       OLRuntime::RegisterProgram &output);
+// compiles `ast` as the only unit of a new program
+OLRuntime::RegisterProgram compile_registers(const std::vector<ASTNode *> &ast,
+                                             OLRuntime::Program &program);
@@ -1,55 +1,358 @@
 #pragma once
+#include "atoms.h"
+#include "value.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
 #include <optional>
+#include <span>
 #include <string>
-#include <unordered_map>
 #include <vector>
 
+class AstArena;
+struct ASTNode;
+class BytecodeFile;
+
 namespace OLRuntime {
+class NativeCode;
+class NativeTrace;
+
 struct Instruction
 {
     enum class Type
     {
         Invalid,
         LoadNumber,
+        // pushes the value whose raw_bits() are data.value, a boolean or null
+        LoadValue,
         LoadLocal,
         StoreLocal,
         Add,
         Sub,
         Mul,
         Div,
+        // pushes whether the two values on top of the stack are equal, see Value::equals()
+        Equal,
+        // continue at instruction data.index
+        Jump,
+        // pops a value and continues at instruction data.index when it is falsy
+        JumpIfFalse,
+        // superinstructions of peephole(), the right operand of the arithmetic is data.number
+        // or the local data.index instead of the top of the stack
+        AddNumber,
+        SubNumber,
+        MulNumber,
+        DivNumber,
+        AddLocal,
+        SubLocal,
+        MulLocal,
+        DivLocal,
+        // stores the top of the stack without popping it
+        StoreLocalKeep,
         End,
     } type
         = Type::Invalid;
+    static constexpr size_t types_count = static_cast<size_t>(Type::End) + 1;
 
     union
     {
         void *other;
         double number;
+        uint64_t value;
         size_t index;
     } data = {.other = nullptr};
+
+    // whether data.index is the index of another instruction
+    [[nodiscard]] bool is_jump() const
+    {
+        return type == Type::Jump || type == Type::JumpIfFalse;
+    }
+
+    // whether data.number is an operand
+    [[nodiscard]] bool uses_number() const
+    {
+        switch (type) {
+        case Type::LoadNumber:
+        case Type::AddNumber:
+        case Type::SubNumber:
+        case Type::MulNumber:
+        case Type::DivNumber:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // whether data.index is a local slot
+    [[nodiscard]] bool uses_local() const
+    {
+        switch (type) {
+        case Type::LoadLocal:
+        case Type::StoreLocal:
+        case Type::AddLocal:
+        case Type::SubLocal:
+        case Type::MulLocal:
+        case Type::DivLocal:
+        case Type::StoreLocalKeep:
+            return true;
+        default:
+            return false;
+        }
+    }
+};
+
+// Most operands the stack machine holds at once running `instructions` from the first one, or
+// nullopt when one of them could pop an empty stack, or be reached with different depths.
+std::optional<size_t> max_stack_depth(std::span<const Instruction> instructions);
+
+// Three-address instruction of the register machine. Registers are the local slots of the
+// program followed by the temporaries of its expressions, operands are read before `dst` is set.
+struct RegisterInstruction
+{
+    enum class Type : uint32_t
+    {
+        Invalid,
+        LoadNumber,  // dst = number
+        LoadValue,   // dst = the value whose raw_bits() are `value`
+        Move,        // dst = a
+        Add,         // dst = a + b
+        Sub,         // dst = a - b
+        Mul,         // dst = a * b
+        Div,         // dst = a / b
+        Equal,       // dst = whether a and b are equal, see Value::equals()
+        Jump,        // continue at instruction a
+        JumpIfFalse, // continue at instruction b when a is falsy
+        End,
+    } type
+        = Type::Invalid;
+    uint32_t dst = 0;
+
+    union
+    {
+        struct
+        {
+            uint32_t a;
+            uint32_t b;
+        } operands;
+        double number;
+        uint64_t value;
+    } data = {.operands = {0, 0}};
+};
+
+// The units compiled so far, each one after the other. Running the program runs the last unit,
+// on the registers the earlier ones left.
+struct RegisterProgram
+{
+    std::vector<RegisterInstruction> instructions;
+    // first instruction of the last unit
+    size_t entry = 0;
+    size_t registers_count = 0;
+    // register holding the value of the last expression statement
+    static constexpr uint32_t no_result = UINT32_MAX;
+    uint32_t result = no_result;
 };
 
 struct Program
 {
     std::vector<Instruction> instructions;
-    std::unordered_map<std::string, size_t> local_vars;
+    AtomTable atoms;
+    // local slot of every variable indexed by its atom, no_slot when it was never declared
+    static constexpr size_t no_slot = SIZE_MAX;
+    std::vector<size_t> local_vars;
+    // slots held by the variables in scope, which are always the lowest ones
+    size_t locals_count = 0;
+    // slots the program uses at most, the size of the frame it runs in
+    size_t frame_size = 0;
+    // max_stack_depth() of the instructions, set once they are compiled
+    size_t stack_size = 0;
+    // Set on a part of a program compiled on its own: variables it uses without declaring them
+    // get a local slot as well, and are listed in `imports` with that slot until link() resolves
+    // them. Its slots are never reused, so each one stands for a single variable.
+    bool separate = false;
+    std::vector<std::pair<uint32_t, size_t>> imports;
+
+    struct Scope
+    {
+        size_t locals_count;
+        size_t shadowed_count;
+    };
+    // blocks being compiled, and the variables their declarations hide, by atom and slot
+    std::vector<Scope> scopes;
+    std::vector<std::pair<uint32_t, size_t>> shadowed;
+
+    [[nodiscard]] bool is_declared(const uint32_t atom) const
+    {
+        return atom < local_vars.size() && local_vars[atom] != no_slot;
+    }
+    // whether `atom` was declared by the innermost block being compiled, or at the top level
+    [[nodiscard]] bool is_declared_in_scope(const uint32_t atom) const
+    {
+        return is_declared(atom)
+               && (scopes.empty() || local_vars[atom] >= scopes.back().locals_count);
+    }
+    size_t declare(const uint32_t atom)
+    {
+        if (atom >= local_vars.size())
+            local_vars.resize(atom + 1, no_slot);
+        if (!scopes.empty())
+            shadowed.emplace_back(atom, local_vars[atom]);
+        frame_size = std::max(frame_size, locals_count + 1);
+        return local_vars[atom] = locals_count++;
+    }
+    size_t declare_import(const uint32_t atom)
+    {
+        const auto slot = declare(atom);
+        imports.emplace_back(atom, slot);
+        return slot;
+    }
+    // Declarations between open_scope() and close_scope() are local to the block, the variables
+    // they hid are visible again once it closes and the next declarations reuse their slots.
+    void open_scope() { scopes.push_back({locals_count, shadowed.size()}); }
+    void close_scope()
+    {
+        const auto scope = scopes.back();
+        scopes.pop_back();
+        while (shadowed.size() > scope.shadowed_count) {
+            const auto [atom, slot] = shadowed.back();
+            local_vars[atom] = slot;
+            shadowed.pop_back();
+        }
+        if (!separate)
+            locals_count = scope.locals_count;
+    }
+    // Appends `part`, compiled with `separate` set, declaring its variables after the ones
+    // declared so far and pointing its imports at them. Atoms below `shared_atoms` name the same
+    // identifier in both programs, the others are matched by name. The variables of its blocks
+    // get slots past all of those, which later parts reuse.
+    void link(const Program &part, size_t shared_atoms);
 };
 
 class OLRuntime
 {
+public:
+    // which machine compiles and runs the scripts
+    enum class Backend
+    {
+        Stack,
+        Registers,
+    };
+    // how the stack machine goes from one instruction to the next
+    enum class Dispatch
+    {
+        // a switch on the type of every instruction, through one shared indirect branch
+        Switch,
+        // Every instruction is translated to the address of its handler once per load, and each
+        // handler ends with its own jump to the next one. Needs labels as values, a GCC and Clang
+        // extension, other compilers use Switch.
+        Threaded,
+    };
+#if defined(__GNUC__) || defined(__clang__)
+    static constexpr bool threaded_dispatch = true;
+#else
+    static constexpr bool threaded_dispatch = false;
+#endif
+
+private:
+    Backend backend = Backend::Stack;
     Program program;
-    std::vector<double> stack;
-    std::vector<double> local_vars;
+    RegisterProgram register_program;
+    // mapped .olc file whose instructions run in place of program.instructions
+    std::shared_ptr<const BytecodeFile> bytecode;
+    // Operands of the stack machine, preallocated for program.stack_size. The top one is kept
+    // out of it while running, stack[0] is never an operand and stack[1] is the bottom one.
+    std::vector<Value> stack;
+    size_t stack_depth = 0;
+    std::vector<Value> local_vars;
+    std::vector<Value> registers;
+    // times each instruction type ran right after another, indexed first * types_count + second
+    bool profiling = false;
+    std::vector<uint64_t> pair_counts;
+    Dispatch dispatch = threaded_dispatch ? Dispatch::Threaded : Dispatch::Switch;
+    // handler address of every instruction of code(), then End's, empty until the next execution
+    // once the program changes
+    std::vector<const void *> handlers;
+    // the handlers of the instantiation of execute_stack() that filled `handlers`, each one has
+    // its own
+    const void *const *handlers_source = nullptr;
+    // whether the stack machine runs code() as machine code, when the platform allows it
+    bool jit = false;
+    // machine code of code(), null until the next execution once the program changes
+    std::shared_ptr<const NativeCode> native;
+    // whether the interpreter hands the loops that run often to NativeTrace
+    bool tracing = false;
+    struct Loop
+    {
+        uint32_t iterations = 0;
+        // recordings that failed, which an iteration leaving the loop makes them do as well
+        uint32_t failures = 0;
+        // the loop stays on the interpreter, its trace failed or stopped fitting its locals
+        bool abandoned = false;
+        std::shared_ptr<const NativeTrace> trace;
+    };
+    // by the instruction of their header, empty until the next execution once the program changes
+    std::vector<Loop> loops;
 
-    void execute();
+    // runs code() from instruction `start` on the stack_depth operands of `stack`, handing the
+    // loops to enter_loop() with `trace`
+    template<bool profile, bool threaded, bool trace = false>
+    void execute_stack(size_t start);
+    // Counts an iteration of the loop at `header`, which the interpreter is jumping back to, and
+    // once it is hot runs the loop from its trace. Returns the instruction to go on from.
+    size_t enter_loop(size_t header);
+    void execute_registers();
+
+    [[nodiscard]] std::span<const Instruction> code() const;
+    // copies the instructions of a mapped file into the program, so more can be appended
+    void detach_bytecode();
+    void run_bytecode(std::shared_ptr<const BytecodeFile> file);
+    // optimizes `ast` in place and compiles it, its nodes are in `arena` or, without one, on the
+    // heap
+    void load(std::vector<ASTNode *> &ast, AstArena *arena);
 
 public:
     OLRuntime() = default;
+    explicit OLRuntime(Backend backend);
+    explicit OLRuntime(Program program);
+    // runs `registers` on the register machine, `program` holds its variables
+    OLRuntime(Program program, RegisterProgram registers);
 
-    ~OLRuntime() = default;
+    ~OLRuntime();
 
     void run(const std::string &source);
+    // lexes and parses the top-level units of `source` on up to `threads` threads, the tree is
+    // then compiled like the one of run()
+    void run_parallel(const std::string &source, size_t threads);
+    // runs a script straight from a memory mapping of the file
+    void run_file(const std::string &path);
+    // runs a script read from `fd` in chunks of `chunk_size` bytes
+    void run_stream(int fd, size_t chunk_size = 64 * 1024);
+    // replaces the program with the one of a .olc file and runs it from the mapping
+    void run_bytecode(const std::string &path);
+    // Runs the script at `source_path` from the .olc file at `cache_path` when that file was
+    // compiled from the same source, otherwise compiles the script and writes the file first.
+    void run_cached(const std::string &source_path, const std::string &cache_path);
+    // writes the loaded program to a .olc file for run_bytecode()
+    void save_bytecode(const std::string &path, std::string_view source) const;
+    // runs the loaded program from its first instruction
+    void execute();
+
+    // Counts the pairs of instructions that run one after the other on the stack machine from
+    // the next execution on. The superinstructions of peephole() are picked from these counts.
+    void set_profiling(bool enabled);
+    [[nodiscard]] uint64_t pair_count(Instruction::Type first, Instruction::Type second) const;
+    void set_dispatch(Dispatch kind);
+    // Compiles the program to machine code from the next execution on, see NativeCode. Profiling
+    // keeps it on the interpreter, as do platforms without a JIT.
+    void set_jit(bool enabled);
+    // Records the loops the stack machine interprets into traces once they ran often, and runs
+    // them as machine code from then on, see trace.h. Profiling keeps them on the interpreter, as
+    // do platforms without a JIT.
+    void set_tracing(bool enabled);
 
+    // value of the last expression statement as a number, see Value::to_number()
     [[nodiscard]] std::optional<double> getLastValue() const;
+    // value of the last expression statement, booleans and null included
+    [[nodiscard]] std::optional<Value> last_result() const;
 };
 } // namespace OLRuntime
\ No newline at end of file
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string_view>
+
+// Byte-scanning kernels used by the lexer to skip whitespace, comments and string bodies.
+// Every kernel has a scalar version and, on x86-64, SSE2 and AVX2 versions picked at runtime.
+namespace Scan {
+enum class Isa
+{
+    Scalar,
+    SSE2,
+    AVX2,
+};
+
+// best instruction set supported by the running CPU
+Isa detect_isa();
+Isa active_isa();
+// overrides the detected instruction set, used to compare the implementations
+void set_isa(Isa);
+
+// position of the first byte at or after `from` that is not whitespace, or source.size()
+size_t skip_whitespace(std::string_view source, size_t from);
+// position of the first `a` or `b` at or after `from`, or source.size()
+size_t find_either(std::string_view source, size_t from, char a, char b);
+inline size_t find(const std::string_view source, const size_t from, const char c)
+{
+    return find_either(source, from, c, c);
+}
+
+struct Newlines
+{
+    size_t count = 0;
+    // position of the last newline, only meaningful when count > 0
+    size_t last = 0;
+};
+// newlines in the range [from, to)
+Newlines count_newlines(std::string_view source, size_t from, size_t to);
+} // namespace Scan
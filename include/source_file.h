@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Read-only memory mapping of a source file, lets the lexer run over the file without copying it
+class SourceFile
+{
+    const char *data = nullptr;
+    size_t size = 0;
+
+public:
+    explicit SourceFile(const std::string &path);
+    ~SourceFile();
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+
+    [[nodiscard]] std::string_view text() const { return {data, size}; }
+};
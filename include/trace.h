@@ -0,0 +1,69 @@
+#pragma once
+
+#include "runtime.h"
+
+#include <optional>
+#include <span>
+#include <vector>
+
+// One iteration of a loop of the stack machine as the interpreter would run it from its header,
+// back to the jump that closes it: a linear list of operations in SSA form, each one referring to
+// earlier ones by index. The branches it took became guards, which leave the loop for the
+// interpreter when the next iterations go another way. Every value of a trace is a number.
+struct TraceOp
+{
+    enum class Kind : uint8_t
+    {
+        // removed by a pass
+        Nop,
+        // the value of local `slot` when the iteration starts, which has to be a number
+        Local,
+        // `number`
+        Number,
+        // a op b
+        Add,
+        Sub,
+        Mul,
+        Div,
+        // goes on when (a == b) is `equal`, otherwise leaves the loop for instruction `slot`
+        Guard,
+        // local `slot` = a
+        Store,
+    } kind = Kind::Nop;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    bool equal = false;
+    size_t slot = 0;
+    double number = 0;
+
+    [[nodiscard]] bool is_arithmetic() const
+    {
+        return kind == Kind::Add || kind == Kind::Sub || kind == Kind::Mul || kind == Kind::Div;
+    }
+};
+
+struct Trace
+{
+    // instruction the loop starts at, the target of the jump back
+    size_t header = 0;
+    std::vector<TraceOp> ops;
+};
+
+// Records the iteration of the loop at `header` that would start with `locals`, without running
+// it. Fails on paths that leave the loop, enter another one or get too long, and on operands that
+// are not numbers, except for the comparisons branches test.
+std::optional<Trace> record_trace(std::span<const OLRuntime::Instruction> instructions,
+                                  size_t header, std::span<const OLRuntime::Value> locals);
+
+// Computes the arithmetic on numbers while recording would, and drops the guards that always hold.
+void fold_constants(Trace &trace);
+
+// Reads of a local that was not stored yet all get its first read, whose type is checked once
+// before the loop, and a guard testing what an earlier one did is dropped.
+void eliminate_redundant_guards(Trace &trace);
+
+// Removes the values that no guard or store depends on.
+void eliminate_dead_ops(Trace &trace);
+
+// Runs the passes above in an order where each one feeds the next.
+void optimize_trace(Trace &trace);
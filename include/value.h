@@ -0,0 +1,193 @@
+#pragma once
+
+#include <bit>
+#include <cassert>
+#include <cstdint>
+
+namespace OLRuntime {
+// A value of the language in one 64-bit word, NaN-boxed. Numbers are stored as their double,
+// the other kinds in the negative quiet NaNs whose bits 48 to 50 hold a nonzero tag, a range no
+// arithmetic on numbers ever produces:
+// - Integer: a signed 32-bit integer in the low bits
+// - Boolean: 0 or 1 in the low bit
+// - Null
+// - Pointer: a heap pointer in the low 48 bits
+// The word is held as a double so numbers stay in floating-point registers, and arithmetic on
+// them costs a single comparison of the result on top of the operation.
+class Value
+{
+public:
+    enum class Tag : uint64_t
+    {
+        Number,
+        Integer,
+        Boolean,
+        Null,
+        Pointer,
+    };
+
+private:
+    // sign, exponent and quiet bit of the NaNs holding the other kinds
+    static constexpr uint64_t boxed = 0xFFF8'0000'0000'0000;
+    static constexpr int tag_shift = 48;
+    static constexpr uint64_t payload_mask = (uint64_t{1} << tag_shift) - 1;
+    static constexpr uint64_t canonical_nan = 0x7FF8'0000'0000'0000;
+
+    double word = 0;
+
+    static constexpr Value from_bits(const uint64_t bits)
+    {
+        Value value;
+        value.word = std::bit_cast<double>(bits);
+        return value;
+    }
+    [[nodiscard]] constexpr uint64_t bits() const { return std::bit_cast<uint64_t>(word); }
+    static constexpr Value tagged(const Tag tag, const uint64_t payload)
+    {
+        return from_bits(boxed | static_cast<uint64_t>(tag) << tag_shift | payload);
+    }
+
+public:
+    // raw_bits() of the numbers are below it, of the other kinds at or above it
+    static constexpr uint64_t first_tagged = boxed | uint64_t{1} << tag_shift;
+
+    // the number 0
+    constexpr Value() = default;
+
+    static constexpr Value number(const double number)
+    {
+        // a NaN from elsewhere could carry any payload, including a tag
+        return from_bits(number != number ? canonical_nan : std::bit_cast<uint64_t>(number));
+    }
+    // Result of arithmetic on numbers, boxed without the check of number(): their NaNs have no
+    // payload, and the NaNs the operations create have none either.
+    static constexpr Value computed(const double number)
+    {
+        Value value;
+        value.word = number;
+        assert(value.is_number());
+        return value;
+    }
+    static constexpr Value integer(const int32_t integer)
+    {
+        return tagged(Tag::Integer, static_cast<uint32_t>(integer));
+    }
+    static constexpr Value boolean(const bool boolean) { return tagged(Tag::Boolean, boolean); }
+    static constexpr Value null() { return tagged(Tag::Null, 0); }
+    static Value pointer(const void *pointer)
+    {
+        const auto address = reinterpret_cast<uintptr_t>(pointer);
+        assert((address & ~payload_mask) == 0);
+        return tagged(Tag::Pointer, address);
+    }
+    // the value of a word from raw_bits(), which must come from a Value
+    static constexpr Value from_raw_bits(const uint64_t bits) { return from_bits(bits); }
+
+    [[nodiscard]] constexpr bool is_number() const { return bits() < first_tagged; }
+    // Whether the value is a number other than NaN, checked without leaving the floating-point
+    // registers. A false one can still be the number NaN.
+    [[nodiscard]] constexpr bool is_ordered() const { return word == word; }
+    // the word read as a double, the number itself for numbers and a NaN for the other kinds
+    [[nodiscard]] constexpr double word_as_number() const { return word; }
+    [[nodiscard]] constexpr Tag tag() const
+    {
+        return is_number() ? Tag::Number : static_cast<Tag>((bits() >> tag_shift) & 7);
+    }
+
+    [[nodiscard]] constexpr double as_number() const
+    {
+        assert(is_number());
+        return word;
+    }
+    [[nodiscard]] constexpr int32_t as_integer() const
+    {
+        assert(tag() == Tag::Integer);
+        return static_cast<int32_t>(static_cast<uint32_t>(bits()));
+    }
+    [[nodiscard]] constexpr bool as_boolean() const
+    {
+        assert(tag() == Tag::Boolean);
+        return (bits() & 1) != 0;
+    }
+    [[nodiscard]] void *as_pointer() const
+    {
+        assert(tag() == Tag::Pointer);
+        return reinterpret_cast<void *>(bits() & payload_mask);
+    }
+    [[nodiscard]] constexpr uint64_t raw_bits() const { return bits(); }
+
+    // integers as doubles, booleans as 0 or 1, null as 0 and pointers as NaN
+    [[nodiscard]] constexpr double to_number() const
+    {
+        if (is_ordered()) [[likely]]
+            return word;
+        switch (tag()) {
+        case Tag::Integer:
+            return as_integer();
+        case Tag::Boolean:
+            return as_boolean() ? 1 : 0;
+        case Tag::Null:
+            return 0;
+        default:
+            return std::bit_cast<double>(canonical_nan);
+        }
+    }
+    // whether a condition on the value fails: 0, false and null, not NaN
+    [[nodiscard]] constexpr bool is_falsy() const
+    {
+        if (word == 0)
+            return true;
+        if (is_ordered()) [[likely]]
+            return false;
+        switch (tag()) {
+        case Tag::Integer:
+            return as_integer() == 0;
+        case Tag::Boolean:
+            return !as_boolean();
+        case Tag::Null:
+            return true;
+        default:
+            return false;
+        }
+    }
+    // == of the language: numbers and integers by their numeric value, other kinds by identity
+    static constexpr bool equals(const Value a, const Value b)
+    {
+        if (a.word == b.word)
+            return true;
+        if (a.is_ordered() && b.is_ordered()) [[likely]]
+            return false;
+        const auto numeric = [](const Value value) {
+            return value.is_number() || value.tag() == Tag::Integer;
+        };
+        if (numeric(a) && numeric(b))
+            return a.to_number() == b.to_number();
+        return a.bits() == b.bits();
+    }
+
+    // the same word, unlike equals() a NaN is the same as itself and 1 is not the integer 1
+    constexpr bool operator==(const Value &other) const { return bits() == other.bits(); }
+};
+static_assert(sizeof(Value) == sizeof(double));
+
+// `operation` on the numeric values of `a` and `b`. Numbers are used as they are: an operand of
+// another kind is NaN as a double, so only a NaN result needs a second look.
+template<typename Operation>
+constexpr Value arithmetic(const Value a, const Value b, const Operation operation)
+{
+    const auto result = operation(a.word_as_number(), b.word_as_number());
+    if (result == result) [[likely]]
+        return Value::computed(result);
+    return Value::computed(operation(a.to_number(), b.to_number()));
+}
+
+// with a number as the right operand, as in the superinstructions taking a constant
+template<typename Operation>
+constexpr Value arithmetic(const Value a, const double b, const Operation operation)
+{
+    const auto result = operation(a.word_as_number(), b);
+    if (result == result) [[likely]]
+        return Value::computed(result);
+    return Value::computed(operation(a.to_number(), b));
+}
+} // namespace OLRuntime
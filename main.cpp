@@ -1,7 +1,42 @@
+#include "runtime.h"
+
 #include <iostream>
+#include <exception>
+#include <string_view>
 
-int main()
+// ObjectsScript [--jit] [--trace] <script>: runs the script and prints the value of its last
+// expression
+int main(const int argc, char **argv)
 {
-    std::cout << "Hello, World!" << std::endl;
+    auto jit = false;
+    auto tracing = false;
+    const char *path = nullptr;
+    auto scripts = 0;
+    for (int i = 1; i < argc; i++) {
+        if (std::string_view(argv[i]) == "--jit") {
+            jit = true;
+        } else if (std::string_view(argv[i]) == "--trace") {
+            tracing = true;
+        } else {
+            path = argv[i];
+            scripts++;
+        }
+    }
+    if (scripts != 1) {
+        std::cerr << "usage: " << argv[0] << " [--jit] [--trace] <script>" << std::endl;
+        return 1;
+    }
+
+    OLRuntime::OLRuntime runtime;
+    runtime.set_jit(jit);
+    runtime.set_tracing(tracing);
+    try {
+        runtime.run_file(path);
+    } catch (const std::exception &error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+    if (const auto value = runtime.getLastValue(); value.has_value())
+        std::cout << *value << std::endl;
     return 0;
 }
@@ -3,7 +3,8 @@
 #include <cassert>
 #include <utility>
 
-bool operator==(const std::vector<ASTNode *> &left, const std::vector<ASTNode *> &right)
+template<typename List>
+static bool equal_nodes(const List &left, const List &right)
 {
     if (left.size() != right.size())
         return false;
@@ -14,10 +15,67 @@ bool operator==(const std::vector<ASTNode *> &left, const std::vector<ASTNode *>
     return true;
 }
 
+bool operator==(const std::vector<ASTNode *> &left, const std::vector<ASTNode *> &right)
+{
+    return equal_nodes(left, right);
+}
+
+bool operator==(const NodeList &left, const NodeList &right)
+{
+    return equal_nodes(left, right);
+}
+
+// Nodes are deleted from a worklist drained by the outermost destructor, so tearing down a deep
+// tree does not recurse: nested destructors only hand their children to the running loop.
+static thread_local std::vector<ASTNode *> *pending_deletes = nullptr;
+
+static void drain(std::vector<ASTNode *> &pending)
+{
+    pending_deletes = &pending;
+    while (!pending.empty()) {
+        const auto next = pending.back();
+        pending.pop_back();
+        delete next;
+    }
+    pending_deletes = nullptr;
+}
+
+static void release(ASTNode *node)
+{
+    if (node == nullptr)
+        return;
+    if (pending_deletes != nullptr) {
+        pending_deletes->push_back(node);
+        return;
+    }
+    std::vector pending{node};
+    drain(pending);
+}
+
 void destroy_ast(const std::vector<ASTNode *> &ast)
 {
-    for (auto &node : ast)
-        delete node;
+    std::vector pending(ast.rbegin(), ast.rend());
+    drain(pending);
+}
+
+// tokens built outside of a lexer with an atom table are interned on first use
+static uint32_t atom_of(const Token &token, OLRuntime::Program &program)
+{
+    return token.atom != Token::no_atom ? token.atom : program.atoms.intern(token.text());
+}
+
+std::optional<OLRuntime::Value> literal_value(const Token::Type type)
+{
+    switch (type) {
+    case Token::Type::True:
+        return OLRuntime::Value::boolean(true);
+    case Token::Type::False:
+        return OLRuntime::Value::boolean(false);
+    case Token::Type::Null:
+        return OLRuntime::Value::null();
+    default:
+        return std::nullopt;
+    }
 }
 
 SingleNode::SingleNode(Token token)
@@ -32,19 +90,31 @@ void SingleNode::compile(OLRuntime::Program &program) const
         program.instructions.push_back(
         {
             .type = OLRuntime::Instruction::Type::LoadNumber,
-            .data = {.number = {std::stod(token.value)}},
+            .data = {.number = {std::stod(std::string(token.text()))}},
         });
     }
     break;
     case Token::Type::Identifier: {
-        assert(program.local_vars.contains(token.value));
+        const auto atom = atom_of(token, program);
+        if (program.separate && !program.is_declared(atom))
+            program.declare_import(atom);
+        assert(program.is_declared(atom));
         program.instructions.push_back(
         {
             .type = OLRuntime::Instruction::Type::LoadLocal,
-            .data = {.index = program.local_vars.at(token.value)},
+            .data = {.index = program.local_vars[atom]},
         });
     }
     break;
+    case Token::Type::True:
+    case Token::Type::False:
+    case Token::Type::Null:
+        program.instructions.push_back(
+        {
+            .type = OLRuntime::Instruction::Type::LoadValue,
+            .data = {.value = literal_value(token.type)->raw_bits()},
+        });
+        break;
     default:
         throw std::runtime_error("Unimplemented method!");
     }
@@ -61,8 +131,9 @@ VarDeclaration::VarDeclaration(Token name)
 }
 void VarDeclaration::compile(OLRuntime::Program &program) const
 {
-    assert(!program.local_vars.contains(name.value));
-    program.local_vars.insert({name.value, {program.local_vars.size()}});
+    const auto atom = atom_of(name, program);
+    assert(!program.is_declared_in_scope(atom));
+    program.declare(atom);
 }
 bool VarDeclaration::operator==(const ASTNode &other) const
 {
@@ -79,27 +150,38 @@ BinaryExpression::BinaryExpression(ASTNode *left, ASTNode *right, Token op)
 }
 BinaryExpression::~BinaryExpression()
 {
-    delete left;
-    delete right;
-}
-void BinaryExpression::compile(OLRuntime::Program &program) const
-{
-    if (op.type == Token::Type::Equals) {
-        right->compile(program);
-        left->compile(program);
-        if (left->type == Type::VarDeclaration) {
-            const auto name = dynamic_cast<VarDeclaration *>(left)->name.value;
-            program.instructions.push_back(
-            {
-                .type = OLRuntime::Instruction::Type::StoreLocal,
-                .data = {.index = program.local_vars[name]},
-            });
-        }
-        return;
+    release(left);
+    release(right);
+}
+// emits the instruction of the operator once both operands are on the stack, an assignment
+// whose value is an operand, as in a = b = 3, leaves it there
+static void compile_operator(
+    const BinaryExpression &expression, OLRuntime::Program &program, const bool keep_value)
+{
+    switch (expression.op.type) {
+    case Token::Type::Equals: {
+        // a declared target gets its slot once the value is compiled
+        if (expression.left->type == ASTNode::Type::VarDeclaration)
+            expression.left->compile(program);
+        const Token *name;
+        if (expression.left->type == ASTNode::Type::VarDeclaration)
+            name = &static_cast<const VarDeclaration *>(expression.left)->name;
+        else if (expression.left->type == ASTNode::Type::SingleNode)
+            name = &static_cast<const SingleNode *>(expression.left)->token;
+        else
+            throw std::runtime_error("Unimplemented method!");
+        const auto atom = atom_of(*name, program);
+        if (program.separate && !program.is_declared(atom))
+            program.declare_import(atom);
+        assert(program.is_declared(atom));
+        program.instructions.push_back(
+        {
+            .type = keep_value ? OLRuntime::Instruction::Type::StoreLocalKeep
+                               : OLRuntime::Instruction::Type::StoreLocal,
+            .data = {.index = program.local_vars[atom]},
+        });
     }
-    left->compile(program);
-    right->compile(program);
-    switch (op.type) {
+    break;
     case Token::Type::Plus:
         program.instructions.push_back(
         {
@@ -128,12 +210,83 @@ void BinaryExpression::compile(OLRuntime::Program &program) const
         throw std::runtime_error("Unimplemented method!");
     }
 }
+
+// operand compiled first, an assignment only compiles its value
+static const ASTNode *first_operand(const BinaryExpression &expression)
+{
+    return expression.op.type == Token::Type::Equals ? expression.right : expression.left;
+}
+
+// Compiles nested expressions in post-order with an explicit stack of the binary expressions
+// whose operands are still being compiled, leaves are compiled as soon as they are reached.
+static void compile_expression(const ASTNode *node, OLRuntime::Program &program)
+{
+    struct Pending
+    {
+        const BinaryExpression *expression;
+        bool second_operand_started;
+    };
+    // shared by the calls on this thread, so compiling does not allocate once it has grown
+    static thread_local std::vector<Pending> stack;
+    const auto base = stack.size();
+    try {
+        while (true) {
+            // the type is checked first, so the hot loop can skip dynamic_cast
+            while (true) {
+                if (node->type == ASTNode::Type::ParenthesizedExpression) {
+                    node = static_cast<const ParenthesizedExpression *>(node)->expression;
+                } else if (node->type == ASTNode::Type::BinaryExpression) {
+                    const auto expression = static_cast<const BinaryExpression *>(node);
+                    // the target of an assignment is not an operand
+                    stack.push_back({expression, expression->op.type == Token::Type::Equals});
+                    node = first_operand(*expression);
+                } else {
+                    break;
+                }
+            }
+            node->compile(program);
+
+            // climb to the closest expression that still misses its second operand
+            while (true) {
+                if (stack.size() == base)
+                    return;
+                auto &pending = stack.back();
+                if (!pending.second_operand_started) {
+                    pending.second_operand_started = true;
+                    node = pending.expression->right;
+                    break;
+                }
+                const auto expression = pending.expression;
+                stack.pop_back();
+                compile_operator(*expression, program, stack.size() != base);
+            }
+        }
+    } catch (...) {
+        stack.resize(base);
+        throw;
+    }
+}
+
+void BinaryExpression::compile(OLRuntime::Program &program) const
+{
+    compile_expression(this, program);
+}
 bool BinaryExpression::operator==(const ASTNode &other) const
 {
-    if (type != other.type)
-        return false;
-    auto &expr = dynamic_cast<const BinaryExpression &>(other);
-    return *left == *expr.left && *right == *expr.right && op == expr.op;
+    // left operands are compared in a loop, chains like a + b + c nest to the left
+    const ASTNode *node = this;
+    const ASTNode *other_node = &other;
+    while (node->type == Type::BinaryExpression) {
+        if (other_node->type != node->type)
+            return false;
+        const auto &expr = static_cast<const BinaryExpression &>(*node);
+        const auto &other_expr = static_cast<const BinaryExpression &>(*other_node);
+        if (expr.op != other_expr.op || *expr.right != *other_expr.right)
+            return false;
+        node = expr.left;
+        other_node = other_expr.left;
+    }
+    return *node == *other_node;
 }
 
 UnaryExpression::UnaryExpression(Token op, ASTNode *operand)
@@ -145,7 +298,7 @@ UnaryExpression::UnaryExpression(Token op, ASTNode *operand)
 }
 UnaryExpression::~UnaryExpression()
 {
-    delete operand;
+    release(operand);
 }
 bool UnaryExpression::operator==(const ASTNode &other) const
 {
@@ -161,9 +314,13 @@ ParenthesizedExpression::ParenthesizedExpression(ASTNode *expression)
     type = Type::ParenthesizedExpression;
     assert(expression != nullptr);
 }
+void ParenthesizedExpression::compile(OLRuntime::Program &program) const
+{
+    compile_expression(this, program);
+}
 ParenthesizedExpression::~ParenthesizedExpression()
 {
-    delete expression;
+    release(expression);
 }
 bool ParenthesizedExpression::operator==(const ASTNode &other) const
 {
@@ -173,7 +330,7 @@ bool ParenthesizedExpression::operator==(const ASTNode &other) const
     return *expression == *expr.expression;
 }
 
-FunctionDeclaration::FunctionDeclaration(Token name, std::vector<ASTNode *> args, ASTNode *body)
+FunctionDeclaration::FunctionDeclaration(Token name, NodeList args, ASTNode *body)
     : name(std::move(name))
       , args(std::move(args))
       , body(body)
@@ -183,9 +340,9 @@ FunctionDeclaration::FunctionDeclaration(Token name, std::vector<ASTNode *> args
 }
 FunctionDeclaration::~FunctionDeclaration()
 {
-    delete body;
+    release(body);
     for (auto &arg : args)
-        delete arg;
+        release(arg);
 }
 bool FunctionDeclaration::operator==(const ASTNode &other) const
 {
@@ -195,7 +352,7 @@ bool FunctionDeclaration::operator==(const ASTNode &other) const
     return name == func.name && args == func.args && *body == *func.body;
 }
 
-ScopeBlock::ScopeBlock(std::vector<ASTNode *> statements)
+ScopeBlock::ScopeBlock(NodeList statements)
     : statements(std::move(statements))
 {
     type = Type::ScopeBlock;
@@ -203,7 +360,19 @@ ScopeBlock::ScopeBlock(std::vector<ASTNode *> statements)
 ScopeBlock::~ScopeBlock()
 {
     for (auto &statement : statements)
-        delete statement;
+        release(statement);
+}
+void ScopeBlock::compile(OLRuntime::Program &program) const
+{
+    program.open_scope();
+    try {
+        for (const auto &statement : statements)
+            statement->compile(program);
+    } catch (...) {
+        program.close_scope();
+        throw;
+    }
+    program.close_scope();
 }
 bool ScopeBlock::operator==(const ASTNode &other) const
 {
@@ -228,10 +397,10 @@ IfStatement::IfStatement(ASTNode *condition, ASTNode *body)
 }
 IfStatement::~IfStatement()
 {
-    delete condition;
-    delete body;
+    release(condition);
+    release(body);
     if (else_body.has_value())
-        delete else_body.value();
+        release(else_body.value());
 }
 bool IfStatement::operator==(const ASTNode &other) const
 {
@@ -253,8 +422,8 @@ WhileStatement::WhileStatement(ASTNode *condition, ASTNode *body)
 }
 WhileStatement::~WhileStatement()
 {
-    delete condition;
-    delete body;
+    release(condition);
+    release(body);
 }
 bool WhileStatement::operator==(const ASTNode &other) const
 {
@@ -272,8 +441,8 @@ ArrayAccess::ArrayAccess(ASTNode *array, ASTNode *index)
 }
 ArrayAccess::~ArrayAccess()
 {
-    delete array;
-    delete index;
+    release(array);
+    release(index);
 }
 bool ArrayAccess::operator==(const ASTNode &other) const
 {
@@ -292,8 +461,8 @@ FieldAccess::FieldAccess(ASTNode *record, ASTNode *field)
 }
 FieldAccess::~FieldAccess()
 {
-    delete record;
-    delete field;
+    release(record);
+    release(field);
 }
 bool FieldAccess::operator==(const ASTNode &other) const
 {
@@ -303,7 +472,7 @@ bool FieldAccess::operator==(const ASTNode &other) const
     return *record == *field_access.record && *field == *field_access.field;
 }
 
-FunctionCall::FunctionCall(ASTNode *name, std::vector<ASTNode *> args)
+FunctionCall::FunctionCall(ASTNode *name, NodeList args)
     : name(name)
       , args(std::move(args))
 {
@@ -311,9 +480,9 @@ FunctionCall::FunctionCall(ASTNode *name, std::vector<ASTNode *> args)
 }
 FunctionCall::~FunctionCall()
 {
-    delete name;
+    release(name);
     for (const auto &arg : args)
-        delete arg;
+        release(arg);
 }
 bool FunctionCall::operator==(const ASTNode &other) const
 {
@@ -330,7 +499,7 @@ Constructor::Constructor(ASTNode *record)
 }
 Constructor::~Constructor()
 {
-    delete record;
+    release(record);
 }
 bool Constructor::operator==(const ASTNode &other) const
 {
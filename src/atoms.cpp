@@ -0,0 +1,27 @@
+#include "atoms.h"
+
+uint32_t AtomTable::intern(const std::string_view name)
+{
+    if (const auto it = ids.find(name); it != ids.end())
+        return it->second;
+    const auto atom = static_cast<uint32_t>(names.size());
+    // deque elements never move, so the key can view the stored name
+    ids.emplace(names.emplace_back(name), atom);
+    return atom;
+}
+
+AtomTable::AtomTable(const AtomTable &other)
+{
+    *this = other;
+}
+
+AtomTable &AtomTable::operator=(const AtomTable &other)
+{
+    if (this == &other)
+        return *this;
+    names.clear();
+    ids.clear();
+    for (const auto &name : other.names)
+        intern(name);
+    return *this;
+}
@@ -0,0 +1,185 @@
+#include "bytecode_file.h"
+
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+
+static constexpr char bytecode_magic[4] = {'O', 'L', 'C', '\0'};
+static constexpr uint32_t byte_order_mark = 0x01020304;
+// sections start at multiples of this, the instructions are read in place from the mapping
+static constexpr size_t section_alignment = alignof(std::max_align_t);
+
+uint64_t hash_text(const std::string_view text)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    constexpr uint64_t prime = 0x100000001b3;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= text.size(); i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, text.data() + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < text.size(); i++)
+        hash = (hash ^ static_cast<unsigned char>(text[i])) * prime;
+    return hash;
+}
+
+static size_t align(const size_t offset)
+{
+    return (offset + section_alignment - 1) / section_alignment * section_alignment;
+}
+
+template<typename T>
+static void put(std::string &buffer, const size_t offset, const T &value)
+{
+    std::memcpy(buffer.data() + offset, &value, sizeof(T));
+}
+
+void write_bytecode(const std::string &path, const OLRuntime::Program &program,
+                    const uint64_t source_hash)
+{
+    BytecodeHeader header{};
+    std::memcpy(header.magic, bytecode_magic, sizeof(header.magic));
+    header.version = bytecode_version;
+    header.instruction_size = sizeof(OLRuntime::Instruction);
+    header.byte_order = byte_order_mark;
+    header.source_hash = source_hash;
+    header.locals_count = program.locals_count;
+    header.frame_size = program.frame_size;
+    header.stack_size = program.stack_size;
+    header.instructions_offset = align(sizeof(BytecodeHeader));
+    header.instructions_count = program.instructions.size();
+    header.symbols_offset = align(header.instructions_offset
+                                  + program.instructions.size() * sizeof(OLRuntime::Instruction));
+    header.symbols_count = program.atoms.size();
+    header.names_offset = header.symbols_offset + program.atoms.size() * sizeof(BytecodeSymbol);
+    for (uint32_t atom = 0; atom < program.atoms.size(); atom++)
+        header.names_size += program.atoms.name(atom).size();
+
+    std::string buffer(header.names_offset + header.names_size, '\0');
+    std::memcpy(buffer.data() + header.instructions_offset, program.instructions.data(),
+                program.instructions.size() * sizeof(OLRuntime::Instruction));
+    uint64_t name_offset = 0;
+    for (uint32_t atom = 0; atom < program.atoms.size(); atom++) {
+        const auto name = program.atoms.name(atom);
+        const BytecodeSymbol symbol{
+            .slot = program.is_declared(atom) ? program.local_vars[atom] : program.no_slot,
+            .name_offset = name_offset,
+            .name_size = name.size(),
+        };
+        put(buffer, header.symbols_offset + atom * sizeof(BytecodeSymbol), symbol);
+        std::memcpy(buffer.data() + header.names_offset + name_offset, name.data(), name.size());
+        name_offset += name.size();
+    }
+    header.checksum = hash_text(std::string_view(buffer).substr(sizeof(BytecodeHeader)));
+    put(buffer, 0, header);
+
+    const auto temporary = path + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        if (!out.flush())
+            throw std::runtime_error("Failed to write '" + temporary + "'");
+    }
+    std::filesystem::rename(temporary, path);
+}
+
+static std::runtime_error invalid(const std::string &path, const std::string &reason)
+{
+    return std::runtime_error("Invalid bytecode file '" + path + "': " + reason);
+}
+
+// whether `value` is one a compiler emits LoadValue for
+static bool is_literal(const OLRuntime::Value value)
+{
+    return value == OLRuntime::Value::boolean(false) || value == OLRuntime::Value::boolean(true)
+           || value == OLRuntime::Value::null();
+}
+
+// whether [offset, offset + count * size) lies within a file of `file_size` bytes
+static bool fits(const uint64_t offset, const uint64_t count, const uint64_t size,
+                 const uint64_t file_size)
+{
+    return offset <= file_size && count <= (file_size - offset) / size;
+}
+
+BytecodeFile::BytecodeFile(const std::string &path)
+    : file(path)
+{
+    const auto bytes = file.text();
+    if (bytes.size() < sizeof(BytecodeHeader))
+        throw invalid(path, "truncated header");
+    header = reinterpret_cast<const BytecodeHeader *>(bytes.data());
+    if (std::memcmp(header->magic, bytecode_magic, sizeof(header->magic)) != 0)
+        throw invalid(path, "not a bytecode file");
+    if (header->version != bytecode_version)
+        throw invalid(path, "version " + std::to_string(header->version) + ", expected "
+                            + std::to_string(bytecode_version));
+    if (header->instruction_size != sizeof(OLRuntime::Instruction)
+        || header->byte_order != byte_order_mark)
+        throw invalid(path, "written by an incompatible build");
+    if (header->instructions_offset % section_alignment != 0
+        || header->symbols_offset % alignof(BytecodeSymbol) != 0
+        || !fits(header->instructions_offset, header->instructions_count,
+                 sizeof(OLRuntime::Instruction), bytes.size())
+        || !fits(header->symbols_offset, header->symbols_count, sizeof(BytecodeSymbol),
+                 bytes.size())
+        || !fits(header->names_offset, header->names_size, 1, bytes.size()))
+        throw invalid(path, "sections out of bounds");
+    if (hash_text(bytes.substr(sizeof(BytecodeHeader))) != header->checksum)
+        throw invalid(path, "checksum mismatch");
+    // the machine trusts the compiler with slots and jump targets, so a file has to as well
+    if (header->locals_count > header->frame_size)
+        throw invalid(path, "frame smaller than its variables");
+    for (const auto &instruction : instructions()) {
+        if (static_cast<size_t>(instruction.type) >= OLRuntime::Instruction::types_count
+            || (instruction.uses_local() && instruction.data.index >= header->frame_size)
+            || (instruction.is_jump() && instruction.data.index > header->instructions_count))
+            throw invalid(path, "instruction out of bounds");
+        // the machine boxes them unchecked, a NaN payload could make one look like another kind
+        if (instruction.uses_number()
+            && !OLRuntime::Value::from_raw_bits(std::bit_cast<uint64_t>(instruction.data.number))
+                    .is_number())
+            throw invalid(path, "number operand is not a number");
+        if (instruction.type == OLRuntime::Instruction::Type::LoadValue
+            && !is_literal(OLRuntime::Value::from_raw_bits(instruction.data.value)))
+            throw invalid(path, "value operand is not a boolean or null");
+    }
+    const auto depth = OLRuntime::max_stack_depth(instructions());
+    if (!depth.has_value() || *depth > header->stack_size)
+        throw invalid(path, "operand stack out of bounds");
+}
+
+std::span<const OLRuntime::Instruction> BytecodeFile::instructions() const
+{
+    const auto base = file.text().data() + header->instructions_offset;
+    return {reinterpret_cast<const OLRuntime::Instruction *>(base), header->instructions_count};
+}
+
+void BytecodeFile::load_symbols(OLRuntime::Program &program) const
+{
+    const auto bytes = file.text();
+    const auto symbols =
+        reinterpret_cast<const BytecodeSymbol *>(bytes.data() + header->symbols_offset);
+    for (size_t i = 0; i < header->symbols_count; i++) {
+        const auto &symbol = symbols[i];
+        if (symbol.name_offset > header->names_size
+            || symbol.name_size > header->names_size - symbol.name_offset)
+            throw std::runtime_error("Invalid bytecode file: symbol name out of bounds");
+        const auto atom = program.atoms.intern(
+            bytes.substr(header->names_offset + symbol.name_offset, symbol.name_size));
+        if (symbol.slot == OLRuntime::Program::no_slot)
+            continue;
+        if (symbol.slot >= header->locals_count)
+            throw std::runtime_error("Invalid bytecode file: symbol slot out of bounds");
+        if (atom >= program.local_vars.size())
+            program.local_vars.resize(atom + 1, OLRuntime::Program::no_slot);
+        program.local_vars[atom] = symbol.slot;
+    }
+    program.locals_count = header->locals_count;
+    program.frame_size = header->frame_size;
+    program.stack_size = header->stack_size;
+}
@@ -0,0 +1,606 @@
+#include "flat_ast.h"
+#include "ast_arena.h"
+#include "parser.h"
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using Index = FlatAst::Index;
+
+static Index add_token(FlatAst &flat, const Token &token)
+{
+    const auto text = token.text();
+    flat.token_pool.push_back({
+        .type = token.type,
+        .line = static_cast<uint32_t>(token.line),
+        .column = static_cast<uint32_t>(token.column),
+        .atom = token.atom,
+        .text_offset = static_cast<uint32_t>(flat.text.size()),
+        .text_size = static_cast<uint32_t>(text.size()),
+    });
+    flat.text.append(text);
+    return static_cast<Index>(flat.token_pool.size() - 1);
+}
+
+static Index add_node(
+    FlatAst &flat,
+    const ASTNode::Type type,
+    const Index token,
+    const Index first = FlatAst::none,
+    const Index second = FlatAst::none,
+    const Index third = FlatAst::none)
+{
+    flat.types.push_back(type);
+    flat.tokens.push_back(token);
+    flat.first.push_back(first);
+    flat.second.push_back(second);
+    flat.third.push_back(third);
+    return static_cast<Index>(flat.types.size() - 1);
+}
+
+static Index add_list(FlatAst &flat, const std::span<const Index> elements)
+{
+    const auto offset = static_cast<Index>(flat.lists.size());
+    flat.lists.push_back(static_cast<Index>(elements.size()));
+    flat.lists.insert(flat.lists.end(), elements.begin(), elements.end());
+    return offset;
+}
+
+namespace {
+// a child node, a list of them, or a missing child flattened to none
+struct Child
+{
+    const ASTNode *node = nullptr;
+    const NodeList *list = nullptr;
+};
+
+// node whose children are being flattened, in the order of its slots
+struct Pending
+{
+    const ASTNode *node;
+    Child children[3];
+    size_t children_count = 0;
+    size_t next = 0;
+    Index slots[3] = {FlatAst::none, FlatAst::none, FlatAst::none};
+    // where the elements of the list being flattened start in the shared element stack
+    size_t elements_start = 0;
+    size_t element = 0;
+
+    explicit Pending(const ASTNode *node)
+        : node(node)
+    {
+        const auto add = [this](const ASTNode *child) { children[children_count++].node = child; };
+        const auto add_nodes = [this](const NodeList &list) {
+            children[children_count++].list = &list;
+        };
+        switch (node->type) {
+        case ASTNode::Type::SingleNode:
+        case ASTNode::Type::VarDeclaration:
+            break;
+        case ASTNode::Type::BinaryExpression: {
+            const auto expression = dynamic_cast<const BinaryExpression *>(node);
+            add(expression->left);
+            add(expression->right);
+        }
+        break;
+        case ASTNode::Type::UnaryExpression:
+            add(dynamic_cast<const UnaryExpression *>(node)->operand);
+            break;
+        case ASTNode::Type::ParenthesizedExpression:
+            add(dynamic_cast<const ParenthesizedExpression *>(node)->expression);
+            break;
+        case ASTNode::Type::FunctionDeclaration: {
+            const auto function = dynamic_cast<const FunctionDeclaration *>(node);
+            add_nodes(function->args);
+            add(function->body);
+        }
+        break;
+        case ASTNode::Type::FunctionCall: {
+            const auto call = dynamic_cast<const FunctionCall *>(node);
+            add(call->name);
+            add_nodes(call->args);
+        }
+        break;
+        case ASTNode::Type::ScopeBlock:
+            add_nodes(dynamic_cast<const ScopeBlock *>(node)->statements);
+            break;
+        case ASTNode::Type::IfStatement: {
+            const auto statement = dynamic_cast<const IfStatement *>(node);
+            add(statement->condition);
+            add(statement->body);
+            add(statement->else_body.value_or(nullptr));
+        }
+        break;
+        case ASTNode::Type::WhileStatement: {
+            const auto statement = dynamic_cast<const WhileStatement *>(node);
+            add(statement->condition);
+            add(statement->body);
+        }
+        break;
+        case ASTNode::Type::ArrayAccess: {
+            const auto access = dynamic_cast<const ArrayAccess *>(node);
+            add(access->array);
+            add(access->index);
+        }
+        break;
+        case ASTNode::Type::FieldAccess: {
+            const auto access = dynamic_cast<const FieldAccess *>(node);
+            add(access->record);
+            add(access->field);
+        }
+        break;
+        case ASTNode::Type::Constructor:
+            add(dynamic_cast<const Constructor *>(node)->record);
+            break;
+        default:
+            throw std::runtime_error(
+                "Unhandled node: " + std::to_string(static_cast<int>(node->type)));
+        }
+    }
+};
+} // namespace
+
+// the token slot of `node`, added once its children are flattened
+static Index token_of(FlatAst &flat, const ASTNode *node)
+{
+    switch (node->type) {
+    case ASTNode::Type::SingleNode:
+        return add_token(flat, dynamic_cast<const SingleNode *>(node)->token);
+    case ASTNode::Type::VarDeclaration:
+        return add_token(flat, dynamic_cast<const VarDeclaration *>(node)->name);
+    case ASTNode::Type::BinaryExpression:
+        return add_token(flat, dynamic_cast<const BinaryExpression *>(node)->op);
+    case ASTNode::Type::UnaryExpression:
+        return add_token(flat, dynamic_cast<const UnaryExpression *>(node)->op);
+    case ASTNode::Type::FunctionDeclaration:
+        return add_token(flat, dynamic_cast<const FunctionDeclaration *>(node)->name);
+    default:
+        return FlatAst::none;
+    }
+}
+
+// Appends the nodes of `root` children first, each list right after its elements. The nodes
+// waiting for their children are kept on an explicit stack, so the depth of the tree is not
+// bounded by the call stack.
+static Index flatten_node(FlatAst &flat, const ASTNode *root)
+{
+    std::vector<Pending> stack;
+    std::vector<Index> elements;
+    stack.emplace_back(root);
+    for (;;) {
+        auto &pending = stack.back();
+        if (pending.next == pending.children_count) {
+            const auto node = add_node(flat, pending.node->type, token_of(flat, pending.node),
+                                       pending.slots[0], pending.slots[1], pending.slots[2]);
+            stack.pop_back();
+            if (stack.empty())
+                return node;
+            auto &parent = stack.back();
+            if (parent.children[parent.next].list != nullptr) {
+                elements.push_back(node);
+                parent.element++;
+            } else {
+                parent.slots[parent.next++] = node;
+            }
+            continue;
+        }
+        const auto &child = pending.children[pending.next];
+        if (child.list != nullptr) {
+            if (pending.element == 0)
+                pending.elements_start = elements.size();
+            if (pending.element < child.list->size()) {
+                stack.emplace_back((*child.list)[pending.element]);
+                continue;
+            }
+            pending.slots[pending.next++] = add_list(
+                flat, std::span(elements).subspan(pending.elements_start));
+            elements.resize(pending.elements_start);
+            pending.element = 0;
+        } else if (child.node == nullptr) {
+            pending.next++;
+        } else {
+            stack.emplace_back(child.node);
+        }
+    }
+}
+
+FlatAst flatten(const std::vector<ASTNode *> &ast)
+{
+    FlatAst flat;
+    for (const auto &node : ast)
+        flat.roots.push_back(flatten_node(flat, node));
+    return flat;
+}
+
+FlatAst parse_flat(Lexer &lexer)
+{
+    AstArena arena;
+    return flatten(parse(lexer, arena));
+}
+
+Token FlatAst::token(const Index node) const
+{
+    const auto &token = token_pool[tokens[node]];
+    Token result{token.type};
+    result.line = token.line;
+    result.column = token.column;
+    result.atom = token.atom;
+    result.span = std::string_view(text).substr(token.text_offset, token.text_size);
+    return result;
+}
+
+static uint32_t atom_of(const FlatAst &flat, const Index node, OLRuntime::Program &program)
+{
+    const auto &token = flat.token_pool[flat.tokens[node]];
+    if (token.atom != Token::no_atom)
+        return token.atom;
+    return program.atoms.intern(std::string_view(flat.text).substr(token.text_offset, token.text_size));
+}
+
+using OLRuntime::Instruction;
+
+// the node types and tokens compile() has code for
+static void check_compilable(const FlatAst &flat)
+{
+    for (Index node = 0; node < flat.size(); node++) {
+        switch (flat.types[node]) {
+        case ASTNode::Type::SingleNode: {
+            const auto type = flat.token_pool[flat.tokens[node]].type;
+            if (type != Token::Type::Number && type != Token::Type::Identifier
+                && !literal_value(type).has_value())
+                throw std::runtime_error("Unimplemented method!");
+        }
+        break;
+        case ASTNode::Type::BinaryExpression:
+            switch (flat.token_pool[flat.tokens[node]].type) {
+            case Token::Type::Equals: {
+                const auto target = flat.types[flat.first[node]];
+                if (target != ASTNode::Type::VarDeclaration && target != ASTNode::Type::SingleNode)
+                    throw std::runtime_error("Unimplemented method!");
+            }
+            break;
+            case Token::Type::Plus:
+            case Token::Type::Minus:
+            case Token::Type::Asterisk:
+            case Token::Type::Slash:
+            case Token::Type::LooseEquality:
+            case Token::Type::StrictEquality:
+                break;
+            default:
+                throw std::runtime_error("Unimplemented method!");
+            }
+            break;
+        case ASTNode::Type::VarDeclaration:
+        case ASTNode::Type::ParenthesizedExpression:
+        case ASTNode::Type::ScopeBlock:
+        case ASTNode::Type::IfStatement:
+        case ASTNode::Type::WhileStatement:
+            break;
+        default:
+            throw std::runtime_error("Unimplemented method!");
+        }
+    }
+}
+
+namespace {
+// Compiles the statements of a FlatAst to instructions of the stack machine. Expression
+// statements of the top level and its blocks leave their value on the stack, as compile() of the
+// pointer tree does. The ones in the body of an if or while store it in a slot instead, read once
+// the statement is done, so branches and iterations leave the stack as they found it.
+class FlatCompiler
+{
+    const FlatAst &flat;
+    OLRuntime::Program &program;
+    // values the statements outside of if and while left on the stack
+    size_t values = 0;
+    // if and while statements being compiled
+    size_t nesting = 0;
+    // stores to the result slot of the outermost if or while, which gets its slot at the end
+    std::vector<size_t> result_stores;
+
+    [[nodiscard]] Token::Type op(const Index node) const
+    {
+        return flat.token_pool[flat.tokens[node]].type;
+    }
+
+    [[nodiscard]] bool is_assignment(const Index node) const
+    {
+        return flat.types[node] == ASTNode::Type::BinaryExpression && op(node) == Token::Type::Equals;
+    }
+
+    [[nodiscard]] bool is_operator(const Index node) const
+    {
+        return flat.types[node] == ASTNode::Type::BinaryExpression && op(node) != Token::Type::Equals;
+    }
+
+    [[nodiscard]] Index unparenthesized(Index node) const
+    {
+        while (flat.types[node] == ASTNode::Type::ParenthesizedExpression)
+            node = flat.first[node];
+        return node;
+    }
+
+    size_t emit(const Instruction::Type type, const size_t index = 0)
+    {
+        program.instructions.push_back({.type = type, .data = {.index = index}});
+        return program.instructions.size() - 1;
+    }
+
+    size_t slot_of(const Index node)
+    {
+        const auto atom = atom_of(flat, node, program);
+        if (flat.types[node] == ASTNode::Type::VarDeclaration) {
+            assert(!program.is_declared_in_scope(atom));
+            return program.declare(atom);
+        }
+        assert(program.is_declared(atom));
+        return program.local_vars[atom];
+    }
+
+    bool has_value_statement(Index node) const;
+    void compile_leaf(Index node);
+    void compile_chain(Index node);
+    void compile_assignment(Index node, Instruction::Type store);
+    void compile_operand(Index node);
+    void compile_control(Index node);
+
+public:
+    FlatCompiler(const FlatAst &flat, OLRuntime::Program &program)
+        : flat(flat)
+          , program(program)
+    {}
+
+    void compile_statement(Index node);
+};
+} // namespace
+
+void FlatCompiler::compile_leaf(const Index node)
+{
+    if (op(node) == Token::Type::Number) {
+        const auto token = flat.token(node);
+        program.instructions.push_back(
+        {
+            .type = Instruction::Type::LoadNumber,
+            .data = {.number = {std::stod(std::string(token.text()))}},
+        });
+        return;
+    }
+    if (const auto value = literal_value(op(node)); value.has_value()) {
+        program.instructions.push_back(
+        {
+            .type = Instruction::Type::LoadValue,
+            .data = {.value = value->raw_bits()},
+        });
+        return;
+    }
+    emit(Instruction::Type::LoadLocal, slot_of(node));
+}
+
+// emits a left-nested chain of operators like a + b + c without recursing into the chain
+void FlatCompiler::compile_chain(const Index node)
+{
+    std::vector chain{node};
+    while (is_operator(flat.first[chain.back()]))
+        chain.push_back(flat.first[chain.back()]);
+    compile_operand(flat.first[chain.back()]);
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        compile_operand(flat.second[*it]);
+        switch (op(*it)) {
+        case Token::Type::Plus:
+            emit(Instruction::Type::Add);
+            break;
+        case Token::Type::Minus:
+            emit(Instruction::Type::Sub);
+            break;
+        case Token::Type::Asterisk:
+            emit(Instruction::Type::Mul);
+            break;
+        case Token::Type::Slash:
+            emit(Instruction::Type::Div);
+            break;
+        default:
+            emit(Instruction::Type::Equal);
+        }
+    }
+}
+
+// compiles the value of an assignment and stores it with `store`
+void FlatCompiler::compile_assignment(const Index node, const Instruction::Type store)
+{
+    compile_operand(flat.second[node]);
+    emit(store, slot_of(flat.first[node]));
+}
+
+// compiles a node whose value is used, an assignment like the b = 3 of a = b = 3 keeps it
+void FlatCompiler::compile_operand(Index node)
+{
+    node = unparenthesized(node);
+    switch (flat.types[node]) {
+    case ASTNode::Type::SingleNode:
+        return compile_leaf(node);
+    case ASTNode::Type::BinaryExpression:
+        if (is_assignment(node))
+            return compile_assignment(node, Instruction::Type::StoreLocalKeep);
+        return compile_chain(node);
+    default:
+        // a declaration, block or statement has no value
+        throw std::runtime_error("Unimplemented method!");
+    }
+}
+
+// whether an expression statement in the bodies of an if or while leaves a value
+bool FlatCompiler::has_value_statement(const Index node) const
+{
+    switch (flat.types[node]) {
+    case ASTNode::Type::VarDeclaration:
+        return false;
+    case ASTNode::Type::ScopeBlock:
+        return std::ranges::any_of(
+            flat.list(flat.first[node]), [&](const Index child) { return has_value_statement(child); });
+    case ASTNode::Type::IfStatement:
+        return has_value_statement(flat.second[node])
+               || (flat.third[node] != FlatAst::none && has_value_statement(flat.third[node]));
+    case ASTNode::Type::WhileStatement:
+        return has_value_statement(flat.second[node]);
+    default:
+        return !is_assignment(unparenthesized(node));
+    }
+}
+
+void FlatCompiler::compile_control(const Index node)
+{
+    const auto header = program.instructions.size();
+    compile_operand(flat.first[node]);
+    const auto skip = emit(Instruction::Type::JumpIfFalse);
+    compile_statement(flat.second[node]);
+    if (flat.types[node] == ASTNode::Type::WhileStatement) {
+        emit(Instruction::Type::Jump, header);
+    } else if (flat.third[node] != FlatAst::none) {
+        const auto end = emit(Instruction::Type::Jump);
+        program.instructions[skip].data.index = program.instructions.size();
+        compile_statement(flat.third[node]);
+        program.instructions[end].data.index = program.instructions.size();
+        return;
+    }
+    program.instructions[skip].data.index = program.instructions.size();
+}
+
+void FlatCompiler::compile_statement(Index node)
+{
+    switch (flat.types[node]) {
+    case ASTNode::Type::VarDeclaration: {
+        const auto slot = slot_of(node);
+        // a loop declares the variables of its body anew on every iteration
+        if (nesting > 0) {
+            program.instructions.push_back(
+                {.type = Instruction::Type::LoadNumber, .data = {.number = 0}});
+            emit(Instruction::Type::StoreLocal, slot);
+        }
+    }
+        return;
+    case ASTNode::Type::ScopeBlock:
+        program.open_scope();
+        try {
+            for (const auto &statement : flat.list(flat.first[node]))
+                compile_statement(statement);
+        } catch (...) {
+            program.close_scope();
+            throw;
+        }
+        program.close_scope();
+        return;
+    case ASTNode::Type::IfStatement:
+    case ASTNode::Type::WhileStatement: {
+        if (nesting > 0 || !has_value_statement(node)) {
+            nesting++;
+            compile_control(node);
+            nesting--;
+            return;
+        }
+        // the statements before keep the result when no value statement of the bodies runs
+        result_stores.clear();
+        if (values > 0)
+            values--;
+        else
+            program.instructions.push_back(
+                {.type = Instruction::Type::LoadNumber, .data = {.number = 0}});
+        result_stores.push_back(emit(Instruction::Type::StoreLocal));
+        nesting++;
+        compile_control(node);
+        nesting--;
+        // no slot is in use past the frame while the statement runs
+        const auto slot = program.frame_size++;
+        for (const auto store : result_stores)
+            program.instructions[store].data.index = slot;
+        emit(Instruction::Type::LoadLocal, slot);
+        values++;
+    }
+        return;
+    default:
+        break;
+    }
+    node = unparenthesized(node);
+    if (is_assignment(node))
+        return compile_assignment(node, Instruction::Type::StoreLocal);
+    compile_operand(node);
+    if (nesting == 0)
+        values++;
+    else
+        result_stores.push_back(emit(Instruction::Type::StoreLocal));
+}
+
+void FlatAst::compile(OLRuntime::Program &program) const
+{
+    check_compilable(*this);
+    FlatCompiler compiler(*this, program);
+    for (const auto &root : roots)
+        compiler.compile_statement(root);
+}
+
+static bool is_list(const ASTNode::Type type, const int slot)
+{
+    return (type == ASTNode::Type::FunctionDeclaration && slot == 0)
+           || (type == ASTNode::Type::FunctionCall && slot == 1)
+           || (type == ASTNode::Type::ScopeBlock && slot == 0);
+}
+
+static bool equal_nodes(const FlatAst &left, Index i, const FlatAst &right, Index j);
+
+static bool equal_slots(
+    const ASTNode::Type type,
+    const FlatAst &left,
+    const Index i,
+    const FlatAst &right,
+    const Index j,
+    const int slot)
+{
+    if (i == FlatAst::none || j == FlatAst::none)
+        return i == j;
+    if (!is_list(type, slot))
+        return equal_nodes(left, i, right, j);
+    const auto left_list = left.list(i);
+    const auto right_list = right.list(j);
+    if (left_list.size() != right_list.size())
+        return false;
+    for (size_t k = 0; k < left_list.size(); k++) {
+        if (!equal_nodes(left, left_list[k], right, right_list[k]))
+            return false;
+    }
+    return true;
+}
+
+static bool equal_nodes(const FlatAst &left, Index i, const FlatAst &right, Index j)
+{
+    for (;;) {
+        if (left.types[i] != right.types[j])
+            return false;
+        if ((left.tokens[i] == FlatAst::none) != (right.tokens[j] == FlatAst::none))
+            return false;
+        if (left.tokens[i] != FlatAst::none && left.token(i) != right.token(j))
+            return false;
+        const auto type = left.types[i];
+        if (type != ASTNode::Type::BinaryExpression)
+            return equal_slots(type, left, left.first[i], right, right.first[j], 0)
+                   && equal_slots(type, left, left.second[i], right, right.second[j], 1)
+                   && equal_slots(type, left, left.third[i], right, right.third[j], 2);
+        // left operands are compared in a loop, chains like a + b + c nest to the left
+        if (!equal_nodes(left, left.second[i], right, right.second[j]))
+            return false;
+        i = left.first[i];
+        j = right.first[j];
+    }
+}
+
+bool FlatAst::operator==(const FlatAst &other) const
+{
+    if (roots.size() != other.roots.size())
+        return false;
+    for (size_t i = 0; i < roots.size(); i++) {
+        if (!equal_nodes(*this, roots[i], other, other.roots[i]))
+            return false;
+    }
+    return true;
+}
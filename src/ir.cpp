@@ -0,0 +1,830 @@
+#include "ir.h"
+
+#include <cassert>
+#include <string>
+
+using OLRuntime::Instruction;
+
+// tokens built outside of a lexer with an atom table are interned on first use
+static uint32_t atom_of(const Token &token, OLRuntime::Program &program)
+{
+    return token.atom != Token::no_atom ? token.atom : program.atoms.intern(token.text());
+}
+
+// name of the variable an assignment or a declaration writes to
+static const Token &target_of(const ASTNode *target)
+{
+    if (target->type == ASTNode::Type::VarDeclaration)
+        return static_cast<const VarDeclaration *>(target)->name;
+    if (target->type == ASTNode::Type::SingleNode)
+        return static_cast<const SingleNode *>(target)->token;
+    throw std::runtime_error("Unimplemented method!");
+}
+
+namespace {
+// Builds SSA form straight from the structured statements: the value of every variable is
+// tracked while walking them, branches are merged with phis at their join, and loop headers get
+// a phi for each variable the loop assigns, completed once the body is built.
+class IrBuilder
+{
+    // variables are indexed by atom + 1, index 0 is the value of the last expression statement
+    static constexpr uint32_t result_variable = 0;
+    static constexpr uint32_t none = IrProgram::none;
+
+    OLRuntime::Program &program;
+    IrProgram ir;
+    uint32_t current = 0;
+    std::vector<uint32_t> definitions;
+    // the value of each variable before the program assigns it, created once in the entry block
+    std::vector<uint32_t> initial;
+    // variables with a slot below this one were declared by programs that ran before
+    size_t slots_before;
+
+    // values of the variables hidden by the declarations of the blocks being built
+    std::vector<std::pair<uint32_t, uint32_t>> hidden;
+
+    struct Frame
+    {
+        const ASTNode *node;
+        size_t step = 0;
+        size_t hidden_count = 0;
+        std::vector<uint32_t> saved;
+        uint32_t blocks[2] = {0, 0};
+        std::vector<std::pair<uint32_t, uint32_t>> phis;
+    };
+    std::vector<Frame> frames;
+
+    struct Pending
+    {
+        const BinaryExpression *expression;
+        uint32_t first;
+        bool second_operand_started;
+    };
+    std::vector<Pending> pending;
+
+    uint32_t add(IrValue value, const uint32_t block)
+    {
+        value.block = block;
+        ir.values.push_back(std::move(value));
+        const auto index = static_cast<uint32_t>(ir.values.size() - 1);
+        ir.blocks[block].values.push_back(index);
+        return index;
+    }
+
+    uint32_t add_block()
+    {
+        ir.blocks.emplace_back();
+        return static_cast<uint32_t>(ir.blocks.size() - 1);
+    }
+
+    void jump(const uint32_t from, const uint32_t to)
+    {
+        ir.blocks[from].end = IrBlock::End::Jump;
+        ir.blocks[from].targets[0] = to;
+        ir.blocks[to].predecessors.push_back(from);
+    }
+
+    void branch(const uint32_t from, const uint32_t condition, const uint32_t then,
+                const uint32_t otherwise)
+    {
+        auto &block = ir.blocks[from];
+        block.end = IrBlock::End::Branch;
+        block.condition = condition;
+        block.targets[0] = then;
+        block.targets[1] = otherwise;
+        ir.blocks[then].predecessors.push_back(from);
+        ir.blocks[otherwise].predecessors.push_back(from);
+    }
+
+    static uint32_t variable_of(const uint32_t atom) { return atom + 1; }
+
+    uint32_t initial_value(const uint32_t variable)
+    {
+        if (variable >= initial.size())
+            initial.resize(variable + 1, none);
+        if (initial[variable] != none)
+            return initial[variable];
+        const auto atom = variable - 1;
+        if (variable != result_variable && program.is_declared(atom)
+            && program.local_vars[atom] < slots_before) {
+            initial[variable] = add({.op = IrValue::Op::Load, .slot = program.local_vars[atom]}, 0);
+        } else {
+            initial[variable] = add({.op = IrValue::Op::Undefined}, 0);
+        }
+        return initial[variable];
+    }
+
+    static uint32_t lookup(const std::vector<uint32_t> &values, const uint32_t variable)
+    {
+        return variable < values.size() ? values[variable] : none;
+    }
+
+    uint32_t read(const uint32_t variable)
+    {
+        const auto value = lookup(definitions, variable);
+        return value != none ? value : initial_value(variable);
+    }
+
+    void write(const uint32_t variable, const uint32_t value)
+    {
+        if (variable >= definitions.size())
+            definitions.resize(variable + 1, none);
+        definitions[variable] = value;
+    }
+
+    // A declaration in a block starts a variable of its own, undefined until assigned, which
+    // hides the one outside of it until the block ends. Declaring it again in the same block
+    // changes nothing.
+    void declare(const uint32_t atom)
+    {
+        if (program.is_declared_in_scope(atom))
+            return;
+        const auto variable = variable_of(atom);
+        const auto hides = program.is_declared(atom);
+        if (!program.scopes.empty())
+            hidden.emplace_back(variable, lookup(definitions, variable));
+        program.declare(atom);
+        if (hides)
+            write(variable, add({.op = IrValue::Op::Undefined}, current));
+    }
+
+    void open_scope(Frame &frame)
+    {
+        program.open_scope();
+        frame.hidden_count = hidden.size();
+    }
+
+    void close_scope(const Frame &frame)
+    {
+        program.close_scope();
+        while (hidden.size() > frame.hidden_count) {
+            const auto [variable, value] = hidden.back();
+            write(variable, value);
+            hidden.pop_back();
+        }
+    }
+
+    uint32_t assign(const ASTNode *target, const uint32_t value)
+    {
+        const auto atom = atom_of(target_of(target), program);
+        if (target->type == ASTNode::Type::VarDeclaration)
+            declare(atom);
+        assert(program.is_declared(atom));
+        write(variable_of(atom), value);
+        return value;
+    }
+
+    uint32_t build_leaf(const ASTNode *node);
+    uint32_t build_operator(const BinaryExpression &expression, uint32_t first, uint32_t second);
+    uint32_t build_value(const ASTNode *node);
+    void build_simple_statement(const ASTNode *node);
+    void build_frames(size_t base);
+    void merge(const std::vector<uint32_t> &then, uint32_t join);
+    std::vector<uint32_t> assigned_variables(const WhileStatement &loop);
+
+public:
+    explicit IrBuilder(OLRuntime::Program &program)
+        : program(program)
+          , slots_before(program.locals_count)
+    {
+        add_block();
+    }
+
+    void build_statement(const ASTNode *node);
+    IrProgram finish();
+};
+} // namespace
+
+uint32_t IrBuilder::build_leaf(const ASTNode *node)
+{
+    if (node->type != ASTNode::Type::SingleNode)
+        throw std::runtime_error("Unimplemented method!");
+    const auto &token = static_cast<const SingleNode *>(node)->token;
+    switch (token.type) {
+    case Token::Type::Number:
+        return add({.op = IrValue::Op::Number, .number = std::stod(std::string(token.text()))},
+                   current);
+    case Token::Type::True:
+    case Token::Type::False:
+    case Token::Type::Null:
+        return add({.op = IrValue::Op::Literal, .bits = literal_value(token.type)->raw_bits()},
+                   current);
+    case Token::Type::Identifier: {
+        const auto atom = atom_of(token, program);
+        assert(program.is_declared(atom));
+        return read(variable_of(atom));
+    }
+    default:
+        throw std::runtime_error("Unimplemented method!");
+    }
+}
+
+uint32_t IrBuilder::build_operator(const BinaryExpression &expression, const uint32_t first,
+                                   const uint32_t second)
+{
+    IrValue::Op op;
+    switch (expression.op.type) {
+    case Token::Type::Equals:
+        return assign(expression.left, first);
+    case Token::Type::Plus:
+        op = IrValue::Op::Add;
+        break;
+    case Token::Type::Minus:
+        op = IrValue::Op::Sub;
+        break;
+    case Token::Type::Asterisk:
+        op = IrValue::Op::Mul;
+        break;
+    case Token::Type::Slash:
+        op = IrValue::Op::Div;
+        break;
+    case Token::Type::LooseEquality:
+    case Token::Type::StrictEquality:
+        op = IrValue::Op::Equal;
+        break;
+    default:
+        throw std::runtime_error("Unimplemented method!");
+    }
+    return add({.op = op, .operands = {first, second}}, current);
+}
+
+// Builds an expression in post-order with an explicit stack of the binary expressions whose
+// operands are still being built, like the stack compiler. Returns the value of the expression.
+uint32_t IrBuilder::build_value(const ASTNode *node)
+{
+    const auto base = pending.size();
+    try {
+        while (true) {
+            while (true) {
+                if (node->type == ASTNode::Type::ParenthesizedExpression) {
+                    node = static_cast<const ParenthesizedExpression *>(node)->expression;
+                } else if (node->type == ASTNode::Type::BinaryExpression) {
+                    const auto expression = static_cast<const BinaryExpression *>(node);
+                    // the target of an assignment is not an operand
+                    const auto assignment = expression->op.type == Token::Type::Equals;
+                    pending.push_back({expression, none, assignment});
+                    node = assignment ? expression->right : expression->left;
+                } else {
+                    break;
+                }
+            }
+            auto value = build_leaf(node);
+
+            while (true) {
+                if (pending.size() == base)
+                    return value;
+                auto &top = pending.back();
+                if (!top.second_operand_started) {
+                    top.second_operand_started = true;
+                    top.first = value;
+                    node = top.expression->right;
+                    break;
+                }
+                const auto first = top.first != none ? top.first : value;
+                value = build_operator(*top.expression, first, value);
+                pending.pop_back();
+            }
+        }
+    } catch (...) {
+        pending.resize(base);
+        throw;
+    }
+}
+
+void IrBuilder::build_simple_statement(const ASTNode *node)
+{
+    if (node->type == ASTNode::Type::VarDeclaration) {
+        declare(atom_of(static_cast<const VarDeclaration *>(node)->name, program));
+        return;
+    }
+    const auto value = build_value(node);
+    const auto assignment = node->type == ASTNode::Type::BinaryExpression
+                            && static_cast<const BinaryExpression *>(node)->op.type
+                            == Token::Type::Equals;
+    if (!assignment)
+        write(result_variable, value);
+}
+
+// joins the variables of the branch that ended with `then` and of the current one in `join`
+void IrBuilder::merge(const std::vector<uint32_t> &then, const uint32_t join)
+{
+    const auto count = std::max(then.size(), definitions.size());
+    for (uint32_t variable = 0; variable < count; variable++) {
+        auto from_then = lookup(then, variable);
+        auto from_else = lookup(definitions, variable);
+        if (from_then == from_else)
+            continue;
+        if (from_then == none)
+            from_then = initial_value(variable);
+        if (from_else == none)
+            from_else = initial_value(variable);
+        if (from_then == from_else)
+            write(variable, from_then);
+        else
+            write(variable, add({.op = IrValue::Op::Phi, .operands = {from_then, from_else}}, join));
+    }
+}
+
+// variables a loop may assign, which need a phi in its header
+std::vector<uint32_t> IrBuilder::assigned_variables(const WhileStatement &loop)
+{
+    std::vector<bool> assigned;
+    const auto mark = [&assigned](const uint32_t variable) {
+        if (variable >= assigned.size())
+            assigned.resize(variable + 1);
+        assigned[variable] = true;
+    };
+    // nodes still to visit, with whether they are statements
+    std::vector<std::pair<const ASTNode *, bool>> nodes{{loop.condition, false}, {loop.body, true}};
+    while (!nodes.empty()) {
+        const auto [node, statement] = nodes.back();
+        nodes.pop_back();
+        switch (node->type) {
+        case ASTNode::Type::ScopeBlock:
+            for (const auto &child : static_cast<const ScopeBlock *>(node)->statements)
+                nodes.emplace_back(child, true);
+            break;
+        case ASTNode::Type::IfStatement: {
+            const auto branch = static_cast<const IfStatement *>(node);
+            nodes.emplace_back(branch->condition, false);
+            nodes.emplace_back(branch->body, true);
+            if (branch->else_body.has_value())
+                nodes.emplace_back(*branch->else_body, true);
+        }
+        break;
+        case ASTNode::Type::WhileStatement: {
+            const auto inner = static_cast<const WhileStatement *>(node);
+            nodes.emplace_back(inner->condition, false);
+            nodes.emplace_back(inner->body, true);
+        }
+        break;
+        case ASTNode::Type::ParenthesizedExpression:
+            nodes.emplace_back(static_cast<const ParenthesizedExpression *>(node)->expression,
+                               statement);
+            break;
+        case ASTNode::Type::BinaryExpression: {
+            const auto expression = static_cast<const BinaryExpression *>(node);
+            if (expression->op.type == Token::Type::Equals) {
+                mark(variable_of(atom_of(target_of(expression->left), program)));
+                nodes.emplace_back(expression->right, false);
+                break;
+            }
+            if (statement)
+                mark(result_variable);
+            nodes.emplace_back(expression->left, false);
+            nodes.emplace_back(expression->right, false);
+        }
+        break;
+        case ASTNode::Type::VarDeclaration:
+            break;
+        default:
+            if (statement)
+                mark(result_variable);
+        }
+    }
+    std::vector<uint32_t> variables;
+    for (uint32_t variable = 0; variable < assigned.size(); variable++) {
+        if (assigned[variable])
+            variables.push_back(variable);
+    }
+    return variables;
+}
+
+// Nested statements are built with an explicit stack of frames, each one resumed at its `step`
+// once the statement it pushed is built.
+void IrBuilder::build_statement(const ASTNode *node)
+{
+    const auto base = frames.size();
+    frames.push_back({node});
+    try {
+        build_frames(base);
+    } catch (...) {
+        // blocks left open are closed like they would have been
+        while (frames.size() > base) {
+            if (frames.back().node->type == ASTNode::Type::ScopeBlock)
+                close_scope(frames.back());
+            frames.pop_back();
+        }
+        throw;
+    }
+}
+
+void IrBuilder::build_frames(const size_t base)
+{
+    while (frames.size() > base) {
+        auto &frame = frames.back();
+        switch (frame.node->type) {
+        case ASTNode::Type::ScopeBlock: {
+            const auto &statements = static_cast<const ScopeBlock *>(frame.node)->statements;
+            // a frame is visited right after it is pushed, so every block on the stack is open
+            if (frame.step == 0)
+                open_scope(frame);
+            if (frame.step == statements.size()) {
+                close_scope(frame);
+                frames.pop_back();
+                break;
+            }
+            const auto next = statements[frame.step++];
+            frames.push_back({next});
+        }
+        break;
+        case ASTNode::Type::IfStatement: {
+            const auto statement = static_cast<const IfStatement *>(frame.node);
+            if (frame.step == 0) {
+                const auto condition = build_value(statement->condition);
+                const auto then = add_block();
+                const auto otherwise = add_block();
+                branch(current, condition, then, otherwise);
+                frame.saved = definitions;
+                frame.blocks[0] = otherwise;
+                frame.step = 1;
+                current = then;
+                frames.push_back({statement->body});
+            } else if (frame.step == 1) {
+                // blocks[1] is where the then branch ended, `saved` holds its variables
+                frame.blocks[1] = current;
+                std::swap(frame.saved, definitions);
+                current = frame.blocks[0];
+                frame.step = 2;
+                if (statement->else_body.has_value())
+                    frames.push_back({*statement->else_body});
+            } else {
+                const auto join = add_block();
+                jump(frame.blocks[1], join);
+                jump(current, join);
+                current = join;
+                merge(frame.saved, join);
+                frames.pop_back();
+            }
+        }
+        break;
+        case ASTNode::Type::WhileStatement: {
+            const auto statement = static_cast<const WhileStatement *>(frame.node);
+            if (frame.step == 0) {
+                const auto header = add_block();
+                jump(current, header);
+                for (const auto variable : assigned_variables(*statement)) {
+                    const auto phi =
+                        add({.op = IrValue::Op::Phi, .operands = {read(variable)}}, header);
+                    write(variable, phi);
+                    frame.phis.emplace_back(variable, phi);
+                }
+                current = header;
+                const auto condition = build_value(statement->condition);
+                const auto body = add_block();
+                const auto exit = add_block();
+                branch(header, condition, body, exit);
+                frame.saved = definitions;
+                frame.blocks[0] = header;
+                frame.blocks[1] = exit;
+                frame.step = 1;
+                current = body;
+                frames.push_back({statement->body});
+            } else {
+                jump(current, frame.blocks[0]);
+                for (const auto &[variable, phi] : frame.phis) {
+                    const auto value = read(variable);
+                    ir.values[phi].operands.push_back(value);
+                }
+                definitions = std::move(frame.saved);
+                current = frame.blocks[1];
+                frames.pop_back();
+            }
+        }
+        break;
+        default:
+            build_simple_statement(frame.node);
+            frames.pop_back();
+        }
+    }
+}
+
+IrProgram IrBuilder::finish()
+{
+    ir.blocks[current].end = IrBlock::End::Exit;
+    for (uint32_t variable = result_variable + 1; variable < definitions.size(); variable++) {
+        // the variables of blocks are gone once they end
+        if (definitions[variable] != none && program.is_declared(variable - 1))
+            ir.exports.emplace_back(program.local_vars[variable - 1], definitions[variable]);
+    }
+    ir.result = lookup(definitions, result_variable);
+    return std::move(ir);
+}
+
+IrProgram build_ir(const std::vector<ASTNode *> &ast, OLRuntime::Program &program)
+{
+    IrBuilder builder(program);
+    for (const auto &node : ast)
+        builder.build_statement(node);
+    return builder.finish();
+}
+
+namespace {
+class IrLowering
+{
+    static constexpr uint32_t none = IrProgram::none;
+
+    const IrProgram &ir;
+    OLRuntime::Program &program;
+    std::vector<uint32_t> uses;
+    // whether each value is computed where it is used instead of being stored in a slot
+    std::vector<bool> inlined;
+    std::vector<size_t> slots;
+    std::vector<size_t> block_starts;
+    // jumps whose target is the start of a block, patched once every block is placed
+    std::vector<std::pair<size_t, uint32_t>> jumps;
+
+    // the value a chain of copies stands for
+    uint32_t resolve(uint32_t value) const
+    {
+        while (ir.values[value].op == IrValue::Op::Copy)
+            value = ir.values[value].operands[0];
+        return value;
+    }
+
+    void emit(const Instruction::Type type, const size_t index = 0)
+    {
+        program.instructions.push_back({.type = type, .data = {.index = index}});
+    }
+
+    void count_use(uint32_t value, uint32_t block);
+    void analyze();
+    std::vector<uint32_t> layout() const;
+    void emit_value(uint32_t value, bool compute);
+    void emit_block(uint32_t block, uint32_t next);
+
+public:
+    IrLowering(const IrProgram &ir, OLRuntime::Program &program)
+        : ir(ir)
+          , program(program)
+          , uses(ir.values.size())
+          , inlined(ir.values.size())
+          , slots(ir.values.size(), OLRuntime::Program::no_slot)
+          , block_starts(ir.blocks.size())
+    {}
+
+    void run();
+};
+} // namespace
+
+// `block` is where the use happens, values used once in their own block can stay on the stack
+void IrLowering::count_use(const uint32_t value, const uint32_t block)
+{
+    const auto resolved = resolve(value);
+    if (uses[resolved]++ == 0)
+        inlined[resolved] = ir.values[resolved].block == block;
+    else
+        inlined[resolved] = false;
+}
+
+void IrLowering::analyze()
+{
+    uint32_t exit = 0;
+    for (uint32_t b = 0; b < ir.blocks.size(); b++) {
+        const auto &block = ir.blocks[b];
+        for (const auto value : block.values) {
+            const auto &definition = ir.values[value];
+            if (definition.op == IrValue::Op::Copy)
+                continue;
+            for (size_t i = 0; i < definition.operands.size(); i++) {
+                // the operands of a phi are used at the end of the matching predecessor
+                count_use(definition.operands[i],
+                          definition.op == IrValue::Op::Phi ? block.predecessors[i] : b);
+            }
+        }
+        if (block.end == IrBlock::End::Branch)
+            count_use(block.condition, b);
+        if (block.end == IrBlock::End::Exit)
+            exit = b;
+    }
+    for (const auto &[slot, value] : ir.exports)
+        count_use(value, exit);
+    if (ir.result != none)
+        count_use(ir.result, exit);
+
+    // slots of the variables whose value from before the program is read
+    std::vector<bool> loaded(program.locals_count);
+    for (uint32_t value = 0; value < ir.values.size(); value++) {
+        switch (ir.values[value].op) {
+        case IrValue::Op::Number:
+        case IrValue::Op::Literal:
+        case IrValue::Op::Undefined:
+            inlined[value] = true;
+            break;
+        case IrValue::Op::Load:
+            inlined[value] = true;
+            if (uses[value] > 0)
+                loaded[ir.values[value].slot] = true;
+            break;
+        case IrValue::Op::Phi:
+            inlined[value] = false;
+            break;
+        default: ;
+        }
+    }
+    // a value ending up in a variable lives in the slot of the variable, unless the old value
+    // of the variable is still needed
+    for (const auto &[slot, value] : ir.exports) {
+        const auto resolved = resolve(value);
+        if (!inlined[resolved] && slots[resolved] == OLRuntime::Program::no_slot
+            && !loaded[slot])
+            slots[resolved] = slot;
+    }
+    // the other values only live while the program runs, so later programs reuse their slots
+    auto next_slot = program.locals_count;
+    for (uint32_t value = 0; value < ir.values.size(); value++) {
+        if (!inlined[value] && uses[value] > 0 && slots[value] == OLRuntime::Program::no_slot)
+            slots[value] = next_slot++;
+    }
+    program.frame_size = std::max(program.frame_size, next_slot);
+}
+
+// blocks in reverse post-order, visiting the else branch and the loop exit first so that each
+// then branch and loop body directly follows its condition
+std::vector<uint32_t> IrLowering::layout() const
+{
+    std::vector<uint32_t> order;
+    std::vector<bool> visited(ir.blocks.size());
+    // blocks being visited, with the number of their successors already visited
+    std::vector<std::pair<uint32_t, int>> path{{0, 0}};
+    visited[0] = true;
+    while (!path.empty()) {
+        auto &[b, next] = path.back();
+        const auto &block = ir.blocks[b];
+        const int successors = block.end == IrBlock::End::Branch ? 2
+                               : block.end == IrBlock::End::Jump ? 1
+                               : 0;
+        if (next == successors) {
+            order.push_back(b);
+            path.pop_back();
+            continue;
+        }
+        const auto successor = block.targets[successors - 1 - next++];
+        if (!visited[successor]) {
+            visited[successor] = true;
+            path.emplace_back(successor, 0);
+        }
+    }
+    return {order.rbegin(), order.rend()};
+}
+
+// Emits the instructions leaving `value` on the stack, computing it when `compute` is set or it is
+// inlined, loading it from its slot otherwise. Inlined operands are expanded with an explicit stack.
+void IrLowering::emit_value(const uint32_t value, const bool compute)
+{
+    // values still to emit, with whether their operands are already on the stack
+    std::vector<std::pair<uint32_t, bool>> stack{{resolve(value), false}};
+    auto root = true;
+    while (!stack.empty()) {
+        const auto [current, operands_ready] = stack.back();
+        stack.pop_back();
+        const auto &definition = ir.values[current];
+        const auto computed = operands_ready || (root && compute) || inlined[current];
+        root = false;
+        if (!computed) {
+            assert(slots[current] != OLRuntime::Program::no_slot);
+            emit(Instruction::Type::LoadLocal, slots[current]);
+            continue;
+        }
+        switch (definition.op) {
+        case IrValue::Op::Number:
+            program.instructions.push_back(
+            {
+                .type = Instruction::Type::LoadNumber,
+                .data = {.number = definition.number},
+            });
+            break;
+        case IrValue::Op::Literal:
+            program.instructions.push_back(
+            {
+                .type = Instruction::Type::LoadValue,
+                .data = {.value = definition.bits},
+            });
+            break;
+        case IrValue::Op::Load:
+            emit(Instruction::Type::LoadLocal, definition.slot);
+            break;
+        case IrValue::Op::Undefined:
+            program.instructions.push_back(
+            {
+                .type = Instruction::Type::LoadNumber,
+                .data = {.number = 0},
+            });
+            break;
+        case IrValue::Op::Add:
+        case IrValue::Op::Sub:
+        case IrValue::Op::Mul:
+        case IrValue::Op::Div:
+        case IrValue::Op::Equal:
+            if (!operands_ready) {
+                stack.emplace_back(current, true);
+                stack.emplace_back(resolve(definition.operands[1]), false);
+                stack.emplace_back(resolve(definition.operands[0]), false);
+                break;
+            }
+            emit(definition.op == IrValue::Op::Add   ? Instruction::Type::Add
+                 : definition.op == IrValue::Op::Sub ? Instruction::Type::Sub
+                 : definition.op == IrValue::Op::Mul ? Instruction::Type::Mul
+                 : definition.op == IrValue::Op::Div ? Instruction::Type::Div
+                                                     : Instruction::Type::Equal);
+            break;
+        default:
+            assert(false && "phis and copies are never computed in place");
+        }
+    }
+}
+
+void IrLowering::emit_block(const uint32_t b, const uint32_t next)
+{
+    const auto &block = ir.blocks[b];
+    block_starts[b] = program.instructions.size();
+    for (const auto value : block.values) {
+        const auto &definition = ir.values[value];
+        if (definition.op == IrValue::Op::Phi || definition.op == IrValue::Op::Copy
+            || inlined[value] || uses[value] == 0)
+            continue;
+        emit_value(value, true);
+        emit(Instruction::Type::StoreLocal, slots[value]);
+    }
+
+    switch (block.end) {
+    case IrBlock::End::Jump: {
+        // the phis of the target are assigned together: every value is pushed before the
+        // first one is stored, so a phi can read another one of the same block
+        const auto &target = ir.blocks[block.targets[0]];
+        size_t predecessor = 0;
+        while (target.predecessors[predecessor] != b)
+            predecessor++;
+        std::vector<size_t> stores;
+        for (const auto value : target.values) {
+            const auto &phi = ir.values[value];
+            if (phi.op != IrValue::Op::Phi || uses[value] == 0)
+                continue;
+            const auto incoming = resolve(phi.operands[predecessor]);
+            if (incoming == value)
+                continue;
+            emit_value(incoming, false);
+            stores.push_back(slots[value]);
+        }
+        for (auto slot = stores.rbegin(); slot != stores.rend(); ++slot)
+            emit(Instruction::Type::StoreLocal, *slot);
+        if (block.targets[0] != next) {
+            jumps.emplace_back(program.instructions.size(), block.targets[0]);
+            emit(Instruction::Type::Jump);
+        }
+    }
+    break;
+    case IrBlock::End::Branch:
+        // the builder never makes a branch target with other predecessors, which would need phis
+        assert(ir.blocks[block.targets[0]].predecessors.size() == 1
+               && ir.blocks[block.targets[1]].predecessors.size() == 1);
+        emit_value(block.condition, false);
+        jumps.emplace_back(program.instructions.size(), block.targets[1]);
+        emit(Instruction::Type::JumpIfFalse);
+        if (block.targets[0] != next) {
+            jumps.emplace_back(program.instructions.size(), block.targets[0]);
+            emit(Instruction::Type::Jump);
+        }
+        break;
+    case IrBlock::End::Exit: {
+        // everything is pushed before the first store, the values may read the slots of other
+        // variables as they were when the program started, and the result stays below
+        if (ir.result != none)
+            emit_value(ir.result, false);
+        std::vector<size_t> stores;
+        for (const auto &[slot, value] : ir.exports) {
+            const auto resolved = resolve(value);
+            const auto &definition = ir.values[resolved];
+            if (slots[resolved] == slot
+                || (definition.op == IrValue::Op::Load && definition.slot == slot))
+                continue;
+            emit_value(value, false);
+            stores.push_back(slot);
+        }
+        for (auto slot = stores.rbegin(); slot != stores.rend(); ++slot)
+            emit(Instruction::Type::StoreLocal, *slot);
+        if (next != none) {
+            jumps.emplace_back(program.instructions.size(), none);
+            emit(Instruction::Type::Jump);
+        }
+    }
+    break;
+    }
+}
+
+void IrLowering::run()
+{
+    analyze();
+    const auto order = layout();
+    for (size_t i = 0; i < order.size(); i++)
+        emit_block(order[i], i + 1 < order.size() ? order[i + 1] : none);
+    for (const auto &[instruction, block] : jumps) {
+        program.instructions[instruction].data.index =
+            block == none ? program.instructions.size() : block_starts[block];
+    }
+}
+
+void lower_ir(const IrProgram &ir, OLRuntime::Program &program)
+{
+    IrLowering(ir, program).run();
+}
@@ -0,0 +1,351 @@
+#include "ir_passes.h"
+
+#include <algorithm>
+#include <bit>
+#include <unordered_map>
+
+static constexpr uint32_t none = IrProgram::none;
+
+static uint32_t resolve(const IrProgram &ir, uint32_t value)
+{
+    while (ir.values[value].op == IrValue::Op::Copy)
+        value = ir.values[value].operands[0];
+    return value;
+}
+
+void propagate_copies(IrProgram &ir)
+{
+    // a phi can only become trivial once another one did, so this runs until nothing changes
+    auto changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t value = 0; value < ir.values.size(); value++) {
+            auto &phi = ir.values[value];
+            if (phi.op != IrValue::Op::Phi)
+                continue;
+            auto same = none;
+            auto trivial = true;
+            for (const auto operand : phi.operands) {
+                const auto incoming = resolve(ir, operand);
+                if (incoming == value || incoming == same)
+                    continue;
+                if (same != none) {
+                    trivial = false;
+                    break;
+                }
+                same = incoming;
+            }
+            if (trivial && same != none) {
+                phi.op = IrValue::Op::Copy;
+                phi.operands = {same};
+                changed = true;
+            }
+        }
+    }
+
+    for (auto &value : ir.values) {
+        if (value.op == IrValue::Op::Copy)
+            continue;
+        for (auto &operand : value.operands)
+            operand = resolve(ir, operand);
+    }
+    for (auto &block : ir.blocks) {
+        if (block.end == IrBlock::End::Branch)
+            block.condition = resolve(ir, block.condition);
+    }
+    for (auto &[slot, value] : ir.exports)
+        value = resolve(ir, value);
+    if (ir.result != none)
+        ir.result = resolve(ir, ir.result);
+}
+
+static int successors_count(const IrBlock &block)
+{
+    switch (block.end) {
+    case IrBlock::End::Branch:
+        return 2;
+    case IrBlock::End::Jump:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// the blocks reachable from the entry in reverse post-order
+static std::vector<uint32_t> reverse_post_order(const IrProgram &ir)
+{
+    std::vector<uint32_t> order;
+    std::vector<bool> visited(ir.blocks.size());
+    std::vector<std::pair<uint32_t, int>> path{{0, 0}};
+    visited[0] = true;
+    while (!path.empty()) {
+        auto &[block, next] = path.back();
+        if (next == successors_count(ir.blocks[block])) {
+            order.push_back(block);
+            path.pop_back();
+            continue;
+        }
+        const auto successor = ir.blocks[block].targets[next++];
+        if (!visited[successor]) {
+            visited[successor] = true;
+            path.emplace_back(successor, 0);
+        }
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+// Immediate dominator of every reachable block, `none` for the others and the entry's own,
+// with the iterative algorithm of Cooper, Harvey and Kennedy.
+static std::vector<uint32_t> dominators(const IrProgram &ir, const std::vector<uint32_t> &order)
+{
+    std::vector<uint32_t> position(ir.blocks.size(), none);
+    for (uint32_t i = 0; i < order.size(); i++)
+        position[order[i]] = i;
+    std::vector<uint32_t> idom(ir.blocks.size(), none);
+    idom[0] = 0;
+    const auto intersect = [&](uint32_t a, uint32_t b) {
+        while (a != b) {
+            while (position[a] > position[b])
+                a = idom[a];
+            while (position[b] > position[a])
+                b = idom[b];
+        }
+        return a;
+    };
+    auto changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < order.size(); i++) {
+            const auto block = order[i];
+            auto dominator = none;
+            for (const auto predecessor : ir.blocks[block].predecessors) {
+                if (idom[predecessor] == none)
+                    continue;
+                dominator = dominator == none ? predecessor : intersect(predecessor, dominator);
+            }
+            if (dominator != idom[block]) {
+                idom[block] = dominator;
+                changed = true;
+            }
+        }
+    }
+    idom[0] = none;
+    return idom;
+}
+
+static bool dominates(const std::vector<uint32_t> &idom, const uint32_t a, uint32_t b)
+{
+    while (b != none && b != a)
+        b = idom[b];
+    return b == a;
+}
+
+namespace {
+// what makes two values compute the same thing
+struct ValueKey
+{
+    IrValue::Op op;
+    uint32_t left;
+    uint32_t right;
+    uint64_t bits;
+
+    bool operator==(const ValueKey &) const = default;
+};
+
+struct ValueKeyHash
+{
+    size_t operator()(const ValueKey &key) const
+    {
+        auto hash = std::hash<uint64_t>()(key.bits);
+        hash = hash * 31 + static_cast<size_t>(key.op);
+        hash = hash * 31 + key.left;
+        return hash * 31 + key.right;
+    }
+};
+} // namespace
+
+static ValueKey key_of(const IrValue &value)
+{
+    ValueKey key{value.op, none, none, 0};
+    if (value.op == IrValue::Op::Number)
+        key.bits = std::bit_cast<uint64_t>(value.number);
+    else if (value.op == IrValue::Op::Literal)
+        key.bits = value.bits;
+    else if (value.op == IrValue::Op::Load)
+        key.bits = value.slot;
+    if (!value.operands.empty()) {
+        key.left = value.operands[0];
+        key.right = value.operands[1];
+        const auto commutative = value.op == IrValue::Op::Add || value.op == IrValue::Op::Mul
+                                 || value.op == IrValue::Op::Equal;
+        if (commutative && key.left > key.right)
+            std::swap(key.left, key.right);
+    }
+    return key;
+}
+
+void eliminate_common_subexpressions(IrProgram &ir)
+{
+    propagate_copies(ir);
+    const auto order = reverse_post_order(ir);
+    const auto idom = dominators(ir, order);
+    std::vector<std::vector<uint32_t>> children(ir.blocks.size());
+    for (const auto block : order) {
+        if (idom[block] != none)
+            children[idom[block]].push_back(block);
+    }
+
+    std::unordered_map<ValueKey, uint32_t, ValueKeyHash> available;
+    // keys added by each block on the path, removed when the walk leaves the block
+    std::vector<std::vector<ValueKey>> added;
+    std::vector<std::pair<uint32_t, size_t>> path{{0, 0}};
+    added.emplace_back();
+    auto entering = true;
+    while (!path.empty()) {
+        auto &[block, next_child] = path.back();
+        if (entering) {
+            for (const auto value : ir.blocks[block].values) {
+                auto &definition = ir.values[value];
+                if (!definition.is_pure() || definition.op == IrValue::Op::Copy)
+                    continue;
+                for (auto &operand : definition.operands)
+                    operand = resolve(ir, operand);
+                const auto key = key_of(definition);
+                if (const auto found = available.find(key); found != available.end()) {
+                    definition.op = IrValue::Op::Copy;
+                    definition.operands = {found->second};
+                } else {
+                    available.emplace(key, value);
+                    added.back().push_back(key);
+                }
+            }
+            entering = false;
+        }
+        if (next_child < children[block].size()) {
+            const auto child = children[block][next_child++];
+            path.emplace_back(child, 0);
+            added.emplace_back();
+            entering = true;
+            continue;
+        }
+        for (const auto &key : added.back())
+            available.erase(key);
+        added.pop_back();
+        path.pop_back();
+    }
+    propagate_copies(ir);
+}
+
+void hoist_loop_invariants(IrProgram &ir)
+{
+    const auto order = reverse_post_order(ir);
+    const auto idom = dominators(ir, order);
+
+    struct Loop
+    {
+        uint32_t header;
+        uint32_t preheader;
+        std::vector<bool> body;
+        size_t size;
+    };
+    std::vector<Loop> loops;
+    for (const auto header : order) {
+        const auto &block = ir.blocks[header];
+        std::vector<bool> body(ir.blocks.size());
+        std::vector<uint32_t> pending;
+        body[header] = true;
+        for (const auto predecessor : block.predecessors) {
+            // a back edge comes from a block the header dominates
+            if (dominates(idom, header, predecessor) && !body[predecessor]) {
+                body[predecessor] = true;
+                pending.push_back(predecessor);
+            }
+        }
+        if (pending.empty())
+            continue;
+        while (!pending.empty()) {
+            const auto current = pending.back();
+            pending.pop_back();
+            for (const auto predecessor : ir.blocks[current].predecessors) {
+                if (!body[predecessor] && idom[predecessor] != none) {
+                    body[predecessor] = true;
+                    pending.push_back(predecessor);
+                }
+            }
+        }
+        // the values can only move to a single block entering the loop that jumps to the header
+        auto preheader = none;
+        auto entries = 0;
+        for (const auto predecessor : block.predecessors) {
+            if (!body[predecessor]) {
+                preheader = predecessor;
+                entries++;
+            }
+        }
+        if (entries != 1 || ir.blocks[preheader].end != IrBlock::End::Jump)
+            continue;
+        const auto size = static_cast<size_t>(std::count(body.begin(), body.end(), true));
+        loops.push_back({header, preheader, std::move(body), size});
+    }
+    // an inner loop has fewer blocks than the loops around it
+    std::sort(loops.begin(), loops.end(),
+              [](const Loop &a, const Loop &b) { return a.size < b.size; });
+
+    for (const auto &loop : loops) {
+        // in reverse post-order the values an invariant depends on are hoisted before it
+        for (const auto block : order) {
+            if (!loop.body[block])
+                continue;
+            auto &values = ir.blocks[block].values;
+            std::erase_if(values, [&](const uint32_t value) {
+                auto &definition = ir.values[value];
+                if (!definition.is_pure() || definition.op == IrValue::Op::Copy)
+                    return false;
+                for (const auto operand : definition.operands) {
+                    if (loop.body[ir.values[operand].block])
+                        return false;
+                }
+                definition.block = loop.preheader;
+                ir.blocks[loop.preheader].values.push_back(value);
+                return true;
+            });
+        }
+    }
+}
+
+void eliminate_dead_code(IrProgram &ir)
+{
+    std::vector<bool> live(ir.values.size());
+    std::vector<uint32_t> pending;
+    const auto mark = [&](const uint32_t value) {
+        if (!live[value]) {
+            live[value] = true;
+            pending.push_back(value);
+        }
+    };
+    for (const auto &block : ir.blocks) {
+        if (block.end == IrBlock::End::Branch)
+            mark(block.condition);
+    }
+    for (const auto &[slot, value] : ir.exports)
+        mark(value);
+    if (ir.result != none)
+        mark(ir.result);
+    while (!pending.empty()) {
+        const auto value = pending.back();
+        pending.pop_back();
+        for (const auto operand : ir.values[value].operands)
+            mark(operand);
+    }
+    for (auto &block : ir.blocks)
+        std::erase_if(block.values, [&live](const uint32_t value) { return !live[value]; });
+}
+
+void optimize_ir(IrProgram &ir)
+{
+    propagate_copies(ir);
+    eliminate_common_subexpressions(ir);
+    hoist_loop_invariants(ir);
+    eliminate_dead_code(ir);
+}
@@ -0,0 +1,767 @@
+#include "jit.h"
+#include "trace.h"
+
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <vector>
+
+using OLRuntime::Instruction;
+using OLRuntime::Value;
+
+namespace {
+enum Register : uint8_t
+{
+    rax = 0,
+    rcx = 1,
+    rdx = 2,
+    rsi = 6,
+    rdi = 7,
+    r8 = 8,
+};
+
+// the others are numbered in between
+enum Xmm : uint8_t
+{
+    xmm0 = 0,
+    xmm1 = 1,
+    xmm2 = 2,
+    xmm15 = 15,
+};
+
+enum Condition : uint8_t
+{
+    above_or_equal = 0x3,
+    equal = 0x4,
+    not_equal = 0x5,
+    parity = 0xA,
+};
+
+// SSE2 opcodes after the 0x0F escape
+enum Sse : uint8_t
+{
+    movsd_load = 0x10,
+    movsd_store = 0x11,
+    movapd = 0x28,
+    ucomisd = 0x2E,
+    xorpd = 0x57,
+    addsd = 0x58,
+    mulsd = 0x59,
+    subsd = 0x5C,
+    divsd = 0x5E,
+};
+
+// The few x86-64 instructions the snippets are made of. Memory operands are [base + disp32]
+// with a base other than rsp, rbp, r12 and r13, which would need another encoding.
+class Assembler
+{
+    std::vector<uint8_t> bytes;
+
+    void emit(const uint8_t byte) { bytes.push_back(byte); }
+    template<typename Integer>
+    void emit_integer(const Integer value)
+    {
+        const auto at = bytes.size();
+        bytes.resize(at + sizeof(value));
+        std::memcpy(bytes.data() + at, &value, sizeof(value));
+    }
+    void rex_w(const uint8_t reg, const uint8_t rm)
+    {
+        emit(0x48 | (reg >> 3) << 2 | rm >> 3);
+    }
+    // only needed for the registers past the first eight
+    void rex(const uint8_t reg, const uint8_t rm)
+    {
+        if (reg >= 8 || rm >= 8)
+            emit(0x40 | (reg >> 3) << 2 | rm >> 3);
+    }
+    void direct(const uint8_t reg, const uint8_t rm) { emit(0xC0 | (reg & 7) << 3 | (rm & 7)); }
+    void memory(const uint8_t reg, const Register base, const int32_t displacement)
+    {
+        emit(0x80 | (reg & 7) << 3 | (base & 7));
+        emit_integer(displacement);
+    }
+    // rel32 of a jump, patched by bind()
+    size_t displacement_to_patch()
+    {
+        emit_integer(int32_t{0});
+        return bytes.size() - sizeof(int32_t);
+    }
+
+public:
+    [[nodiscard]] size_t position() const { return bytes.size(); }
+    [[nodiscard]] const std::vector<uint8_t> &code() const { return bytes; }
+
+    // points the jump whose displacement is at `patch` to `target`
+    void bind(const size_t patch, const size_t target)
+    {
+        const auto displacement = static_cast<int32_t>(static_cast<int64_t>(target)
+                                                       - static_cast<int64_t>(patch + 4));
+        std::memcpy(bytes.data() + patch, &displacement, sizeof(displacement));
+    }
+
+    void sse(const uint8_t prefix, const Sse opcode, const Xmm reg, const Xmm rm)
+    {
+        emit(prefix);
+        rex(reg, rm);
+        emit(0x0F);
+        emit(opcode);
+        direct(reg, rm);
+    }
+    void sse(const uint8_t prefix, const Sse opcode, const Xmm reg, const Register base,
+             const int32_t displacement)
+    {
+        emit(prefix);
+        rex(reg, base);
+        emit(0x0F);
+        emit(opcode);
+        memory(reg, base, displacement);
+    }
+    // scalar double instructions, the prefix of the packed ones is 0x66
+    void sd(const Sse opcode, const Xmm reg, const Xmm rm) { sse(0xF2, opcode, reg, rm); }
+    void sd(const Sse opcode, const Xmm reg, const Register base, const int32_t displacement)
+    {
+        sse(0xF2, opcode, reg, base, displacement);
+    }
+    void pd(const Sse opcode, const Xmm reg, const Xmm rm) { sse(0x66, opcode, reg, rm); }
+
+    void movq(const Xmm to, const Register from)
+    {
+        emit(0x66);
+        rex_w(to, from);
+        emit(0x0F);
+        emit(0x6E);
+        direct(to, from);
+    }
+    void movq(const Register to, const Xmm from)
+    {
+        emit(0x66);
+        rex_w(from, to);
+        emit(0x0F);
+        emit(0x7E);
+        direct(from, to);
+    }
+    void mov(const Register to, const uint64_t immediate)
+    {
+        rex_w(0, to);
+        emit(0xB8 | (to & 7));
+        emit_integer(immediate);
+    }
+    // mov [to], from
+    void store(const Register to, const Register from)
+    {
+        rex_w(from, to);
+        emit(0x89);
+        emit((from & 7) << 3 | (to & 7));
+    }
+    void lea(const Register to, const Register base, const int32_t displacement)
+    {
+        rex_w(to, base);
+        emit(0x8D);
+        memory(to, base, displacement);
+    }
+    void add(const Register to, const int8_t immediate)
+    {
+        rex_w(0, to);
+        emit(0x83);
+        direct(0, to);
+        emit(static_cast<uint8_t>(immediate));
+    }
+    void sub(const Register to, const int8_t immediate)
+    {
+        rex_w(0, to);
+        emit(0x83);
+        direct(5, to);
+        emit(static_cast<uint8_t>(immediate));
+    }
+    void sub(const Register to, const Register from)
+    {
+        rex_w(from, to);
+        emit(0x29);
+        direct(from, to);
+    }
+    void shr(const Register to, const uint8_t count)
+    {
+        rex_w(0, to);
+        emit(0xC1);
+        direct(5, to);
+        emit(count);
+    }
+    void cmp(const Register a, const Register b)
+    {
+        rex_w(b, a);
+        emit(0x39);
+        direct(b, a);
+    }
+    void bitwise_or(const Register to, const Register from)
+    {
+        rex_w(from, to);
+        emit(0x09);
+        direct(from, to);
+    }
+    // eax = 1 when the last comparison was equal, 0 otherwise
+    void set_eax_if_equal()
+    {
+        emit(0x0F);
+        emit(0x94);
+        emit(0xC0);
+        emit(0x0F);
+        emit(0xB6);
+        emit(0xC0);
+    }
+    // returns the displacement to bind()
+    size_t jump()
+    {
+        emit(0xE9);
+        return displacement_to_patch();
+    }
+    size_t jump_if(const Condition condition)
+    {
+        emit(0x0F);
+        emit(0x80 | condition);
+        return displacement_to_patch();
+    }
+    void ret() { emit(0xC3); }
+};
+
+// the offset of a local, or nullopt past what a displacement holds
+static std::optional<int32_t> local(const size_t index)
+{
+    if (index > INT32_MAX / sizeof(Value))
+        return std::nullopt;
+    return static_cast<int32_t>(index * sizeof(Value));
+}
+
+// Emits the snippets. The generated function takes (locals, stack, stack, &depth) in rdi, rsi,
+// rdx and rcx as the System V ABI passes them, and only uses registers the caller saves: rsi is
+// the stack pointer of the interpreter, past the operands below the top one in xmm0, and rdx
+// stays the bottom of the stack to compute the depth on the way out.
+class Compiler
+{
+    const std::span<const Instruction> instructions;
+    Assembler assembler;
+    // start of the code of every instruction, and of the end of the program
+    std::vector<size_t> starts;
+    // jumps to the code of an instruction, and to the exit before an instruction
+    std::vector<std::pair<size_t, size_t>> jumps;
+    std::vector<std::pair<size_t, size_t>> exits;
+
+    // JumpIfFalse on a value that is not an ordered number, whose tag is checked out of line
+    struct TagCheck
+    {
+        size_t index;
+        size_t patch;
+        // where the code goes on when the value is truthy
+        size_t after;
+    };
+    std::vector<TagCheck> tag_checks;
+
+    static constexpr uint64_t false_bits = Value::boolean(false).raw_bits();
+    static constexpr uint64_t true_bits = Value::boolean(true).raw_bits();
+    static constexpr uint64_t null_bits = Value::null().raw_bits();
+
+    void exit_if(const Condition condition, const size_t index)
+    {
+        exits.emplace_back(assembler.jump_if(condition), index);
+    }
+    void push()
+    {
+        assembler.sd(movsd_store, xmm0, rsi, 0);
+        assembler.add(rsi, 8);
+    }
+    // pops without touching the flags
+    void pop()
+    {
+        assembler.sd(movsd_load, xmm0, rsi, -8);
+        assembler.lea(rsi, rsi, -8);
+    }
+    void load_number(const Xmm to, const double number)
+    {
+        assembler.mov(rax, std::bit_cast<uint64_t>(number));
+        assembler.movq(to, rax);
+    }
+    // leaves the arithmetic on operands that are not numbers, and on NaN, to the interpreter
+    void keep_if_ordered(const Xmm result, const size_t index)
+    {
+        assembler.pd(ucomisd, result, result);
+        exit_if(parity, index);
+    }
+
+    void compile(size_t index);
+    void compile_tag_check(const TagCheck &check);
+
+public:
+    explicit Compiler(const std::span<const Instruction> instructions)
+        : instructions(instructions)
+    {}
+
+    std::vector<uint8_t> compile();
+};
+
+void Compiler::compile(const size_t index)
+{
+    const auto &instruction = instructions[index];
+    const auto arithmetic = [](const Instruction::Type type) {
+        switch (type) {
+        case Instruction::Type::Add:
+        case Instruction::Type::AddNumber:
+        case Instruction::Type::AddLocal:
+            return addsd;
+        case Instruction::Type::Sub:
+        case Instruction::Type::SubNumber:
+        case Instruction::Type::SubLocal:
+            return subsd;
+        case Instruction::Type::Mul:
+        case Instruction::Type::MulNumber:
+        case Instruction::Type::MulLocal:
+            return mulsd;
+        default:
+            return divsd;
+        }
+    };
+    std::optional<int32_t> slot;
+    if (instruction.uses_local()) {
+        slot = local(instruction.data.index);
+        if (!slot.has_value()) {
+            exits.emplace_back(assembler.jump(), index);
+            return;
+        }
+    }
+
+    switch (instruction.type) {
+    case Instruction::Type::Invalid:
+        break;
+    case Instruction::Type::LoadNumber:
+        push();
+        load_number(xmm0, instruction.data.number);
+        break;
+    case Instruction::Type::LoadValue:
+        push();
+        assembler.mov(rax, instruction.data.value);
+        assembler.movq(xmm0, rax);
+        break;
+    case Instruction::Type::LoadLocal:
+        push();
+        assembler.sd(movsd_load, xmm0, rdi, *slot);
+        break;
+    case Instruction::Type::StoreLocal:
+        assembler.sd(movsd_store, xmm0, rdi, *slot);
+        pop();
+        break;
+    case Instruction::Type::Add:
+    case Instruction::Type::Sub:
+    case Instruction::Type::Mul:
+    case Instruction::Type::Div:
+        assembler.sd(movsd_load, xmm1, rsi, -8);
+        assembler.sd(arithmetic(instruction.type), xmm1, xmm0);
+        keep_if_ordered(xmm1, index);
+        assembler.sub(rsi, 8);
+        assembler.pd(movapd, xmm0, xmm1);
+        break;
+    case Instruction::Type::Equal:
+        assembler.sd(movsd_load, xmm1, rsi, -8);
+        assembler.pd(ucomisd, xmm1, xmm0);
+        exit_if(parity, index);
+        assembler.set_eax_if_equal();
+        assembler.mov(r8, false_bits);
+        assembler.bitwise_or(rax, r8);
+        assembler.movq(xmm0, rax);
+        assembler.sub(rsi, 8);
+        break;
+    case Instruction::Type::Jump:
+        jumps.emplace_back(assembler.jump(), instruction.data.index);
+        break;
+    case Instruction::Type::JumpIfFalse: {
+        // 0 and -0 are the falsy numbers, NaN has its tags checked
+        assembler.pd(xorpd, xmm1, xmm1);
+        assembler.pd(ucomisd, xmm0, xmm1);
+        const auto patch = assembler.jump_if(parity);
+        pop();
+        jumps.emplace_back(assembler.jump_if(equal), instruction.data.index);
+        tag_checks.push_back({index, patch, assembler.position()});
+        break;
+    }
+    case Instruction::Type::AddNumber:
+    case Instruction::Type::SubNumber:
+    case Instruction::Type::MulNumber:
+    case Instruction::Type::DivNumber:
+        load_number(xmm1, instruction.data.number);
+        assembler.pd(movapd, xmm2, xmm0);
+        assembler.sd(arithmetic(instruction.type), xmm2, xmm1);
+        keep_if_ordered(xmm2, index);
+        assembler.pd(movapd, xmm0, xmm2);
+        break;
+    case Instruction::Type::AddLocal:
+    case Instruction::Type::SubLocal:
+    case Instruction::Type::MulLocal:
+    case Instruction::Type::DivLocal:
+        assembler.pd(movapd, xmm2, xmm0);
+        assembler.sd(arithmetic(instruction.type), xmm2, rdi, *slot);
+        keep_if_ordered(xmm2, index);
+        assembler.pd(movapd, xmm0, xmm2);
+        break;
+    case Instruction::Type::StoreLocalKeep:
+        assembler.sd(movsd_store, xmm0, rdi, *slot);
+        break;
+    case Instruction::Type::End:
+        jumps.emplace_back(assembler.jump(), instructions.size());
+        break;
+    default:
+        // anything else is left to the interpreter
+        exits.emplace_back(assembler.jump(), index);
+    }
+}
+
+void Compiler::compile_tag_check(const TagCheck &check)
+{
+    assembler.bind(check.patch, assembler.position());
+    const auto target = instructions[check.index].data.index;
+    assembler.movq(rax, xmm0);
+    std::vector<size_t> falsy;
+    for (const auto bits : {false_bits, null_bits}) {
+        assembler.mov(r8, bits);
+        assembler.cmp(rax, r8);
+        falsy.push_back(assembler.jump_if(equal));
+    }
+    assembler.mov(r8, true_bits);
+    assembler.cmp(rax, r8);
+    exit_if(not_equal, check.index);
+    pop();
+    assembler.bind(assembler.jump(), check.after);
+    for (const auto patch : falsy)
+        assembler.bind(patch, assembler.position());
+    pop();
+    jumps.emplace_back(assembler.jump(), target);
+}
+
+std::vector<uint8_t> Compiler::compile()
+{
+    // the top operand of an empty stack is never read, it only has to be a value
+    assembler.sd(movsd_load, xmm0, rsi, 0);
+    for (size_t index = 0; index < instructions.size(); index++) {
+        starts.push_back(assembler.position());
+        compile(index);
+    }
+    starts.push_back(assembler.position());
+    exits.emplace_back(assembler.jump(), instructions.size());
+    for (const auto &check : tag_checks)
+        compile_tag_check(check);
+
+    // each instruction the code can stop before returns its own index
+    std::vector<size_t> stubs(instructions.size() + 1, SIZE_MAX);
+    std::vector<size_t> to_exit;
+    for (const auto &[patch, index] : exits) {
+        if (stubs[index] == SIZE_MAX) {
+            stubs[index] = assembler.position();
+            assembler.mov(rax, index);
+            to_exit.push_back(assembler.jump());
+        }
+        assembler.bind(patch, stubs[index]);
+    }
+    // the top operand goes back on the stack, where the interpreter expects it
+    for (const auto patch : to_exit)
+        assembler.bind(patch, assembler.position());
+    assembler.sd(movsd_store, xmm0, rsi, 0);
+    assembler.sub(rsi, rdx);
+    assembler.shr(rsi, 3);
+    assembler.store(rcx, rsi);
+    assembler.ret();
+
+    for (const auto &[patch, target] : jumps)
+        assembler.bind(patch, starts[target]);
+    return assembler.code();
+}
+
+// Compiles a trace to a function taking the locals in rdi. Every local the trace reads or
+// stores has a home register holding its value at the start of an iteration, every constant a
+// register loaded once before the loop, and the arithmetic in between the registers left, as
+// long as the values need them. Stores only change which register holds the current value of a
+// local: the homes are updated at the end of an iteration, and memory when a guard fails.
+class TraceCompiler
+{
+    // xmm15 is the scratch register of the moves between iterations
+    static constexpr uint8_t allocatable = 15;
+
+    const Trace &trace;
+    Assembler assembler;
+    // register of every op with a value
+    std::vector<uint8_t> registers;
+    // home register of the locals the trace reads or stores, by slot
+    std::map<size_t, uint8_t> homes;
+
+    struct Exit
+    {
+        size_t patch;
+        size_t resume;
+        // op holding the value of each local the iteration stored before the guard, by slot
+        std::vector<std::pair<size_t, uint32_t>> values;
+    };
+    std::vector<Exit> exits;
+
+    [[nodiscard]] Xmm xmm(const uint32_t op) const { return static_cast<Xmm>(registers[op]); }
+    bool allocate();
+    void move_to_homes(const std::map<size_t, uint32_t> &values);
+
+public:
+    explicit TraceCompiler(const Trace &trace)
+        : trace(trace)
+        , registers(trace.ops.size())
+    {}
+
+    // nullopt when the trace needs more registers than there are
+    std::optional<std::vector<uint8_t>> compile();
+};
+
+bool TraceCompiler::allocate()
+{
+    const auto &ops = trace.ops;
+    std::vector<bool> used(allocatable);
+    const auto take = [&used]() -> std::optional<uint8_t> {
+        for (uint8_t reg = 0; reg < allocatable; reg++) {
+            if (!used[reg]) {
+                used[reg] = true;
+                return reg;
+            }
+        }
+        return std::nullopt;
+    };
+    for (const auto &op : ops) {
+        if (op.kind == TraceOp::Kind::Local || op.kind == TraceOp::Kind::Store)
+            homes.emplace(op.slot, 0);
+    }
+    for (auto &[slot, home] : homes) {
+        const auto reg = take();
+        if (!reg.has_value())
+            return false;
+        home = *reg;
+    }
+    // the constants are loaded once, before the loop
+    for (uint32_t index = 0; index < ops.size(); index++) {
+        if (ops[index].kind == TraceOp::Kind::Number) {
+            const auto reg = take();
+            if (!reg.has_value())
+                return false;
+            registers[index] = *reg;
+        }
+    }
+
+    // the last op needing the value of every result of arithmetic, which is the end of the
+    // trace for the ones the next iteration starts with
+    std::vector<size_t> last_use(ops.size());
+    std::map<size_t, uint32_t> current;
+    for (size_t index = 0; index < ops.size(); index++) {
+        const auto &op = ops[index];
+        if (op.is_arithmetic() || op.kind == TraceOp::Kind::Guard)
+            last_use[op.a] = last_use[op.b] = index;
+        if (op.kind == TraceOp::Kind::Store) {
+            last_use[op.a] = index;
+            current[op.slot] = op.a;
+        }
+        // a failing guard writes the current values back
+        if (op.kind == TraceOp::Kind::Guard) {
+            for (const auto &[slot, value] : current)
+                last_use[value] = index;
+        }
+    }
+    for (const auto &[slot, value] : current)
+        last_use[value] = ops.size();
+
+    std::vector<std::vector<uint32_t>> dying(ops.size());
+    for (uint32_t index = 0; index < ops.size(); index++) {
+        const auto &op = ops[index];
+        if (op.kind == TraceOp::Kind::Local) {
+            registers[index] = homes.at(op.slot);
+        } else if (op.is_arithmetic()) {
+            // taken before the operands are given back, so it is never the right one
+            const auto reg = take();
+            if (!reg.has_value())
+                return false;
+            registers[index] = *reg;
+            if (last_use[index] < ops.size())
+                dying[last_use[index]].push_back(index);
+        }
+        for (const auto value : dying[index])
+            used[registers[value]] = false;
+    }
+    return true;
+}
+
+void TraceCompiler::move_to_homes(const std::map<size_t, uint32_t> &values)
+{
+    // the moves between registers, the homes read by another move go last, and a cycle of them
+    // is broken through xmm15
+    std::vector<std::pair<uint8_t, uint8_t>> moves;
+    for (const auto &[slot, value] : values) {
+        if (registers[value] != homes.at(slot))
+            moves.emplace_back(homes.at(slot), registers[value]);
+    }
+    while (!moves.empty()) {
+        const auto free = std::ranges::find_if(moves, [&moves](const auto &move) {
+            return std::ranges::none_of(moves, [&move](const auto &other) {
+                return other.second == move.first;
+            });
+        });
+        if (free == moves.end()) {
+            const auto blocked = moves.front().first;
+            assembler.pd(movapd, xmm15, static_cast<Xmm>(blocked));
+            for (auto &move : moves) {
+                if (move.second == blocked)
+                    move.second = xmm15;
+            }
+            continue;
+        }
+        assembler.pd(movapd, static_cast<Xmm>(free->first), static_cast<Xmm>(free->second));
+        moves.erase(free);
+    }
+}
+
+std::optional<std::vector<uint8_t>> TraceCompiler::compile()
+{
+    if (!allocate())
+        return std::nullopt;
+    for (const auto &[slot, home] : homes) {
+        if (!local(slot).has_value())
+            return std::nullopt;
+    }
+    const auto &ops = trace.ops;
+
+    // the locals the trace reads have to be numbers, which it checks once on the way in
+    std::vector<size_t> not_numbers;
+    for (const auto &[slot, home] : homes)
+        assembler.sd(movsd_load, static_cast<Xmm>(home), rdi, *local(slot));
+    assembler.mov(r8, Value::first_tagged);
+    for (uint32_t index = 0; index < ops.size(); index++) {
+        if (ops[index].kind == TraceOp::Kind::Local) {
+            assembler.movq(rax, xmm(index));
+            assembler.cmp(rax, r8);
+            not_numbers.push_back(assembler.jump_if(above_or_equal));
+        }
+    }
+    for (uint32_t index = 0; index < ops.size(); index++) {
+        if (ops[index].kind == TraceOp::Kind::Number) {
+            assembler.mov(rax, std::bit_cast<uint64_t>(ops[index].number));
+            assembler.movq(xmm(index), rax);
+        }
+    }
+
+    const auto loop = assembler.position();
+    std::map<size_t, uint32_t> values;
+    for (uint32_t index = 0; index < ops.size(); index++) {
+        const auto &op = ops[index];
+        switch (op.kind) {
+        case TraceOp::Kind::Add:
+        case TraceOp::Kind::Sub:
+        case TraceOp::Kind::Mul:
+        case TraceOp::Kind::Div: {
+            static constexpr Sse opcodes[] = {addsd, subsd, mulsd, divsd};
+            const auto opcode
+                = opcodes[static_cast<size_t>(op.kind) - static_cast<size_t>(TraceOp::Kind::Add)];
+            assembler.pd(movapd, xmm(index), xmm(op.a));
+            assembler.sd(opcode, xmm(index), xmm(op.b));
+            break;
+        }
+        case TraceOp::Kind::Guard: {
+            // NaN is unordered, equal to nothing
+            assembler.pd(ucomisd, xmm(op.a), xmm(op.b));
+            Exit exit{.resume = op.slot};
+            for (const auto &[slot, value] : values)
+                exit.values.emplace_back(slot, value);
+            if (op.equal) {
+                exit.patch = assembler.jump_if(parity);
+                exits.push_back(exit);
+                exit.patch = assembler.jump_if(not_equal);
+                exits.push_back(std::move(exit));
+            } else {
+                const auto unordered = assembler.jump_if(parity);
+                exit.patch = assembler.jump_if(equal);
+                exits.push_back(std::move(exit));
+                assembler.bind(unordered, assembler.position());
+            }
+            break;
+        }
+        case TraceOp::Kind::Store:
+            values[op.slot] = op.a;
+            break;
+        default:
+            break;
+        }
+    }
+    move_to_homes(values);
+    assembler.bind(assembler.jump(), loop);
+
+    for (const auto &exit : exits) {
+        assembler.bind(exit.patch, assembler.position());
+        std::map<size_t, uint8_t> written;
+        for (const auto &[slot, value] : exit.values)
+            written[slot] = registers[value];
+        for (const auto &[slot, value] : values)
+            written.emplace(slot, homes.at(slot));
+        for (const auto &[slot, reg] : written)
+            assembler.sd(movsd_store, static_cast<Xmm>(reg), rdi, *local(slot));
+        assembler.mov(rax, exit.resume);
+        assembler.ret();
+    }
+    for (const auto patch : not_numbers)
+        assembler.bind(patch, assembler.position());
+    assembler.mov(rax, trace.header);
+    assembler.ret();
+    return assembler.code();
+}
+} // namespace
+
+OLRuntime::ExecutableMemory::ExecutableMemory(const std::span<const uint8_t> code)
+    : size(code.size())
+{
+    // written before it becomes executable, never both at once
+    memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        memory = nullptr;
+        throw std::runtime_error(std::string("Failed to map native code: ") + std::strerror(errno));
+    }
+    std::memcpy(memory, code.data(), size);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) < 0) {
+        const auto error = std::string("Failed to protect native code: ") + std::strerror(errno);
+        munmap(memory, size);
+        throw std::runtime_error(error);
+    }
+}
+
+OLRuntime::ExecutableMemory::~ExecutableMemory()
+{
+    if (memory != nullptr)
+        munmap(memory, size);
+}
+
+std::unique_ptr<const OLRuntime::NativeCode>
+OLRuntime::NativeCode::compile(const std::span<const Instruction> instructions)
+{
+    if constexpr (!supported)
+        return nullptr;
+    return std::make_unique<const NativeCode>(Compiler(instructions).compile());
+}
+
+size_t OLRuntime::NativeCode::run(Value *locals, Value *stack, size_t &depth) const
+{
+    using Function = size_t (*)(Value *, Value *, Value *, size_t *);
+    return code.entry<Function>()(locals, stack, stack, &depth);
+}
+
+std::unique_ptr<const OLRuntime::NativeTrace> OLRuntime::NativeTrace::compile(const Trace &trace)
+{
+    if constexpr (!NativeCode::supported)
+        return nullptr;
+    const auto code = TraceCompiler(trace).compile();
+    if (!code.has_value())
+        return nullptr;
+    return std::make_unique<const NativeTrace>(*code);
+}
+
+size_t OLRuntime::NativeTrace::run(Value *locals) const
+{
+    return code.entry<size_t (*)(Value *)>()(locals);
+}
@@ -1,130 +1,217 @@
 #include "lexer.h"
+#include "scan.h"
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
 #include <stdexcept>
+#include <unistd.h>
 #include <utility>
 
 Lexer::Lexer(std::string source)
-    : source(std::move(source))
+    : storage(std::move(source))
+    , source(storage)
+    , mode(Mode::Copy)
     , position(0)
     , line(1)
     , column(1)
     , last_token()
 {}
 
-static bool is_separator(const char c)
+Lexer::Lexer(const std::string_view source, const Mode mode)
+    : source(source)
+    , mode(mode)
+    , position(0)
+    , line(1)
+    , column(1)
+    , last_token()
+{}
+
+Lexer::Lexer(std::vector<Token> tokens)
+    : mode(Mode::Copy)
+    , position(0)
+    , line(1)
+    , column(1)
+    , last_token()
+    , replay(std::move(tokens))
+    , replaying(true)
+{}
+
+Lexer::Lexer(const int fd, const size_t chunk_size)
+    : mode(Mode::Copy)
+    , position(0)
+    , line(1)
+    , column(1)
+    , last_token()
+    , input(fd)
+    , chunk_size(chunk_size)
+    , exhausted(false)
 {
-    return isspace(c) || c == ',' || c == '(' || c == ')' || c == '{' || c == '}' || c == '\0'
-           || c == '=' || c == '+' || c == '-' || c == '*' || c == '/' || c == ';' || c == '['
-           || c == ']' || c == '.';
+    assert(chunk_size > 0);
 }
 
-static bool is_integer(const std::string &str)
+// Character classes driving the word scanner below
+enum class CharClass : uint8_t
 {
-    try {
-        size_t idx;
-        std::stoi(str, &idx);
-        return idx == str.size();
-    } catch (std::invalid_argument &) {
-        return false;
-    }
+    Other = 0,
+    Digit,
+    Sign,
+    Dot,
+    Exponent,
+    Separator,
+};
+
+static constexpr auto char_classes = [] {
+    std::array<CharClass, 256> table{};
+    // '"' ends words so that every quote outside comments and strings opens a string
+    for (const unsigned char c : std::string_view(" \t\n\v\f\r,(){}=+-*/;[].\""))
+        table[c] = CharClass::Separator;
+    table['\0'] = CharClass::Separator;
+    for (unsigned char c = '0'; c <= '9'; c++)
+        table[c] = CharClass::Digit;
+    table['+'] = table['-'] = CharClass::Sign;
+    table['.'] = CharClass::Dot;
+    table['e'] = table['E'] = CharClass::Exponent;
+    return table;
+}();
+
+// States of the number/identifier DFA, a word ends on the first transition into Done
+enum class ScanState : uint8_t
+{
+    Start = 0,
+    Sign,
+    Integer,
+    LeadingDot,
+    Fraction,
+    Exponent,
+    ExponentSign,
+    ExponentDigits,
+    Word,
+    Done,
+};
+
+static constexpr ScanState transitions[][6] = {
+    // Other, Digit, Sign, Dot, Exponent, Separator
+    {ScanState::Word, ScanState::Integer, ScanState::Sign, ScanState::LeadingDot, ScanState::Word,
+     ScanState::Word}, // Start
+    {ScanState::Done, ScanState::Integer, ScanState::Done, ScanState::Done, ScanState::Done,
+     ScanState::Done}, // Sign
+    {ScanState::Word, ScanState::Integer, ScanState::Done, ScanState::Fraction,
+     ScanState::Exponent, ScanState::Done}, // Integer
+    {ScanState::Done, ScanState::Fraction, ScanState::Done, ScanState::Done, ScanState::Done,
+     ScanState::Done}, // LeadingDot
+    {ScanState::Word, ScanState::Fraction, ScanState::Done, ScanState::Done, ScanState::Exponent,
+     ScanState::Done}, // Fraction
+    {ScanState::Word, ScanState::ExponentDigits, ScanState::ExponentSign, ScanState::Done,
+     ScanState::Word, ScanState::Done}, // Exponent
+    {ScanState::Word, ScanState::ExponentDigits, ScanState::Done, ScanState::Done,
+     ScanState::Word, ScanState::Done}, // ExponentSign
+    {ScanState::Word, ScanState::ExponentDigits, ScanState::Done, ScanState::Done,
+     ScanState::Word, ScanState::Done}, // ExponentDigits
+    {ScanState::Word, ScanState::Word, ScanState::Done, ScanState::Done, ScanState::Word,
+     ScanState::Done}, // Word
+};
+
+static constexpr bool is_number(const ScanState state)
+{
+    return state == ScanState::Integer || state == ScanState::Fraction
+           || state == ScanState::ExponentDigits;
 }
 
-static bool is_real(const std::string &str)
+struct Keyword
 {
-    try {
-        size_t idx;
-        std::stod(str, &idx);
-        return idx == str.size();
-    } catch (std::invalid_argument &) {
-        return false;
-    }
+    std::string_view name;
+    Token::Type type;
+};
+
+static constexpr Keyword keywords[] = {
+    {"var", Token::Type::Var},
+    {"if", Token::Type::If},
+    {"else", Token::Type::Else},
+    {"while", Token::Type::While},
+    {"function", Token::Type::Function},
+    {"return", Token::Type::Return},
+    {"this", Token::Type::This},
+    {"new", Token::Type::New},
+    {"true", Token::Type::True},
+    {"false", Token::Type::False},
+    {"null", Token::Type::Null},
+};
+
+static constexpr size_t keyword_hash(const std::string_view str)
+{
+    return (str.size() + static_cast<unsigned char>(str.front())
+            + 7 * static_cast<unsigned char>(str.back()))
+           & 15;
 }
 
-static Token::Type classify_word(const std::string &str)
+static constexpr auto keyword_table = [] {
+    std::array<Keyword, 16> table{};
+    for (const auto &keyword : keywords)
+        table[keyword_hash(keyword.name)] = keyword;
+    return table;
+}();
+
+static_assert(
+    [] {
+        for (const auto &keyword : keywords) {
+            if (keyword_table[keyword_hash(keyword.name)].name != keyword.name)
+                return false;
+        }
+        return true;
+    }(),
+    "keyword_hash must map every keyword to its own slot");
+
+static Token::Type classify_word(const std::string_view str)
 {
-    if (str == ";")
-        return Token::Type::Semicolon;
-    if (str == ",")
-        return Token::Type::Comma;
-    if (str == "=")
-        return Token::Type::Equals;
-    if (str == "+")
-        return Token::Type::Plus;
-    if (str == "-")
-        return Token::Type::Minus;
-    if (str == "*")
-        return Token::Type::Asterisk;
-    if (str == "/")
-        return Token::Type::Slash;
-    if (str == "var")
-        return Token::Type::Var;
-    if (str == "if")
-        return Token::Type::If;
-    if (str == "else")
-        return Token::Type::Else;
-    if (str == "while")
-        return Token::Type::While;
-    if (str == "function")
-        return Token::Type::Function;
-    if (str == "return")
-        return Token::Type::Return;
-    if (str == "this")
-        return Token::Type::This;
-    if (str == "new")
-        return Token::Type::New;
-    if (str == "true")
-        return Token::Type::True;
-    if (str == "false")
-        return Token::Type::False;
-    if (str == "null")
-        return Token::Type::Null;
+    if (str.empty())
+        return Token::Type::Identifier;
+    if (const auto &keyword = keyword_table[keyword_hash(str)]; keyword.name == str)
+        return keyword.type;
     return Token::Type::Identifier;
 }
 
-Token Lexer::next()
+void Lexer::set_text(Token &token, const size_t start, const size_t end) const
+{
+    if (mode == Mode::View)
+        token.span = source.substr(start, end - start);
+    else
+        token.value.assign(source.substr(start, end - start));
+}
+
+Token Lexer::scan()
 {
     Token token{};
 
     if (position >= source.size())
         return {Token::Type::EndOfFile};
 
-    // skip whitespaces
-    for (; isspace(source[position]) && position < source.size(); position++) {
-        if (source[position] == '\n') {
-            line++;
-            column = 1;
-        } else {
-            column++;
-        }
-    }
+    while (true) {
+        // skip whitespaces
+        advance_to(Scan::skip_whitespace(source, position));
 
-    // skip one-line comments
-    if (source[position] == '/' && source[position + 1] == '/') {
-        position += 2;
-        while (source[position] != '\n' && position < source.size()) {
-            position++;
+        // skip one-line comments, the newline is consumed with the next whitespace run
+        if (at(position) == '/' && at(position + 1) == '/') {
+            advance_to(Scan::find(source, position + 2, '\n'));
+            continue;
         }
-        position++;
-        column = 1;
-        line++;
-        return next();
-    }
 
-    // skip multi-line comments
-    if (source[position] == '/' && source[position + 1] == '*') {
-        position += 2;
-        column += 2;
-        for (; source[position] != '*' || source[position + 1] != '/'; position++) {
-            if (source[position] == '\n') {
-                line++;
-                column = 1;
-                continue;
+        // skip multi-line comments
+        if (at(position) == '/' && at(position + 1) == '*') {
+            auto end = position + 2;
+            while (true) {
+                end = Scan::find(source, end, '*');
+                if (end >= source.size() || at(end + 1) == '/')
+                    break;
+                end++;
             }
-            column++;
+            advance_to(std::min(end + 2, source.size()));
+            continue;
         }
-        position += 2;
-        column += 2;
-        return next();
+        break;
     }
 
     if (position >= source.size())
@@ -132,26 +219,27 @@ Token Lexer::next()
 
     token.column = column;
     token.line = line;
+    token.offset = discarded + position;
 
     const char current_char = source[position];
 
     // Handle '===' and '=='
     if (current_char == '=') {
-        if (source[position + 1] == '=') {
-            if (source[position + 2] == '=') {
+        if (at(position + 1) == '=') {
+            if (at(position + 2) == '=') {
                 token.type = Token::Type::StrictEquality;
-                token.value = "===";
+                set_text(token, position, position + 3);
                 position += 3;
                 column += 3;
             } else {
                 token.type = Token::Type::LooseEquality;
-                token.value = "==";
+                set_text(token, position, position + 2);
                 position += 2;
                 column += 2;
             }
         } else {
             token.type = Token::Type::Equals;
-            token.value = "=";
+            set_text(token, position, position + 1);
             position++;
             column++;
         }
@@ -162,7 +250,7 @@ Token Lexer::next()
 #define TOK(tok, c) \
     case c: \
         token.type = Token::Type::tok; \
-        token.value = c; \
+        set_text(token, position, position + 1); \
         position++; \
         column++; \
         return token
@@ -173,11 +261,25 @@ Token Lexer::next()
         TOK(RightBracket, ']');
         TOK(LeftBrace, '{');
         TOK(RightBrace, '}');
+        TOK(Semicolon, ';');
+        TOK(Comma, ',');
+        TOK(Asterisk, '*');
+        TOK(Slash, '/');
+    case '+':
+    case '-':
+        // a sign directly followed by a digit is part of the number
+        if (isdigit(at(position + 1)))
+            break;
+        token.type = current_char == '+' ? Token::Type::Plus : Token::Type::Minus;
+        set_text(token, position, position + 1);
+        position++;
+        column++;
+        return token;
     case '.':
-        if (isdigit(source[position + 1]))
+        if (isdigit(at(position + 1)))
             break;
         token.type = Token::Type::Dot;
-        token.value = '.';
+        set_text(token, position, position + 1);
         position++;
         column++;
         return token;
@@ -188,57 +290,131 @@ Token Lexer::next()
     if (source[position] == '"')
         return read_string();
 
-    bool seen_exponent = false;
-    while (true) {
-        if (position >= source.size())
+    const size_t start = position;
+    auto state = ScanState::Start;
+    for (; position < source.size(); position++) {
+        const auto next_state = transitions[static_cast<size_t>(state)][static_cast<size_t>(
+            char_classes[static_cast<unsigned char>(source[position])])];
+        if (next_state == ScanState::Done)
             break;
+        state = next_state;
+    }
+    column += position - start;
+    token.type = is_number(state) ? Token::Type::Number
+                                  : classify_word(source.substr(start, position - start));
+    set_text(token, start, position);
+    if (atoms != nullptr && token.type == Token::Type::Identifier)
+        token.atom = atoms->intern(token.text());
+    return token;
+}
 
-        token.value += source[position];
+// tokens produced by the word scanner, the only ones current() reports
+static bool is_word(const Token::Type type)
+{
+    if (type == Token::Type::Identifier || type == Token::Type::Number)
+        return true;
+    for (const auto &keyword : keywords) {
+        if (keyword.type == type)
+            return true;
+    }
+    return false;
+}
 
-        if (is_integer(token.value) || is_real(token.value))
-            token.type = Token::Type::Number;
-        else
-            token.type = classify_word(token.value);
+Token Lexer::next()
+{
+    Token token = buffered > 0 ? std::move(buffer[head]) : fill();
+    if (buffered > 0) {
+        head = (head + 1) % lookahead;
+        buffered--;
+    }
+    if (is_word(token.type))
+        last_token = token;
+    return token;
+}
 
-        // handle exponents
-        if (isdigit(source[position - 1]) && (source[position] == 'E' || source[position] == 'e')
-            && !seen_exponent) {
-            seen_exponent = true;
-            token.value += source[++position]; // Add 'E' or 'e'
-            column++;
+const Token &Lexer::peek(const size_t offset)
+{
+    assert(offset < lookahead);
+    while (buffered <= offset) {
+        buffer[(head + buffered) % lookahead] = fill();
+        buffered++;
+    }
+    return buffer[(head + offset) % lookahead];
+}
 
-            if (source[position + 1] == '+' || source[position + 1] == '-') {
-                token.value += source[++position]; // Add sign
-            }
-        }
+void Lexer::seek(const size_t position, const size_t line, const size_t column)
+{
+    assert(input < 0 && !replaying);
+    this->position = position;
+    this->line = line;
+    this->column = column;
+    head = 0;
+    buffered = 0;
+}
 
-        column++;
-        position++;
+Token Lexer::fill()
+{
+    if (replaying)
+        return replay_index < replay.size() ? std::move(replay[replay_index++])
+                                            : Token{Token::Type::EndOfFile};
+    // tokens own their text in streaming mode, so consumed bytes can be dropped, once they are
+    // half of the window so each byte is moved a bounded number of times
+    if (input >= 0 && position >= std::max(chunk_size, source.size() / 2)) {
+        storage.erase(0, position);
+        source = storage;
+        discarded += position;
+        position = 0;
+    }
+    while (true) {
+        const auto start = position;
+        const auto start_line = line;
+        const auto start_column = column;
+        auto token = scan();
+        scanned_bytes += std::min(position, source.size()) - std::min(start, source.size());
+        // The token may continue past the window, read more input and scan it again. At least
+        // as much as the window holds of it, so a long token is rescanned a logarithmic number
+        // of times over a doubling window, linear time in all.
+        if (!exhausted && position + 2 >= source.size()) {
+            position = start;
+            line = start_line;
+            column = start_column;
+            read_chunk(std::max(chunk_size, source.size() - start));
+            continue;
+        }
+        return token;
+    }
+}
 
-        // an ugly workaround for real numbers
-        if (token.type == Token::Type::Number && source[position] == '.')
+void Lexer::read_chunk(const size_t size)
+{
+    const auto end = storage.size();
+    storage.resize(end + size);
+    size_t filled = 0;
+    while (filled < size) {
+        const auto count = ::read(input, storage.data() + end + filled, size - filled);
+        if (count < 0 && errno == EINTR)
             continue;
-        if (is_separator(source[position])
-            && !(seen_exponent && (source[position] == '+' || source[position] == '-')))
+        if (count < 0)
+            throw std::runtime_error(std::string("Failed to read source: ") + std::strerror(errno));
+        if (count == 0) {
+            exhausted = true;
             break;
+        }
+        filled += count;
     }
-
-    last_token = token;
-    return token;
+    storage.resize(end + filled);
+    source = storage;
 }
 
-Token Lexer::peek()
+void Lexer::advance_to(const size_t end)
 {
-    const auto o_line = this->line;
-    const auto o_column = this->column;
-    const auto o_position = this->position;
-    const auto old = current();
-    auto token = next();
-    this->line = o_line;
-    this->column = o_column;
-    this->position = o_position;
-    this->last_token = old;
-    return token;
+    if (const auto newlines = Scan::count_newlines(source, position, end); newlines.count > 0) {
+        line += newlines.count;
+        column = end - newlines.last;
+    } else {
+        column += end - position;
+    }
+    position = end;
 }
 
 #define ESCAPE_SEQ(CHAR, ESC) \
@@ -247,8 +423,7 @@ Token Lexer::peek()
         break
 inline void Lexer::handle_escape_sequence(Token &token)
 {
-    position++; // skip '\'
-    switch (source[position]) {
+    switch (at(position + 1)) {
         ESCAPE_SEQ('n', '\n');
         ESCAPE_SEQ('r', '\r');
         ESCAPE_SEQ('t', '\t');
@@ -258,7 +433,7 @@ inline void Lexer::handle_escape_sequence(Token &token)
     default:
         break;
     }
-    column++;
+    advance_to(std::min(position + 2, source.size()));
 }
 
 Token Lexer::read_string()
@@ -267,17 +442,27 @@ Token Lexer::read_string()
     token.type = Token::Type::String;
     token.line = line;
     token.column = column;
-    position++; // skip "
-    for (; source[position] != '"'; position++) {
-        if (source[position] == '\\')
-            handle_escape_sequence(token);
-        else {
-            token.value += source[position];
-            column++;
+    token.offset = discarded + position;
+    advance_to(position + 1); // skip "
+    const size_t start = position;
+    bool materialized = mode == Mode::Copy;
+    while (true) {
+        const auto end = Scan::find_either(source, position, '"', '\\');
+        if (materialized)
+            token.value.append(source.substr(position, end - position));
+        advance_to(end);
+        if (position >= source.size() || source[position] == '"')
+            break;
+        // escaped strings are the only tokens that need their own storage
+        if (!materialized) {
+            token.value.assign(source.substr(start, position - start));
+            materialized = true;
         }
+        handle_escape_sequence(token);
     }
-    position++;
-    column++;
+    if (!materialized)
+        token.span = source.substr(start, position - start);
+    advance_to(std::min(position + 1, source.size()));
     return token;
 }
 
@@ -0,0 +1,350 @@
+#include "optimizer.h"
+#include "ast_arena.h"
+
+#include <charconv>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+class Optimizer
+{
+    AstArena *arena;
+    // Names are views into the tokens of declarations and assignment targets, which the pass
+    // never frees. `variable` holds the names that must keep being read from their slot.
+    std::unordered_set<std::string_view> variable;
+    std::unordered_set<std::string_view> declared;
+    std::unordered_map<std::string_view, double> constants;
+    // operators of the left-nested chains being folded, the innermost chain on top
+    std::vector<BinaryExpression *> chains;
+
+    template<typename T, typename... Args>
+    T *make(Args &&...args)
+    {
+        if (arena != nullptr)
+            return arena->make<T>(std::forward<Args>(args)...);
+        return new T(std::forward<Args>(args)...);
+    }
+
+    void discard(ASTNode *node) const
+    {
+        if (arena == nullptr)
+            delete node;
+    }
+
+    ASTNode *make_number(const double value, const Token &at)
+    {
+        char text[32];
+        const auto end = std::to_chars(text, text + sizeof(text), value).ptr;
+        Token token{Token::Type::Number, {}, at.line, at.column};
+        if (arena != nullptr)
+            token.span = arena->keep({text, end});
+        else
+            token.value.assign(text, end);
+        return make<SingleNode>(std::move(token));
+    }
+
+    void scan(const ASTNode *node);
+    ASTNode *fold(ASTNode *node, bool propagate);
+    ASTNode *fold_binary(BinaryExpression *expression, bool propagate);
+    ASTNode *fold_chain(BinaryExpression *expression, bool propagate);
+    ASTNode *fold_operator(BinaryExpression *expression);
+
+public:
+    explicit Optimizer(AstArena *arena)
+        : arena(arena)
+    {}
+
+    void run(std::vector<ASTNode *> &ast)
+    {
+        for (const auto &node : ast)
+            scan(node);
+        for (auto &node : ast)
+            node = fold(node, true);
+    }
+};
+} // namespace
+
+static const Token *number_of(const ASTNode *node)
+{
+    if (node->type != ASTNode::Type::SingleNode)
+        return nullptr;
+    const auto &token = dynamic_cast<const SingleNode *>(node)->token;
+    return token.type == Token::Type::Number ? &token : nullptr;
+}
+
+// an operator other than '=', whose left operand is folded along with it
+static bool is_chained(const ASTNode *node)
+{
+    return node->type == ASTNode::Type::BinaryExpression
+           && dynamic_cast<const BinaryExpression *>(node)->op.type != Token::Type::Equals;
+}
+
+static bool is_number(const ASTNode *node, const double value)
+{
+    const auto token = number_of(node);
+    if (token == nullptr)
+        return false;
+    const auto number = std::stod(std::string(token->text()));
+    return number == value && std::signbit(number) == std::signbit(value);
+}
+
+// whether `node` always evaluates to a number, the identities below only hold for those
+static bool is_numeric(const ASTNode *node)
+{
+    while (node->type == ASTNode::Type::ParenthesizedExpression)
+        node = dynamic_cast<const ParenthesizedExpression *>(node)->expression;
+    if (node->type == ASTNode::Type::BinaryExpression) {
+        switch (dynamic_cast<const BinaryExpression *>(node)->op.type) {
+        case Token::Type::Plus:
+        case Token::Type::Minus:
+        case Token::Type::Asterisk:
+        case Token::Type::Slash:
+            return true;
+        default:
+            return false;
+        }
+    }
+    return number_of(node) != nullptr;
+}
+
+// finds the variables that are assigned outside of their declaration or declared twice
+void Optimizer::scan(const ASTNode *node)
+{
+    // left operands are followed in a loop, chains like a + b + c nest to the left
+    while (node->type == ASTNode::Type::BinaryExpression) {
+        const auto expression = dynamic_cast<const BinaryExpression *>(node);
+        if (expression->op.type == Token::Type::Equals
+            && expression->left->type == ASTNode::Type::SingleNode)
+            variable.insert(dynamic_cast<const SingleNode *>(expression->left)->token.text());
+        scan(expression->right);
+        node = expression->left;
+    }
+    switch (node->type) {
+    case ASTNode::Type::VarDeclaration: {
+        const auto name = dynamic_cast<const VarDeclaration *>(node)->name.text();
+        if (!declared.insert(name).second)
+            variable.insert(name);
+    }
+    break;
+    case ASTNode::Type::UnaryExpression:
+        scan(dynamic_cast<const UnaryExpression *>(node)->operand);
+        break;
+    case ASTNode::Type::ParenthesizedExpression:
+        scan(dynamic_cast<const ParenthesizedExpression *>(node)->expression);
+        break;
+    case ASTNode::Type::FunctionDeclaration: {
+        const auto function = dynamic_cast<const FunctionDeclaration *>(node);
+        for (const auto &arg : function->args)
+            scan(arg);
+        scan(function->body);
+    }
+    break;
+    case ASTNode::Type::FunctionCall:
+        for (const auto &arg : dynamic_cast<const FunctionCall *>(node)->args)
+            scan(arg);
+        break;
+    case ASTNode::Type::ScopeBlock:
+        for (const auto &statement : dynamic_cast<const ScopeBlock *>(node)->statements)
+            scan(statement);
+        break;
+    case ASTNode::Type::IfStatement: {
+        const auto statement = dynamic_cast<const IfStatement *>(node);
+        scan(statement->condition);
+        scan(statement->body);
+        if (statement->else_body.has_value())
+            scan(statement->else_body.value());
+    }
+    break;
+    case ASTNode::Type::WhileStatement: {
+        const auto statement = dynamic_cast<const WhileStatement *>(node);
+        scan(statement->condition);
+        scan(statement->body);
+    }
+    break;
+    case ASTNode::Type::ArrayAccess: {
+        const auto access = dynamic_cast<const ArrayAccess *>(node);
+        scan(access->array);
+        scan(access->index);
+    }
+    break;
+    case ASTNode::Type::FieldAccess: {
+        const auto access = dynamic_cast<const FieldAccess *>(node);
+        scan(access->record);
+        scan(access->field);
+    }
+    break;
+    case ASTNode::Type::Constructor:
+        scan(dynamic_cast<const Constructor *>(node)->record);
+        break;
+    default:
+        break;
+    }
+}
+
+// returns the node that replaces `node`, which is then owned by the caller
+ASTNode *Optimizer::fold(ASTNode *node, const bool propagate)
+{
+    switch (node->type) {
+    case ASTNode::Type::SingleNode: {
+        const auto &token = dynamic_cast<SingleNode *>(node)->token;
+        if (!propagate || token.type != Token::Type::Identifier)
+            return node;
+        const auto constant = constants.find(token.text());
+        if (constant == constants.end())
+            return node;
+        const auto number = make_number(constant->second, token);
+        discard(node);
+        return number;
+    }
+    case ASTNode::Type::BinaryExpression:
+        return fold_binary(dynamic_cast<BinaryExpression *>(node), propagate);
+    case ASTNode::Type::ParenthesizedExpression: {
+        // parentheses only group, the tree already has the shape they asked for
+        const auto parenthesized = dynamic_cast<ParenthesizedExpression *>(node);
+        const auto expression = fold(std::exchange(parenthesized->expression, nullptr), propagate);
+        discard(parenthesized);
+        return expression;
+    }
+    case ASTNode::Type::UnaryExpression: {
+        const auto expression = dynamic_cast<UnaryExpression *>(node);
+        expression->operand = fold(expression->operand, propagate);
+    }
+    break;
+    case ASTNode::Type::FunctionDeclaration: {
+        const auto function = dynamic_cast<FunctionDeclaration *>(node);
+        function->body = fold(function->body, false);
+    }
+    break;
+    case ASTNode::Type::FunctionCall:
+        for (auto &arg : dynamic_cast<FunctionCall *>(node)->args)
+            arg = fold(arg, propagate);
+        break;
+    case ASTNode::Type::ScopeBlock:
+        for (auto &statement : dynamic_cast<ScopeBlock *>(node)->statements)
+            statement = fold(statement, propagate);
+        break;
+    case ASTNode::Type::IfStatement: {
+        const auto statement = dynamic_cast<IfStatement *>(node);
+        statement->condition = fold(statement->condition, propagate);
+        statement->body = fold(statement->body, propagate);
+        if (statement->else_body.has_value())
+            statement->else_body = fold(statement->else_body.value(), propagate);
+    }
+    break;
+    case ASTNode::Type::WhileStatement: {
+        const auto statement = dynamic_cast<WhileStatement *>(node);
+        statement->condition = fold(statement->condition, propagate);
+        statement->body = fold(statement->body, propagate);
+    }
+    break;
+    case ASTNode::Type::ArrayAccess: {
+        const auto access = dynamic_cast<ArrayAccess *>(node);
+        access->array = fold(access->array, propagate);
+        access->index = fold(access->index, propagate);
+    }
+    break;
+    default:
+        break;
+    }
+    return node;
+}
+
+ASTNode *Optimizer::fold_binary(BinaryExpression *expression, const bool propagate)
+{
+    if (expression->op.type == Token::Type::Equals) {
+        // the target is written, not read
+        expression->right = fold(expression->right, propagate);
+        if (expression->left->type == ASTNode::Type::VarDeclaration && propagate) {
+            const auto name = dynamic_cast<VarDeclaration *>(expression->left)->name.text();
+            if (const auto value = number_of(expression->right);
+                value != nullptr && !variable.contains(name))
+                constants[name] = std::stod(std::string(value->text()));
+        }
+        return expression;
+    }
+    if (is_chained(expression->left))
+        return fold_chain(expression, propagate);
+    expression->left = fold(expression->left, propagate);
+    expression->right = fold(expression->right, propagate);
+    return fold_operator(expression);
+}
+
+// Folds the operators of a left-nested chain like a + b + c bottom up, without recursing into
+// the chain. Kept apart from fold_binary(), which nested right operands recurse through.
+ASTNode *Optimizer::fold_chain(BinaryExpression *expression, const bool propagate)
+{
+    const auto base = chains.size();
+    auto length = base + 1;
+    for (auto node = expression->left; is_chained(node);
+         node = dynamic_cast<BinaryExpression *>(node)->left)
+        length++;
+    chains.resize(length);
+    chains[base] = expression;
+    for (auto i = base + 1; i < length; i++)
+        chains[i] = dynamic_cast<BinaryExpression *>(chains[i - 1]->left);
+    auto folded = fold(chains.back()->left, propagate);
+    for (auto i = chains.size(); i-- > base;) {
+        chains[i]->left = folded;
+        chains[i]->right = fold(chains[i]->right, propagate);
+        folded = fold_operator(chains[i]);
+    }
+    chains.resize(base);
+    return folded;
+}
+
+// folds an operator whose operands are already folded
+ASTNode *Optimizer::fold_operator(BinaryExpression *expression)
+{
+    const auto type = expression->op.type;
+    const auto left = number_of(expression->left);
+    const auto right = number_of(expression->right);
+    if (left != nullptr && right != nullptr) {
+        const auto x = std::stod(std::string(left->text()));
+        const auto y = std::stod(std::string(right->text()));
+        double value;
+        switch (type) {
+        case Token::Type::Plus:
+            value = x + y;
+            break;
+        case Token::Type::Minus:
+            value = x - y;
+            break;
+        case Token::Type::Asterisk:
+            value = x * y;
+            break;
+        case Token::Type::Slash:
+            value = x / y;
+            break;
+        default:
+            return expression;
+        }
+        const auto number = make_number(value, expression->op);
+        discard(expression);
+        return number;
+    }
+
+    // identities that hold for every double, including -0, infinities and NaN
+    ASTNode *operand = nullptr;
+    if (((type == Token::Type::Asterisk && is_number(expression->right, 1))
+         || (type == Token::Type::Slash && is_number(expression->right, 1))
+         || (type == Token::Type::Minus && is_number(expression->right, 0))
+         || (type == Token::Type::Plus && is_number(expression->right, -0.0)))
+        && is_numeric(expression->left))
+        operand = std::exchange(expression->left, nullptr);
+    else if (((type == Token::Type::Asterisk && is_number(expression->left, 1))
+              || (type == Token::Type::Plus && is_number(expression->left, -0.0)))
+             && is_numeric(expression->right))
+        operand = std::exchange(expression->right, nullptr);
+    if (operand == nullptr)
+        return expression;
+    discard(expression);
+    return operand;
+}
+
+void optimize(std::vector<ASTNode *> &ast, AstArena *arena)
+{
+    Optimizer(arena).run(ast);
+}
@@ -0,0 +1,115 @@
+#include "parallel_lexer.h"
+#include "scan.h"
+
+#include <algorithm>
+#include <thread>
+
+// Position right after the string literal whose opening quote is at `quote`
+static size_t skip_string(const std::string_view source, size_t quote)
+{
+    auto position = quote + 1;
+    while (true) {
+        position = Scan::find_either(source, position, '"', '\\');
+        if (position >= source.size())
+            return source.size();
+        if (source[position] == '"')
+            return position + 1;
+        position += 2;
+    }
+}
+
+// Position right after the comment starting at `slash`, or `slash + 1` if it does not open one
+static size_t skip_comment(const std::string_view source, const size_t slash)
+{
+    const auto next = slash + 1 < source.size() ? source[slash + 1] : '\0';
+    if (next == '/')
+        return Scan::find(source, slash + 2, '\n');
+    if (next != '*')
+        return slash + 1;
+    auto position = slash + 2;
+    while (true) {
+        position = Scan::find(source, position, '*');
+        if (position + 1 >= source.size())
+            return source.size();
+        if (source[position + 1] == '/')
+            return position + 2;
+        position++;
+    }
+}
+
+std::vector<size_t> find_split_points(const std::string_view source, size_t parts)
+{
+    parts = std::max<size_t>(parts, 1);
+    std::vector<size_t> splits = {0};
+    size_t position = 0;
+    auto target = source.size() / parts;
+    while (splits.size() < parts && position < source.size()) {
+        // quotes and slashes are the only bytes that can leave the code state
+        const auto special = Scan::find_either(source, position, '"', '/');
+        if (target < special) {
+            const auto newline = Scan::find(source, std::max(position, target), '\n');
+            if (newline < special) {
+                splits.push_back(newline + 1);
+                position = newline + 1;
+                target = std::max(target, position) + source.size() / parts;
+                continue;
+            }
+        }
+        if (special >= source.size())
+            break;
+        position = source[special] == '"' ? skip_string(source, special)
+                                          : skip_comment(source, special);
+    }
+    if (splits.size() == 1 || splits.back() != source.size())
+        splits.push_back(source.size());
+    return splits;
+}
+
+std::vector<Token> lex_parallel(
+    const std::string_view source,
+    const Lexer::Mode mode,
+    const size_t threads,
+    const size_t min_chunk_size,
+    AtomTable *atoms)
+{
+    const auto parts =
+        std::clamp<size_t>(source.size() / std::max<size_t>(min_chunk_size, 1), 1, threads);
+    const auto splits = find_split_points(source, parts);
+    const auto chunks = splits.size() - 1;
+
+    std::vector<std::vector<Token>> tokens(chunks);
+    std::vector<size_t> newlines(chunks);
+    {
+        std::vector<std::jthread> workers;
+        for (size_t i = 0; i < chunks; i++) {
+            workers.emplace_back([&, i] {
+                const auto chunk = source.substr(splits[i], splits[i + 1] - splits[i]);
+                Lexer lexer(chunk, mode);
+                for (auto token = lexer.next(); token.type != Token::Type::EndOfFile;
+                     token = lexer.next())
+                    tokens[i].push_back(std::move(token));
+                newlines[i] = Scan::count_newlines(chunk, 0, chunk.size()).count;
+            });
+        }
+    }
+
+    std::vector<Token> result;
+    size_t total = 1;
+    for (const auto &chunk : tokens)
+        total += chunk.size();
+    result.reserve(total);
+    // every chunk starts at column 1, only lines need to be shifted
+    size_t line_offset = 0;
+    for (size_t i = 0; i < chunks; i++) {
+        for (auto &token : tokens[i]) {
+            token.line += line_offset;
+            token.offset += splits[i];
+            if (atoms != nullptr && token.type == Token::Type::Identifier)
+                token.atom = atoms->intern(token.text());
+            result.push_back(std::move(token));
+        }
+        line_offset += newlines[i];
+    }
+    result.push_back({Token::Type::EndOfFile});
+    return result;
+}
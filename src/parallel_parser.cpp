@@ -0,0 +1,182 @@
+#include "parallel_parser.h"
+#include "parser.h"
+
+#include <algorithm>
+#include <cassert>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <utility>
+
+// tokens that make the expression before them their operand, a unit cannot start with one
+static bool continues_expression(const Token::Type type)
+{
+    switch (type) {
+    case Token::Type::Plus:
+    case Token::Type::Minus:
+    case Token::Type::Asterisk:
+    case Token::Type::Slash:
+    case Token::Type::Equals:
+    case Token::Type::LooseEquality:
+    case Token::Type::StrictEquality:
+    case Token::Type::Dot:
+    case Token::Type::LeftBracket:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// tokens after which a function declaration is an operand rather than a statement
+static bool takes_operand(const Token::Type type)
+{
+    return type == Token::Type::New || (type != Token::Type::LeftBracket && continues_expression(type));
+}
+
+// index of the brace closing the body of the function declared at `function`, or `end`
+static size_t find_function_end(const std::vector<Token> &tokens, size_t function, size_t end)
+{
+    auto position = function;
+    while (position < end && tokens[position].type != Token::Type::LeftBrace)
+        position++;
+    size_t braces = 0;
+    for (; position < end; position++) {
+        if (tokens[position].type == Token::Type::LeftBrace)
+            braces++;
+        else if (tokens[position].type == Token::Type::RightBrace && --braces == 0)
+            return position;
+    }
+    return end;
+}
+
+std::vector<size_t> find_top_level_units(const std::vector<Token> &tokens)
+{
+    assert(!tokens.empty() && tokens.back().type == Token::Type::EndOfFile);
+    const auto end = tokens.size() - 1;
+    std::vector<size_t> units = {0};
+    size_t depth = 0;
+    // an if or while whose condition is being read, and a token that starts the body of an if,
+    // while or else: a function there belongs to that statement
+    auto condition = false;
+    auto body_next = false;
+    for (size_t i = 0; i < end; i++) {
+        const auto body = std::exchange(body_next, false);
+        switch (tokens[i].type) {
+        case Token::Type::If:
+        case Token::Type::While:
+            condition = depth == 0;
+            break;
+        case Token::Type::Else:
+            body_next = depth == 0;
+            break;
+        case Token::Type::LeftParenthesis:
+        case Token::Type::LeftBracket:
+        case Token::Type::LeftBrace:
+            depth++;
+            break;
+        case Token::Type::RightParenthesis:
+        case Token::Type::RightBracket:
+        case Token::Type::RightBrace:
+            depth -= depth > 0 ? 1 : 0;
+            if (condition && depth == 0) {
+                condition = false;
+                body_next = true;
+            }
+            break;
+        case Token::Type::Function: {
+            if (depth != 0)
+                break;
+            const auto close = find_function_end(tokens, i, end);
+            if (close == end) {
+                i = end;
+                break;
+            }
+            if (!body && (i == 0 || !takes_operand(tokens[i - 1].type))) {
+                if (units.back() != i)
+                    units.push_back(i);
+                if (!continues_expression(tokens[close + 1].type) && close + 1 < end)
+                    units.push_back(close + 1);
+            }
+            i = close;
+        }
+        break;
+        default:
+            break;
+        }
+    }
+    if (units.back() != end)
+        units.push_back(end);
+    return units;
+}
+
+// Runs `work(i)` for i in [0, count) on up to `threads` threads. Every index runs even if some
+// throw, the first exception in index order is then rethrown.
+template<typename Work>
+static void run_pool(const size_t count, const size_t threads, Work work)
+{
+    std::vector<std::exception_ptr> errors(count);
+    std::atomic<size_t> next = 0;
+    const auto worker = [&] {
+        for (auto i = next++; i < count; i = next++) {
+            try {
+                work(i);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+    {
+        std::vector<std::jthread> workers;
+        for (size_t i = 1; i < std::min(threads, count); i++)
+            workers.emplace_back(worker);
+        worker();
+    }
+    for (const auto &error : errors) {
+        if (error)
+            std::rethrow_exception(error);
+    }
+}
+
+std::vector<ASTNode *> parse_parallel(const std::vector<Token> &tokens, const size_t threads)
+{
+    const auto units = find_top_level_units(tokens);
+    std::vector<std::vector<ASTNode *>> trees(units.size() - 1);
+    try {
+        run_pool(trees.size(), threads, [&](const size_t i) {
+            std::vector<Token> unit;
+            unit.reserve(units[i + 1] - units[i] + 1);
+            unit.insert(unit.end(), tokens.begin() + units[i], tokens.begin() + units[i + 1]);
+            unit.push_back(tokens.back());
+            Lexer lexer(std::move(unit));
+            trees[i] = parse(lexer);
+        });
+    } catch (...) {
+        for (const auto &tree : trees)
+            destroy_ast(tree);
+        throw;
+    }
+
+    std::vector<ASTNode *> ast;
+    for (const auto &tree : trees)
+        ast.insert(ast.end(), tree.begin(), tree.end());
+    return ast;
+}
+
+void compile_parallel(
+    const std::vector<ASTNode *> &ast, OLRuntime::Program &program, const size_t threads)
+{
+    const auto parts = std::clamp<size_t>(threads, 1, std::max<size_t>(ast.size(), 1));
+    std::vector<OLRuntime::Program> units(parts);
+    const auto shared_atoms = program.atoms.size();
+    run_pool(parts, threads, [&](const size_t i) {
+        auto &unit = units[i];
+        unit.atoms = program.atoms;
+        unit.separate = true;
+        const auto first = ast.size() * i / parts;
+        const auto last = ast.size() * (i + 1) / parts;
+        for (auto node = first; node < last; node++)
+            ast[node]->compile(unit);
+    });
+    for (const auto &unit : units)
+        program.link(unit, shared_atoms);
+}
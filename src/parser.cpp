@@ -1,70 +1,117 @@
 #include "parser.h"
+#include "ast_arena.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <iostream>
+#include <ranges>
 #include <stdexcept>
+#include <utility>
 
 enum class Precedence
 {
     Lowest = 0,
+    Assignment,
     Equals,
     Sum,
     Product,
     Parenthesis,
 };
 
-static Precedence get_precedence(Token::Type type)
+enum class Associativity
 {
-    switch (type) {
-    case Token::Type::StrictEquality:
-    case Token::Type::LooseEquality:
-    case Token::Type::Equals:
-        return Precedence::Equals;
-    case Token::Type::Plus:
-    case Token::Type::Minus:
-        return Precedence::Sum;
-    case Token::Type::Asterisk:
-    case Token::Type::Slash:
-        return Precedence::Product;
-    default:
-        return Precedence::Lowest;
-    }
+    Left,
+    Right,
+};
+
+struct BinaryOperator
+{
+    Precedence precedence = Precedence::Lowest;
+    Associativity associativity = Associativity::Left;
+};
+
+// Binary operators by token type, tokens left at Precedence::Lowest are not binary operators.
+// Assignment groups to the right, so a = b = c stores c in both, the others to the left.
+static constexpr auto binary_operators = [] {
+    std::array<BinaryOperator, static_cast<size_t>(Token::Type::Null) + 1> table{};
+    const auto set = [&](Token::Type type, Precedence precedence, Associativity associativity) {
+        table[static_cast<size_t>(type)] = {precedence, associativity};
+    };
+    set(Token::Type::Equals, Precedence::Assignment, Associativity::Right);
+    set(Token::Type::LooseEquality, Precedence::Equals, Associativity::Left);
+    set(Token::Type::StrictEquality, Precedence::Equals, Associativity::Left);
+    set(Token::Type::Plus, Precedence::Sum, Associativity::Left);
+    set(Token::Type::Minus, Precedence::Sum, Associativity::Left);
+    set(Token::Type::Asterisk, Precedence::Product, Associativity::Left);
+    set(Token::Type::Slash, Precedence::Product, Associativity::Left);
+    return table;
+}();
+
+static const BinaryOperator &get_operator(Token::Type type)
+{
+    return binary_operators[static_cast<size_t>(type)];
 }
 
-static Precedence get_precedence(const ASTNode *node)
+static bool is_binary_operator(Token::Type type)
 {
-    switch (node->type) {
-    case ASTNode::Type::BinaryExpression:
-        return get_precedence(dynamic_cast<const BinaryExpression *>(node)->op.type);
-    case ASTNode::Type::ParenthesizedExpression:
-        return Precedence::Parenthesis;
-    default:
-        return Precedence::Lowest;
-    }
+    return get_operator(type).precedence != Precedence::Lowest;
 }
 
-static ASTNode *read_var_declaration(Lexer &lexer)
+// Arena of the parse running on this thread, nodes are heap allocated when there is none
+static thread_local AstArena *current_arena = nullptr;
+
+template<typename T, typename... Args>
+static T *make(Args &&...args)
 {
-    auto token = lexer.next();
-    assert(token.type == Token::Type::Var);
-    token = lexer.next();
-    assert(token.type == Token::Type::Identifier);
-    return new VarDeclaration(token);
+    if (current_arena != nullptr)
+        return current_arena->make<T>(std::forward<Args>(args)...);
+    return new T(std::forward<Args>(args)...);
 }
 
-static ASTNode *handle_precedence(ASTNode *old, ASTNode *new_node, const Token &op)
+static NodeList make_list()
 {
-    if (old->type != ASTNode::Type::BinaryExpression) {
-        return new BinaryExpression(old, new_node, op);
-    }
-    const auto old_node = dynamic_cast<BinaryExpression *>(old);
-    if (get_precedence(op.type) >= get_precedence(old)) {
-        const auto right =
-            old_node->right->type == ASTNode::Type::BinaryExpression
-                ? handle_precedence(old_node->right, new_node, op)
-                : new BinaryExpression(old_node->right, new_node, op);
-        return new BinaryExpression(old_node->left, right, old_node->op);
+    return NodeList(
+        current_arena != nullptr ? current_arena->resource() : std::pmr::get_default_resource());
+}
+
+// arena nodes never run their destructors, so tokens must not own heap memory
+static Token keep(Token token)
+{
+    if (current_arena != nullptr && !token.value.empty()) {
+        token.span = current_arena->keep(token.value);
+        std::string().swap(token.value);
     }
-    return new BinaryExpression(old, new_node, op);
+    return token;
+}
+
+[[noreturn]] static void unexpected(const Token &token, const std::string_view expected)
+{
+    throw std::runtime_error("Expected " + std::string(expected) + " at line "
+                             + std::to_string(token.line) + ", column "
+                             + std::to_string(token.column));
+}
+
+// consumes the next token, which malformed input may not have of the type the grammar needs
+static Token expect(Lexer &lexer, const Token::Type type, const std::string_view expected)
+{
+    if (lexer.peek().type != type)
+        unexpected(lexer.peek(), expected);
+    return lexer.next();
+}
+
+// an unterminated construct, like (1 + 2 or { 1, runs into the end of the input
+static void expect_more(Lexer &lexer, const std::string_view close)
+{
+    if (lexer.peek().type == Token::Type::EndOfFile)
+        unexpected(lexer.peek(), std::string(close) + " before the end of the input");
+}
+
+static ASTNode *read_var_declaration(Lexer &lexer)
+{
+    const auto token = lexer.next();
+    assert(token.type == Token::Type::Var);
+    return make<VarDeclaration>(keep(expect(lexer, Token::Type::Identifier, "a variable name")));
 }
 
 static bool is_expression_ended(const Token &current, const Token &next)
@@ -76,255 +123,798 @@ static bool is_expression_ended(const Token &current, const Token &next)
     return false;
 }
 
-static ASTNode *read_expression(Lexer &lexer, std::vector<ASTNode *> &nodes);
+// read by every parser, including the workers of parse_parallel()
+static std::atomic<size_t> max_depth = default_max_parse_depth;
 
-static ASTNode *read_expression(Lexer &lexer)
+void set_max_parse_depth(const size_t depth)
 {
-    std::vector<ASTNode *> nodes;
-    while (!is_expression_ended(lexer.current(), lexer.peek()))
-        nodes.push_back(read_expression(lexer, nodes));
-    assert(nodes.size() == 1);
-    return nodes.back();
+    max_depth.store(depth, std::memory_order_relaxed);
 }
 
-static ASTNode *read_scope_block(Lexer &lexer)
+size_t max_parse_depth()
 {
-    auto token = lexer.next();
-    assert(token.type == Token::Type::LeftBrace);
-    std::vector<ASTNode *> statements;
-    while (lexer.peek().type != Token::Type::RightBrace) {
-        assert(lexer.peek().type != Token::Type::EndOfFile);
-        statements.push_back(read_expression(lexer, statements));
-    }
-    token = lexer.next();
-    assert(token.type == Token::Type::RightBrace);
-    return new ScopeBlock(statements);
+    return max_depth.load(std::memory_order_relaxed);
 }
 
-static ASTNode *read_func_declaration(Lexer &lexer)
+// A read_* call of the parser suspended on the explicit stack. `step` says where it resumes once
+// the frame it pushed has finished and left its node in Parser::result.
+struct Frame
 {
-    auto token = lexer.next();
-    assert(token.type == Token::Type::Function);
+    enum class Kind
+    {
+        Expression,
+        // an expression where a statement is expected, the only place a block may start
+        Statement,
+        Binary,
+        Line,
+        Parenthesized,
+        Scope,
+        Function,
+        Call,
+        If,
+        While,
+        ArrayAccess,
+        Field,
+        Constructor,
+    } kind;
+    // frame whose list the expression is read into, operators take their left operand from its
+    // back; Parser::caller stands for the list passed to Parser::read_expression
+    size_t target;
+    // statements, arguments or condition read by this frame, the operands of an operator chain
+    NodeList nodes;
+    int step = 0;
+    // name of a function or call
+    Token token{};
+    // operators of a chain that still wait for their right operand
+    std::vector<Token> operators{};
+    ASTNode *left = nullptr;
+    ASTNode *right = nullptr;
+};
+
+// Recursive descent parser running on a heap allocated stack of frames, so nesting depth is
+// bounded by max_parse_depth() instead of the size of the thread's stack
+class Parser
+{
+    static constexpr size_t caller = SIZE_MAX;
+
+    Lexer &lexer;
+    const size_t limit = max_parse_depth();
+    // frames past `depth` are kept for reuse, with the capacity of their lists
+    std::vector<Frame> frames;
+    size_t depth = 0;
+    NodeList *caller_nodes = nullptr;
+    ASTNode *result = nullptr;
+
+    NodeList &list(const size_t target)
+    {
+        return target == caller ? *caller_nodes : frames[target].nodes;
+    }
 
-    // read function name
-    token = lexer.next();
-    assert(token.type == Token::Type::Identifier);
-    const auto name = token;
+    // the running frame, as a target for the expressions it reads into its own list
+    [[nodiscard]] size_t self() const { return depth - 1; }
 
-    // read function arguments
-    token = lexer.next();
-    assert(token.type == Token::Type::LeftParenthesis);
-    std::vector<ASTNode *> args;
-    while (true) {
-        assert(lexer.peek().type != Token::Type::EndOfFile);
-        args.push_back(read_expression(lexer, args));
-        token = lexer.next();
-        if (token.type == Token::Type::RightParenthesis)
-            break;
-        assert(token.type == Token::Type::Comma);
+    [[noreturn]] void too_deep()
+    {
+        throw std::runtime_error("Nesting too deep at line " + std::to_string(lexer.peek().line)
+                                 + ", the limit is " + std::to_string(limit) + " levels");
+    }
+
+    // an operator, '[' or '.' applies to the expression read before it into the same list
+    void expect_operand(const Frame &frame)
+    {
+        if (!list(frame.target).empty())
+            return;
+        const auto &token = lexer.peek();
+        throw std::runtime_error("Expected an expression before '" + std::string(token.text())
+                                 + "' at line " + std::to_string(token.line) + ", column "
+                                 + std::to_string(token.column));
+    }
+
+    // the one expression of a line, a condition, an index or parentheses, before the token that
+    // ends it
+    [[nodiscard]] ASTNode *single_expression(const Frame &frame) const
+    {
+        if (frame.nodes.size() != 1)
+            unexpected(lexer.peek(), frame.nodes.empty() ? "an expression" : "a single expression");
+        return frame.nodes.back();
+    }
+
+    // A call that reads a single token or a var declaration completes right away, without a
+    // frame, the caller then resumes as if a frame had returned. A function call still gets one.
+    bool read_leaf()
+    {
+        while (lexer.peek().type == Token::Type::Semicolon)
+            lexer.next();
+        switch (lexer.peek().type) {
+        case Token::Type::Var:
+            result = read_var_declaration(lexer);
+            return true;
+        case Token::Type::Number:
+        case Token::Type::String:
+        case Token::Type::True:
+        case Token::Type::False:
+        case Token::Type::Null:
+            result = make<SingleNode>(keep(lexer.next()));
+            return true;
+        case Token::Type::Identifier: {
+            auto id = lexer.next();
+            if (lexer.peek().type != Token::Type::LeftParenthesis) {
+                result = make<SingleNode>(keep(std::move(id)));
+                return true;
+            }
+            push(Frame::Kind::Call, caller).token = std::move(id);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    void call(const Frame::Kind kind, const size_t target)
+    {
+        if ((kind != Frame::Kind::Expression && kind != Frame::Kind::Statement) || !read_leaf())
+            push(kind, target);
+    }
+
+    Frame &push(const Frame::Kind kind, const size_t target)
+    {
+        if (depth >= limit)
+            too_deep();
+        if (depth++ == frames.size())
+            return frames.emplace_back(kind, target, make_list());
+        auto &frame = frames[depth - 1];
+        frame.kind = kind;
+        frame.target = target;
+        frame.step = 0;
+        frame.left = frame.right = nullptr;
+        frame.nodes.clear();
+        return frame;
+    }
+
+    // replaces the running frame, for calls that are the last thing a frame does
+    static void become(Frame &frame, const Frame::Kind kind)
+    {
+        frame.kind = kind;
+        frame.step = 0;
+    }
+
+    void finish(ASTNode *node)
+    {
+        result = node;
+        depth--;
+    }
+
+    void read_expression(Frame &frame);
+    void read_binary_expression(Frame &frame);
+    void read_line(Frame &frame);
+    void read_enclosed(Frame &frame);
+    void read_func_declaration(Frame &frame);
+    void read_function_call(Frame &frame);
+    void read_if_statement(Frame &frame);
+    void read_while_statement(Frame &frame);
+    void read_array_access(Frame &frame);
+    void read_operand(Frame &frame);
+
+public:
+    explicit Parser(Lexer &lexer)
+        : lexer(lexer)
+    {
+        frames.reserve(64);
     }
 
-    // read function body
-    token = lexer.peek();
-    assert(token.type == Token::Type::LeftBrace);
-    const auto body = read_scope_block(lexer);
+    // reads the next expression of `nodes`, nullptr at the end of the input
+    ASTNode *read_expression(NodeList &nodes);
+};
 
-    return new FunctionDeclaration(name, args, body);
+ASTNode *Parser::read_expression(NodeList &nodes)
+{
+    caller_nodes = &nodes;
+    call(Frame::Kind::Statement, caller);
+    try {
+        while (depth != 0) {
+            auto &frame = frames[depth - 1];
+            switch (frame.kind) {
+            case Frame::Kind::Expression:
+            case Frame::Kind::Statement:
+                read_expression(frame);
+                break;
+            case Frame::Kind::Binary:
+                read_binary_expression(frame);
+                break;
+            case Frame::Kind::Line:
+                read_line(frame);
+                break;
+            case Frame::Kind::Parenthesized:
+            case Frame::Kind::Scope:
+                read_enclosed(frame);
+                break;
+            case Frame::Kind::Function:
+                read_func_declaration(frame);
+                break;
+            case Frame::Kind::Call:
+                read_function_call(frame);
+                break;
+            case Frame::Kind::If:
+                read_if_statement(frame);
+                break;
+            case Frame::Kind::While:
+                read_while_statement(frame);
+                break;
+            case Frame::Kind::ArrayAccess:
+                read_array_access(frame);
+                break;
+            case Frame::Kind::Field:
+            case Frame::Kind::Constructor:
+                read_operand(frame);
+                break;
+            }
+        }
+    } catch (...) {
+        // the unfinished nodes belong to the frames, arena nodes go away with their arena
+        if (current_arena == nullptr) {
+            for (const auto &frame : frames | std::views::take(depth)) {
+                delete frame.left;
+                delete frame.right;
+                for (const auto &node : frame.nodes)
+                    delete node;
+            }
+        }
+        for (auto &frame : frames | std::views::take(depth)) {
+            frame.left = frame.right = nullptr;
+            frame.nodes.clear();
+            frame.operators.clear();
+        }
+        depth = 0;
+        throw;
+    }
+    return result;
 }
 
-static ASTNode *read_parenthesized_expression(Lexer &lexer)
+void Parser::read_expression(Frame &frame)
 {
-    std::vector<ASTNode *> nodes;
-    auto token = lexer.next();
-    assert(token.type == Token::Type::LeftParenthesis);
-    while (lexer.peek().type != Token::Type::RightParenthesis) {
-        assert(lexer.peek().type != Token::Type::EndOfFile);
-        nodes.push_back(read_expression(lexer, nodes));
+    while (lexer.peek().type == Token::Type::Semicolon)
+        lexer.next();
+    switch (lexer.peek().type) {
+    case Token::Type::EndOfFile:
+        return finish(nullptr);
+    case Token::Type::If:
+        return become(frame, Frame::Kind::If);
+    case Token::Type::While:
+        return become(frame, Frame::Kind::While);
+    case Token::Type::Function:
+        return become(frame, Frame::Kind::Function);
+    case Token::Type::Var:
+        return finish(read_var_declaration(lexer));
+    case Token::Type::Number:
+    case Token::Type::String:
+    case Token::Type::True:
+    case Token::Type::False:
+    case Token::Type::Null:
+        return finish(make<SingleNode>(keep(lexer.next())));
+    case Token::Type::Identifier: {
+        auto id = lexer.next();
+        if (lexer.peek().type != Token::Type::LeftParenthesis)
+            return finish(make<SingleNode>(keep(std::move(id))));
+        frame.token = std::move(id);
+        return become(frame, Frame::Kind::Call);
+    }
+    case Token::Type::Plus:
+    case Token::Type::Minus:
+    case Token::Type::Asterisk:
+    case Token::Type::Slash:
+    case Token::Type::Equals:
+    case Token::Type::LooseEquality:
+    case Token::Type::StrictEquality:
+        expect_operand(frame);
+        frame.nodes.push_back(list(frame.target).back());
+        list(frame.target).pop_back();
+        return become(frame, Frame::Kind::Binary);
+    case Token::Type::Dot:
+        expect_operand(frame);
+        lexer.next(); // consume '.'
+        return become(frame, Frame::Kind::Field);
+    case Token::Type::LeftParenthesis:
+        return become(frame, Frame::Kind::Parenthesized);
+    case Token::Type::LeftBrace: {
+        if (frame.kind == Frame::Kind::Statement)
+            return become(frame, Frame::Kind::Scope);
+        const auto &token = lexer.peek();
+        throw std::runtime_error("A block can only start a statement, found '{' at line "
+                                 + std::to_string(token.line) + ", column "
+                                 + std::to_string(token.column));
     }
-    token = lexer.next();
-    assert(token.type == Token::Type::RightParenthesis);
-    assert(nodes.size() == 1);
-    return new ParenthesizedExpression(nodes.back());
+    case Token::Type::LeftBracket:
+        return become(frame, Frame::Kind::ArrayAccess);
+    case Token::Type::New:
+        lexer.next(); // consume 'new'
+        return become(frame, Frame::Kind::Constructor);
+    default:
+        break;
+    }
+    throw std::runtime_error(
+        "Unhandled token: " + std::to_string(static_cast<int>(lexer.peek().type)));
 }
 
-static ASTNode *read_if_statement(Lexer &lexer)
+// Reads an operator chain with an operand stack, `nodes`, and an operator stack. An operator
+// first folds the operators on the stack that bind at least as tightly, on ties only when it
+// groups to the left, so each BinaryExpression is allocated once with its final operands.
+void Parser::read_binary_expression(Frame &frame)
 {
-    auto token = lexer.next();
-    assert(token.type == Token::Type::If);
+    const auto reduce = [&] {
+        const auto right = frame.nodes.back();
+        frame.nodes.pop_back();
+        const auto left = frame.nodes.back();
+        frame.nodes.back() = make<BinaryExpression>(left, right, keep(frame.operators.back()));
+        frame.operators.pop_back();
+    };
+    while (true) {
+        if (frame.step == 1) {
+            // the input ended right after the operator
+            if (result == nullptr) {
+                const auto &op = frame.operators.back();
+                throw std::runtime_error("Expected an expression after '" + std::string(op.text())
+                                         + "' at line " + std::to_string(op.line) + ", column "
+                                         + std::to_string(op.column));
+            }
+            frame.nodes.push_back(result);
+        }
+        if (!is_binary_operator(lexer.peek().type)) {
+            while (!frame.operators.empty())
+                reduce();
+            const auto expression = frame.nodes.back();
+            frame.nodes.clear();
+            return finish(expression);
+        }
+        const auto &next = get_operator(lexer.peek().type);
+        while (!frame.operators.empty()) {
+            const auto &top = get_operator(frame.operators.back().type);
+            if (top.precedence < next.precedence
+                || (top.precedence == next.precedence && next.associativity == Associativity::Right))
+                break;
+            reduce();
+        }
+        // pending operators are nesting levels of the finished tree
+        if (depth + frame.operators.size() >= limit)
+            too_deep();
+        frame.operators.push_back(lexer.next());
+        frame.step = 1;
+        const auto before = depth;
+        call(Frame::Kind::Expression, frame.target);
+        // carry on in place while the operands are leaves
+        if (depth != before)
+            return;
+    }
+}
 
-    // read condition
-    token = lexer.next();
-    assert(token.type == Token::Type::LeftParenthesis);
-    std::vector<ASTNode *> nodes;
-    while (lexer.peek().type != Token::Type::RightParenthesis) {
-        assert(lexer.peek().type != Token::Type::EndOfFile);
-        nodes.push_back(read_expression(lexer, nodes));
+// a statement that ends with its line, the body of an if without braces
+void Parser::read_line(Frame &frame)
+{
+    if (frame.step == 1)
+        frame.nodes.push_back(result);
+    if (is_expression_ended(lexer.current(), lexer.peek()))
+        return finish(single_expression(frame));
+    frame.step = 1;
+    call(Frame::Kind::Expression, self());
+}
+
+// parenthesized expressions and scope blocks
+void Parser::read_enclosed(Frame &frame)
+{
+    const auto parenthesized = frame.kind == Frame::Kind::Parenthesized;
+    const auto close = parenthesized ? Token::Type::RightParenthesis : Token::Type::RightBrace;
+    if (frame.step == 0) {
+        auto token = lexer.next();
+        assert(token.type
+               == (parenthesized ? Token::Type::LeftParenthesis : Token::Type::LeftBrace));
+        frame.step = 1;
+    } else {
+        frame.nodes.push_back(result);
+    }
+    if (lexer.peek().type != close) {
+        expect_more(lexer, parenthesized ? "')'" : "'}'");
+        return call(parenthesized ? Frame::Kind::Expression : Frame::Kind::Statement, self());
     }
-    token = lexer.next();
-    assert(nodes.size() == 1);
-    const auto condition = nodes.back();
-    assert(token.type == Token::Type::RightParenthesis);
+    if (!parenthesized) {
+        lexer.next();
+        return finish(make<ScopeBlock>(std::move(frame.nodes)));
+    }
+    const auto expression = single_expression(frame);
+    lexer.next();
+    finish(make<ParenthesizedExpression>(expression));
+}
 
-    // read body
-    token = lexer.peek();
-    ASTNode *body = token.type == Token::Type::LeftBrace
-                        ? read_scope_block(lexer)
-                        : read_expression(lexer);
+void Parser::read_func_declaration(Frame &frame)
+{
+    switch (frame.step) {
+    case 0: {
+        auto token = lexer.next();
+        assert(token.type == Token::Type::Function);
+
+        // read function name
+        frame.token = expect(lexer, Token::Type::Identifier, "a function name");
+
+        // read function arguments
+        expect(lexer, Token::Type::LeftParenthesis, "'('");
+        expect_more(lexer, "')'");
+        frame.step = 1;
+        return call(Frame::Kind::Expression, self());
+    }
+    case 1: {
+        frame.nodes.push_back(result);
+        if (lexer.peek().type != Token::Type::RightParenthesis) {
+            expect(lexer, Token::Type::Comma, "',' or ')'");
+            expect_more(lexer, "')'");
+            return call(Frame::Kind::Expression, self());
+        }
+        lexer.next();
 
-    // read else clause if found
-    if (lexer.peek().type == Token::Type::Else) {
-        lexer.next(); // consume 'else' token
-        ASTNode *elseClause;
-        if (lexer.peek().type == Token::Type::LeftBrace)
-            elseClause = read_scope_block(lexer);
-        else
-            elseClause = read_expression(lexer);
-        return new IfStatement(condition, body, elseClause);
+        // read function body
+        if (lexer.peek().type != Token::Type::LeftBrace)
+            unexpected(lexer.peek(), "'{'");
+        frame.step = 2;
+        return call(Frame::Kind::Scope, caller);
     }
+    default:
+        finish(make<FunctionDeclaration>(keep(frame.token), std::move(frame.nodes), result));
+    }
+}
+
+void Parser::read_function_call(Frame &frame)
+{
+    if (frame.step == 0) {
+        assert(frame.token.type == Token::Type::Identifier);
+        const auto token = lexer.next();
+        assert(token.type == Token::Type::LeftParenthesis);
+        frame.step = 1;
+    } else {
+        frame.nodes.push_back(result);
+        if (lexer.peek().type == Token::Type::Comma)
+            lexer.next();
+    }
+    if (lexer.peek().type != Token::Type::RightParenthesis) {
+        expect_more(lexer, "')'");
+        return call(Frame::Kind::Expression, self());
+    }
+    lexer.next();
+    finish(make<FunctionCall>(make<SingleNode>(keep(frame.token)), std::move(frame.nodes)));
+}
 
-    return new IfStatement(condition, body);
+// body of an if or else clause, a block or a single line
+static Frame::Kind clause_kind(Lexer &lexer)
+{
+    return lexer.peek().type == Token::Type::LeftBrace ? Frame::Kind::Scope : Frame::Kind::Line;
 }
 
-static ASTNode *read_while_statement(Lexer &lexer)
+void Parser::read_if_statement(Frame &frame)
 {
-    auto token = lexer.next();
-    assert(token.type == Token::Type::While);
+    switch (frame.step) {
+    case 0: {
+        auto token = lexer.next();
+        assert(token.type == Token::Type::If);
+        expect(lexer, Token::Type::LeftParenthesis, "'(' after 'if'");
+        frame.step = 1;
+    }
+    break;
+    case 1:
+        frame.nodes.push_back(result);
+        break;
+    case 2:
+        frame.right = result;
+        // read else clause if found
+        if (lexer.peek().type == Token::Type::Else) {
+            lexer.next(); // consume 'else' token
+            frame.step = 3;
+            return call(clause_kind(lexer), caller);
+        }
+        return finish(make<IfStatement>(
+            std::exchange(frame.left, nullptr), std::exchange(frame.right, nullptr)));
+    default:
+        return finish(make<IfStatement>(
+            std::exchange(frame.left, nullptr), std::exchange(frame.right, nullptr), result));
+    }
 
     // read condition
-    token = lexer.next();
-    assert(token.type == Token::Type::LeftParenthesis);
-    std::vector<ASTNode *> nodes;
-    while (lexer.peek().type != Token::Type::RightParenthesis) {
-        assert(lexer.peek().type != Token::Type::EndOfFile);
-        nodes.push_back(read_expression(lexer, nodes));
+    if (lexer.peek().type != Token::Type::RightParenthesis) {
+        expect_more(lexer, "')'");
+        return call(Frame::Kind::Expression, self());
     }
-    token = lexer.next();
-    assert(nodes.size() == 1);
-    const auto condition = nodes.back();
-    assert(token.type == Token::Type::RightParenthesis);
+    frame.left = single_expression(frame);
+    frame.nodes.clear();
+    lexer.next();
 
     // read body
-    token = lexer.peek();
-    assert(token.type == Token::Type::LeftBrace);
-    const auto body = read_scope_block(lexer);
+    frame.step = 2;
+    call(clause_kind(lexer), caller);
+}
+
+void Parser::read_while_statement(Frame &frame)
+{
+    switch (frame.step) {
+    case 0: {
+        auto token = lexer.next();
+        assert(token.type == Token::Type::While);
+        expect(lexer, Token::Type::LeftParenthesis, "'(' after 'while'");
+        frame.step = 1;
+    }
+    break;
+    case 1:
+        frame.nodes.push_back(result);
+        break;
+    default:
+        return finish(make<WhileStatement>(std::exchange(frame.left, nullptr), result));
+    }
+
+    // read condition
+    if (lexer.peek().type != Token::Type::RightParenthesis) {
+        expect_more(lexer, "')'");
+        return call(Frame::Kind::Expression, self());
+    }
+    frame.left = single_expression(frame);
+    frame.nodes.clear();
+    lexer.next();
 
-    return new WhileStatement(condition, body);
+    // read body
+    if (lexer.peek().type != Token::Type::LeftBrace)
+        unexpected(lexer.peek(), "'{' after the condition of 'while'");
+    frame.step = 2;
+    call(Frame::Kind::Scope, caller);
 }
 
-static ASTNode *read_array_access(Lexer &lexer, std::vector<ASTNode *> &nodes)
+void Parser::read_array_access(Frame &frame)
 {
-    auto token = lexer.next();
-    assert(token.type == Token::Type::LeftBracket);
+    if (frame.step == 0) {
+        expect_operand(frame);
+        const auto token = lexer.next();
+        assert(token.type == Token::Type::LeftBracket);
+        frame.step = 1;
+    } else {
+        frame.nodes.push_back(result);
+    }
 
     // read array index
-    std::vector<ASTNode *> index_nodes;
-    while (lexer.peek().type != Token::Type::RightBracket) {
-        assert(lexer.peek().type != Token::Type::EndOfFile);
-        index_nodes.push_back(read_expression(lexer, index_nodes));
+    if (lexer.peek().type != Token::Type::RightBracket) {
+        expect_more(lexer, "']'");
+        return call(Frame::Kind::Expression, self());
     }
-    assert(index_nodes.size() == 1);
+    const auto index = single_expression(frame);
+    lexer.next();
 
-    token = lexer.next();
-    assert(token.type == Token::Type::RightBracket);
+    const auto array = list(frame.target).back();
+    list(frame.target).pop_back();
+    finish(make<ArrayAccess>(array, index));
+}
 
-    const auto array = nodes.back();
-    nodes.pop_back();
-    return new ArrayAccess(array, index_nodes.back());
+// the expression after '.' or 'new'
+void Parser::read_operand(Frame &frame)
+{
+    if (frame.step == 0) {
+        frame.step = 1;
+        return call(Frame::Kind::Expression, frame.target);
+    }
+    if (frame.kind == Frame::Kind::Constructor)
+        return finish(make<Constructor>(result));
+    const auto record = list(frame.target).back();
+    list(frame.target).pop_back();
+    finish(make<FieldAccess>(record, result));
 }
 
-static ASTNode *read_function_call(Lexer &lexer)
+std::vector<ASTNode *> parse(const std::string &source)
 {
-    const auto name = lexer.current();
-    assert(name.type == Token::Type::Identifier);
+    return parse(source, Lexer::Mode::Copy);
+}
 
-    std::vector<ASTNode *> args;
-    auto token = lexer.next();
-    assert(token.type == Token::Type::LeftParenthesis);
-    while (lexer.peek().type != Token::Type::RightParenthesis) {
-        assert(lexer.peek().type != Token::Type::EndOfFile);
-        args.push_back(read_expression(lexer, args));
-        if (lexer.peek().type == Token::Type::Comma)
-            lexer.next();
-    }
-    token = lexer.next();
-    assert(token.type == Token::Type::RightParenthesis);
+std::vector<ASTNode *> parse(const std::string_view source, const Lexer::Mode mode)
+{
+    Lexer lexer(source, mode);
+    return parse(lexer);
+}
 
-    return new FunctionCall(new SingleNode(name), args);
+std::vector<ASTNode *> parse(Lexer &lexer, AstArena &arena)
+{
+    const auto previous = current_arena;
+    current_arena = &arena;
+    try {
+        auto ast = parse(lexer);
+        current_arena = previous;
+        return ast;
+    } catch (...) {
+        current_arena = previous;
+        throw;
+    }
 }
 
-static ASTNode *read_expression(Lexer &lexer, std::vector<ASTNode *> &nodes)
+std::vector<ASTNode *> parse(Lexer &lexer)
 {
-    while (true) {
-        if (lexer.peek().type == Token::Type::EndOfFile)
-            break;
-        if (lexer.peek().type == Token::Type::Semicolon) {
-            lexer.next();
-            return read_expression(lexer, nodes);
-        }
-        switch (lexer.peek().type) {
-        case Token::Type::If:
-            return read_if_statement(lexer);
-        case Token::Type::While:
-            return read_while_statement(lexer);
-        case Token::Type::Function:
-            return read_func_declaration(lexer);
-        case Token::Type::Var:
-            return read_var_declaration(lexer);
-        case Token::Type::Number:
-        case Token::Type::String:
-            return new SingleNode(lexer.next());
-        case Token::Type::Identifier: {
-            const auto id = lexer.next();
-            if (lexer.peek().type == Token::Type::LeftParenthesis)
-                return read_function_call(lexer);
-            return new SingleNode(id);
-        }
-        case Token::Type::Plus:
-        case Token::Type::Minus:
-        case Token::Type::Asterisk:
-        case Token::Type::Slash:
-        case Token::Type::Equals:
-        case Token::Type::LooseEquality:
-        case Token::Type::StrictEquality: {
-            const auto op = lexer.next();
-            const auto left = nodes.back();
-            nodes.pop_back();
-            const auto right = read_expression(lexer, nodes);
-            return handle_precedence(left, right, op);
-        }
-        case Token::Type::Dot: {
-            auto token = lexer.next(); // consume '.'
-            const auto field = read_expression(lexer, nodes);
-            const auto record = nodes.back();
-            nodes.pop_back();
-            return new FieldAccess(record, field);
-        }
-        case Token::Type::LeftParenthesis:
-            return read_parenthesized_expression(lexer);
-        case Token::Type::LeftBracket:
-            return read_array_access(lexer, nodes);
-        case Token::Type::New: {
-            lexer.next(); // consume 'new'
-            const auto type = read_expression(lexer, nodes);
-            return new Constructor(type);
-        }
-        default:
-            throw std::runtime_error(
-                "Unhandled token: " + std::to_string(static_cast<int>(lexer.peek().type)));
+    Parser parser(lexer);
+    auto nodes = make_list();
+    try {
+        while (lexer.peek().type != Token::Type::EndOfFile) {
+            if (const auto expression = parser.read_expression(nodes); expression != nullptr)
+                nodes.push_back(expression);
         }
+    } catch (...) {
+        if (current_arena == nullptr)
+            destroy_ast({nodes.begin(), nodes.end()});
+        throw;
     }
-    return nullptr;
+
+    return {nodes.begin(), nodes.end()};
 }
 
-std::vector<ASTNode *> parse(const std::string &source)
+// moves every token of a reused subtree by `delta` lines
+static void shift_lines(ASTNode *node, const ptrdiff_t delta)
 {
-    Lexer lexer(source);
-    std::vector<ASTNode *> nodes;
-
-    while (lexer.peek().type != Token::Type::EndOfFile) {
-        if (const auto expression = read_expression(lexer, nodes); expression != nullptr)
-            nodes.push_back(expression);
+    const auto shift = [&](Token &token) { token.line += delta; };
+    // left operands are followed in a loop, chains like a + b + c nest to the left
+    while (node->type == ASTNode::Type::BinaryExpression) {
+        const auto expression = dynamic_cast<BinaryExpression *>(node);
+        shift(expression->op);
+        shift_lines(expression->right, delta);
+        node = expression->left;
+    }
+    switch (node->type) {
+    case ASTNode::Type::SingleNode:
+        shift(dynamic_cast<SingleNode *>(node)->token);
+        break;
+    case ASTNode::Type::VarDeclaration:
+        shift(dynamic_cast<VarDeclaration *>(node)->name);
+        break;
+    case ASTNode::Type::UnaryExpression: {
+        const auto expression = dynamic_cast<UnaryExpression *>(node);
+        shift(expression->op);
+        shift_lines(expression->operand, delta);
+    }
+    break;
+    case ASTNode::Type::ParenthesizedExpression:
+        shift_lines(dynamic_cast<ParenthesizedExpression *>(node)->expression, delta);
+        break;
+    case ASTNode::Type::FunctionDeclaration: {
+        const auto function = dynamic_cast<FunctionDeclaration *>(node);
+        shift(function->name);
+        for (const auto &arg : function->args)
+            shift_lines(arg, delta);
+        shift_lines(function->body, delta);
     }
+    break;
+    case ASTNode::Type::FunctionCall: {
+        const auto call = dynamic_cast<FunctionCall *>(node);
+        shift_lines(call->name, delta);
+        for (const auto &arg : call->args)
+            shift_lines(arg, delta);
+    }
+    break;
+    case ASTNode::Type::ScopeBlock:
+        for (const auto &statement : dynamic_cast<ScopeBlock *>(node)->statements)
+            shift_lines(statement, delta);
+        break;
+    case ASTNode::Type::IfStatement: {
+        const auto statement = dynamic_cast<IfStatement *>(node);
+        shift_lines(statement->condition, delta);
+        shift_lines(statement->body, delta);
+        if (statement->else_body.has_value())
+            shift_lines(statement->else_body.value(), delta);
+    }
+    break;
+    case ASTNode::Type::WhileStatement: {
+        const auto statement = dynamic_cast<WhileStatement *>(node);
+        shift_lines(statement->condition, delta);
+        shift_lines(statement->body, delta);
+    }
+    break;
+    case ASTNode::Type::ArrayAccess: {
+        const auto access = dynamic_cast<ArrayAccess *>(node);
+        shift_lines(access->array, delta);
+        shift_lines(access->index, delta);
+    }
+    break;
+    case ASTNode::Type::FieldAccess: {
+        const auto access = dynamic_cast<FieldAccess *>(node);
+        shift_lines(access->record, delta);
+        shift_lines(access->field, delta);
+    }
+    break;
+    case ASTNode::Type::Constructor:
+        shift_lines(dynamic_cast<Constructor *>(node)->record, delta);
+        break;
+    default:
+        break;
+    }
+}
+
+IncrementalParser::IncrementalParser(std::string source)
+    : source(std::move(source))
+{
+    edit(0, 0, {});
+}
 
+IncrementalParser::~IncrementalParser()
+{
+    for (const auto &statement : statements)
+        delete statement.node;
+}
+
+std::vector<ASTNode *> IncrementalParser::ast() const
+{
+    std::vector<ASTNode *> nodes;
+    nodes.reserve(statements.size());
+    for (const auto &statement : statements)
+        nodes.push_back(statement.node);
     return nodes;
-}
\ No newline at end of file
+}
+
+size_t IncrementalParser::edit(const size_t offset, const size_t length, const std::string_view text)
+{
+    assert(offset + length <= source.size());
+    const auto old_end = offset + length;
+    const auto delta = static_cast<ptrdiff_t>(text.size()) - static_cast<ptrdiff_t>(length);
+    const auto line_delta = std::ranges::count(text, '\n')
+                            - std::count(source.begin() + offset, source.begin() + old_end, '\n');
+
+    // An edit can extend the statement before the one it lands in, e.g. by turning the first
+    // token of its statement into an operator, so parsing restarts one statement earlier.
+    auto first = static_cast<size_t>(
+        std::ranges::upper_bound(statements, offset, {}, &Statement::offset) - statements.begin());
+    first = first > 1 ? first - 2 : 0;
+
+    const auto removed = source.substr(offset, length);
+    source.replace(offset, length, text);
+    Lexer lexer(source, Lexer::Mode::Copy);
+    if (first < statements.size())
+        lexer.seek(statements[first].offset, statements[first].line, statements[first].column);
+
+    // parse until the next token starts an old statement that lies past the edit
+    Parser parser(lexer);
+    auto nodes = make_list();
+    std::vector<Statement> parsed;
+    auto reused = first;
+    try {
+        while (lexer.peek().type != Token::Type::EndOfFile) {
+            const auto &next = lexer.peek();
+            while (reused < statements.size()
+                   && (statements[reused].offset < old_end
+                       || static_cast<ptrdiff_t>(statements[reused].offset) + delta
+                              < static_cast<ptrdiff_t>(next.offset)))
+                reused++;
+            if (reused < statements.size()
+                && static_cast<ptrdiff_t>(statements[reused].offset) + delta
+                       == static_cast<ptrdiff_t>(next.offset)
+                && statements[reused].column == next.column
+                && static_cast<ptrdiff_t>(statements[reused].line) + line_delta
+                       == static_cast<ptrdiff_t>(next.line))
+                break;
+
+            Statement statement{nullptr, next.offset, next.line, next.column};
+            const auto node = parser.read_expression(nodes);
+            if (node == nullptr)
+                continue;
+            // the new node absorbed the previous statement, e.g. it is a binary expression
+            if (nodes.size() < parsed.size()) {
+                statement = parsed[nodes.size()];
+                parsed.resize(nodes.size());
+            }
+            statement.node = node;
+            nodes.push_back(node);
+            parsed.push_back(statement);
+        }
+    } catch (...) {
+        for (const auto &node : nodes)
+            delete node;
+        source.replace(offset, text.size(), removed);
+        throw;
+    }
+    if (lexer.peek().type == Token::Type::EndOfFile)
+        reused = statements.size();
+
+    for (auto i = first; i < reused; i++)
+        delete statements[i].node;
+    for (auto i = reused; i < statements.size(); i++) {
+        auto &statement = statements[i];
+        statement.offset += delta;
+        statement.line += line_delta;
+        if (line_delta != 0)
+            shift_lines(statement.node, line_delta);
+    }
+    statements.erase(statements.begin() + first, statements.begin() + reused);
+    statements.insert(statements.begin() + first, parsed.begin(), parsed.end());
+    return parsed.size();
+}
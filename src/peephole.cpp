@@ -0,0 +1,74 @@
+#include "peephole.h"
+
+using OLRuntime::Instruction;
+
+// the superinstruction taking the right operand of `type` from data.number, or from a local
+static Instruction::Type fused(const Instruction::Type type, const bool local)
+{
+    switch (type) {
+    case Instruction::Type::Add:
+        return local ? Instruction::Type::AddLocal : Instruction::Type::AddNumber;
+    case Instruction::Type::Sub:
+        return local ? Instruction::Type::SubLocal : Instruction::Type::SubNumber;
+    case Instruction::Type::Mul:
+        return local ? Instruction::Type::MulLocal : Instruction::Type::MulNumber;
+    case Instruction::Type::Div:
+        return local ? Instruction::Type::DivLocal : Instruction::Type::DivNumber;
+    default:
+        return Instruction::Type::Invalid;
+    }
+}
+
+void peephole(OLRuntime::Program &program)
+{
+    auto &instructions = program.instructions;
+    // a pair is only fused when nothing jumps to its second instruction
+    std::vector<bool> targets(instructions.size() + 1);
+    for (const auto &instruction : instructions) {
+        if (instruction.is_jump())
+            targets[instruction.data.index] = true;
+    }
+    // new index of each instruction, or of the one after it when it is dropped
+    std::vector<size_t> moved(instructions.size() + 1);
+    // the instructions before `kept` are final, each one is matched against the last of them
+    size_t kept = 0;
+    for (size_t i = 0; i < instructions.size(); i++) {
+        const auto current = instructions[i];
+        moved[i] = kept;
+        if (kept > 0 && !targets[i]) {
+            auto &last = instructions[kept - 1];
+            if (last.type == Instruction::Type::LoadNumber
+                || last.type == Instruction::Type::LoadLocal) {
+                const auto type = fused(current.type, last.type == Instruction::Type::LoadLocal);
+                if (type != Instruction::Type::Invalid) {
+                    last.type = type;
+                    moved[i] = kept - 1;
+                    continue;
+                }
+            }
+            if (last.type == Instruction::Type::StoreLocal
+                && current.type == Instruction::Type::LoadLocal
+                && last.data.index == current.data.index) {
+                last.type = Instruction::Type::StoreLocalKeep;
+                moved[i] = kept - 1;
+                continue;
+            }
+            // only when the load is the instruction right before, so earlier dropped
+            // instructions keep pointing at the position the next one lands on
+            if (last.type == Instruction::Type::LoadLocal && moved[i - 1] == kept - 1
+                && current.type == Instruction::Type::StoreLocal
+                && last.data.index == current.data.index) {
+                kept--;
+                moved[i - 1] = moved[i] = kept;
+                continue;
+            }
+        }
+        instructions[kept++] = current;
+    }
+    moved[instructions.size()] = kept;
+    instructions.resize(kept);
+    for (auto &instruction : instructions) {
+        if (instruction.is_jump())
+            instruction.data.index = moved[instruction.data.index];
+    }
+}
@@ -0,0 +1,464 @@
+#include "register_compiler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <string>
+
+using OLRuntime::RegisterInstruction;
+
+namespace {
+class RegisterCompiler
+{
+    // Temporaries are numbered on their own while compiling and marked with this bit, they are
+    // moved after the local slots once the number of slots is known.
+    static constexpr uint32_t temporary = 1u << 31;
+
+    OLRuntime::Program &program;
+    OLRuntime::RegisterProgram &output;
+    // first instruction of the unit being compiled, the ones before belong to earlier units
+    const size_t unit_start;
+    uint32_t next_temporary = 0;
+    uint32_t temporaries_count = 0;
+    // temporaries below this one hold the result of the last expression statement
+    uint32_t reserved = 0;
+    // if and while statements being compiled
+    size_t nesting = 0;
+    // set for a statement with an assignment inside, whose operands must not read a variable
+    // after the assignment changed it
+    bool copy_variables = false;
+
+    struct Pending
+    {
+        const BinaryExpression *expression;
+        // first temporary that is free again once the expression has its value
+        uint32_t mark;
+        uint32_t first_register;
+        bool second_operand_started;
+    };
+    std::vector<Pending> stack;
+
+    static bool is_temporary(const uint32_t reg) { return (reg & temporary) != 0; }
+
+    uint32_t allocate()
+    {
+        temporaries_count = std::max(temporaries_count, next_temporary + 1);
+        return temporary | next_temporary++;
+    }
+
+    size_t emit(const RegisterInstruction::Type type, const uint32_t dst, const uint32_t a = 0,
+                const uint32_t b = 0)
+    {
+        output.instructions.push_back({.type = type, .dst = dst, .data = {.operands = {a, b}}});
+        return output.instructions.size() - 1;
+    }
+
+    uint32_t atom_of(const Token &token) const
+    {
+        return token.atom != Token::no_atom ? token.atom : program.atoms.intern(token.text());
+    }
+
+    uint32_t compile_leaf(const ASTNode *node);
+    uint32_t compile_operator(const BinaryExpression &expression, uint32_t mark, uint32_t first,
+                              uint32_t second);
+    uint32_t compile_value(const ASTNode *node);
+    uint32_t compile_nested_assignment(const ASTNode *node, size_t base);
+    uint32_t compile_assignment(const BinaryExpression &assignment);
+    void compile_result(const ASTNode *node);
+    void compile_control(const ASTNode *node);
+
+public:
+    RegisterCompiler(OLRuntime::Program &program, OLRuntime::RegisterProgram &output);
+
+    void compile(const ASTNode *node);
+    void finish();
+};
+} // namespace
+
+static bool is_assignment(const ASTNode *node)
+{
+    return node->type == ASTNode::Type::BinaryExpression
+           && static_cast<const BinaryExpression *>(node)->op.type == Token::Type::Equals;
+}
+
+static const ASTNode *unparenthesized(const ASTNode *node)
+{
+    while (node->type == ASTNode::Type::ParenthesizedExpression)
+        node = static_cast<const ParenthesizedExpression *>(node)->expression;
+    return node;
+}
+
+// whether the expression assigns a variable
+static bool has_assignment(const ASTNode *node)
+{
+    std::vector nodes{node};
+    while (!nodes.empty()) {
+        node = unparenthesized(nodes.back());
+        nodes.pop_back();
+        if (is_assignment(node))
+            return true;
+        if (node->type == ASTNode::Type::BinaryExpression) {
+            nodes.push_back(static_cast<const BinaryExpression *>(node)->left);
+            nodes.push_back(static_cast<const BinaryExpression *>(node)->right);
+        }
+    }
+    return false;
+}
+
+// whether an expression statement in the bodies of an if or while has a value to keep
+static bool has_value_statement(const ASTNode *node)
+{
+    switch (node->type) {
+    case ASTNode::Type::VarDeclaration:
+        return false;
+    case ASTNode::Type::ScopeBlock:
+        return std::ranges::any_of(static_cast<const ScopeBlock *>(node)->statements,
+                                   has_value_statement);
+    case ASTNode::Type::IfStatement: {
+        const auto statement = static_cast<const IfStatement *>(node);
+        return has_value_statement(statement->body)
+               || (statement->else_body.has_value() && has_value_statement(*statement->else_body));
+    }
+    case ASTNode::Type::WhileStatement:
+        return has_value_statement(static_cast<const WhileStatement *>(node)->body);
+    default:
+        return !is_assignment(unparenthesized(node));
+    }
+}
+
+// The instructions of a new unit go where the End of the previous one was. A result it left in
+// a temporary is copied first, the new unit may reuse that register for a variable.
+RegisterCompiler::RegisterCompiler(OLRuntime::Program &program,
+                                   OLRuntime::RegisterProgram &output)
+    : program(program)
+      , output(output)
+      , unit_start(output.instructions.empty() ? 0 : output.instructions.size() - 1)
+{
+    if (!output.instructions.empty()) {
+        assert(output.instructions.back().type == RegisterInstruction::Type::End);
+        output.instructions.pop_back();
+    }
+    if (output.result != OLRuntime::RegisterProgram::no_result) {
+        const auto copy = allocate();
+        emit(RegisterInstruction::Type::Move, copy, output.result);
+        output.result = copy;
+        reserved = next_temporary;
+    }
+}
+
+uint32_t RegisterCompiler::compile_leaf(const ASTNode *node)
+{
+    if (node->type != ASTNode::Type::SingleNode)
+        throw std::runtime_error("Unimplemented method!");
+    const auto &token = static_cast<const SingleNode *>(node)->token;
+    switch (token.type) {
+    case Token::Type::Number: {
+        const auto reg = allocate();
+        output.instructions.push_back(
+        {
+            .type = RegisterInstruction::Type::LoadNumber,
+            .dst = reg,
+            .data = {.number = std::stod(std::string(token.text()))},
+        });
+        return reg;
+    }
+    case Token::Type::True:
+    case Token::Type::False:
+    case Token::Type::Null: {
+        const auto reg = allocate();
+        output.instructions.push_back(
+        {
+            .type = RegisterInstruction::Type::LoadValue,
+            .dst = reg,
+            .data = {.value = literal_value(token.type)->raw_bits()},
+        });
+        return reg;
+    }
+    case Token::Type::Identifier: {
+        const auto atom = atom_of(token);
+        assert(program.is_declared(atom));
+        const auto slot = static_cast<uint32_t>(program.local_vars[atom]);
+        if (!copy_variables)
+            return slot;
+        const auto reg = allocate();
+        emit(RegisterInstruction::Type::Move, reg, slot);
+        return reg;
+    }
+    default:
+        throw std::runtime_error("Unimplemented method!");
+    }
+}
+
+uint32_t RegisterCompiler::compile_operator(const BinaryExpression &expression,
+                                            const uint32_t mark, const uint32_t first,
+                                            const uint32_t second)
+{
+    next_temporary = mark;
+    RegisterInstruction::Type type;
+    switch (expression.op.type) {
+    case Token::Type::Plus:
+        type = RegisterInstruction::Type::Add;
+        break;
+    case Token::Type::Minus:
+        type = RegisterInstruction::Type::Sub;
+        break;
+    case Token::Type::Asterisk:
+        type = RegisterInstruction::Type::Mul;
+        break;
+    case Token::Type::Slash:
+        type = RegisterInstruction::Type::Div;
+        break;
+    case Token::Type::LooseEquality:
+    case Token::Type::StrictEquality:
+        type = RegisterInstruction::Type::Equal;
+        break;
+    default:
+        throw std::runtime_error("Unimplemented method!");
+    }
+    const auto dst = allocate();
+    emit(type, dst, first, second);
+    return dst;
+}
+
+// Compiles an expression in post-order like the stack compiler, with an explicit stack of the
+// binary expressions whose operands are still being compiled. Returns the register of its value.
+uint32_t RegisterCompiler::compile_value(const ASTNode *node)
+{
+    const auto base = stack.size();
+    try {
+        while (true) {
+            while (true) {
+                if (node->type == ASTNode::Type::ParenthesizedExpression) {
+                    node = static_cast<const ParenthesizedExpression *>(node)->expression;
+                } else if (node->type == ASTNode::Type::BinaryExpression && !is_assignment(node)) {
+                    const auto expression = static_cast<const BinaryExpression *>(node);
+                    stack.push_back({expression, next_temporary, 0, false});
+                    node = expression->left;
+                } else {
+                    break;
+                }
+            }
+            auto reg = is_assignment(node) ? compile_nested_assignment(node, base)
+                                           : compile_leaf(node);
+
+            while (true) {
+                if (stack.size() == base)
+                    return reg;
+                auto &pending = stack.back();
+                if (!pending.second_operand_started) {
+                    pending.second_operand_started = true;
+                    pending.first_register = reg;
+                    node = pending.expression->right;
+                    break;
+                }
+                reg = compile_operator(*pending.expression, pending.mark, pending.first_register,
+                                       reg);
+                stack.pop_back();
+            }
+        }
+    } catch (...) {
+        stack.resize(base);
+        throw;
+    }
+}
+
+// The value of an assignment inside an expression, like the b = 3 of a = b = 3, is its variable.
+// An operator copies it, a later assignment in the expression could change the variable first.
+uint32_t RegisterCompiler::compile_nested_assignment(const ASTNode *node, const size_t base)
+{
+    const auto slot = compile_assignment(*static_cast<const BinaryExpression *>(node));
+    if (stack.size() == base)
+        return slot;
+    const auto copy = allocate();
+    emit(RegisterInstruction::Type::Move, copy, slot);
+    return copy;
+}
+
+// `var x = value` and `x = value` compute the value straight into the slot of x, which holds the
+// value of the assignment
+uint32_t RegisterCompiler::compile_assignment(const BinaryExpression &assignment)
+{
+    const Token *name;
+    if (assignment.left->type == ASTNode::Type::VarDeclaration)
+        name = &static_cast<const VarDeclaration *>(assignment.left)->name;
+    else if (assignment.left->type == ASTNode::Type::SingleNode)
+        name = &static_cast<const SingleNode *>(assignment.left)->token;
+    else
+        throw std::runtime_error("Unimplemented method!");
+    const auto atom = atom_of(*name);
+    const auto declaration = assignment.left->type == ASTNode::Type::VarDeclaration;
+    assert(declaration ? !program.is_declared_in_scope(atom) : program.is_declared(atom));
+    const auto value = compile_value(assignment.right);
+    const auto slot =
+        static_cast<uint32_t>(declaration ? program.declare(atom) : program.local_vars[atom]);
+    // a temporary value is always written by the last instruction
+    if (is_temporary(value))
+        output.instructions.back().dst = slot;
+    else if (value != slot)
+        emit(RegisterInstruction::Type::Move, slot, value);
+    return slot;
+}
+
+// An expression statement. At the top level its value becomes the result, in the body of an if
+// or while it goes to the result register the statement reserved, so every path leaves it there.
+void RegisterCompiler::compile_result(const ASTNode *node)
+{
+    next_temporary = nesting == 0 ? 0 : reserved;
+    auto value = compile_value(node);
+    if (nesting > 0) {
+        if (is_temporary(value))
+            output.instructions.back().dst = output.result;
+        else
+            emit(RegisterInstruction::Type::Move, output.result, value);
+        return;
+    }
+    // the result outlives the variables, so it never stays in their slots
+    if (!is_temporary(value)) {
+        const auto copy = allocate();
+        emit(RegisterInstruction::Type::Move, copy, value);
+        value = copy;
+    }
+    output.result = value;
+    reserved = (value & ~temporary) + 1;
+}
+
+void RegisterCompiler::compile_control(const ASTNode *node)
+{
+    // an if or while whose bodies have values starts from the result so far, 0 without one
+    if (nesting == 0 && has_value_statement(node)
+        && output.result == OLRuntime::RegisterProgram::no_result) {
+        next_temporary = reserved;
+        output.result = allocate();
+        output.instructions.push_back(
+        {
+            .type = RegisterInstruction::Type::LoadNumber,
+            .dst = output.result,
+            .data = {.number = 0},
+        });
+        reserved = next_temporary;
+    }
+    const auto header = output.instructions.size();
+    const auto condition = node->type == ASTNode::Type::WhileStatement
+                               ? static_cast<const WhileStatement *>(node)->condition
+                               : static_cast<const IfStatement *>(node)->condition;
+    next_temporary = reserved;
+    copy_variables = has_assignment(condition);
+    const auto skip = emit(RegisterInstruction::Type::JumpIfFalse, 0, compile_value(condition));
+    copy_variables = false;
+    nesting++;
+    if (node->type == ASTNode::Type::WhileStatement) {
+        compile(static_cast<const WhileStatement *>(node)->body);
+        emit(RegisterInstruction::Type::Jump, 0, static_cast<uint32_t>(header));
+    } else {
+        const auto statement = static_cast<const IfStatement *>(node);
+        compile(statement->body);
+        if (statement->else_body.has_value()) {
+            const auto end = emit(RegisterInstruction::Type::Jump, 0);
+            output.instructions[skip].data.operands.b =
+                static_cast<uint32_t>(output.instructions.size());
+            compile(*statement->else_body);
+            output.instructions[end].data.operands.a =
+                static_cast<uint32_t>(output.instructions.size());
+            nesting--;
+            return;
+        }
+    }
+    nesting--;
+    output.instructions[skip].data.operands.b = static_cast<uint32_t>(output.instructions.size());
+}
+
+void RegisterCompiler::compile(const ASTNode *node)
+{
+    switch (node->type) {
+    case ASTNode::Type::VarDeclaration: {
+        const auto atom = atom_of(static_cast<const VarDeclaration *>(node)->name);
+        assert(!program.is_declared_in_scope(atom));
+        const auto slot = static_cast<uint32_t>(program.declare(atom));
+        // a loop declares the variables of its body anew on every iteration
+        if (nesting > 0) {
+            output.instructions.push_back(
+            {
+                .type = RegisterInstruction::Type::LoadNumber,
+                .dst = slot,
+                .data = {.number = 0},
+            });
+        }
+        return;
+    }
+    case ASTNode::Type::ScopeBlock:
+        program.open_scope();
+        try {
+            for (const auto &statement : static_cast<const ScopeBlock *>(node)->statements)
+                compile(statement);
+        } catch (...) {
+            program.close_scope();
+            throw;
+        }
+        program.close_scope();
+        return;
+    case ASTNode::Type::IfStatement:
+    case ASTNode::Type::WhileStatement:
+        return compile_control(node);
+    default:
+        break;
+    }
+    const auto statement = unparenthesized(node);
+    if (is_assignment(statement)) {
+        const auto &assignment = *static_cast<const BinaryExpression *>(statement);
+        copy_variables = has_assignment(assignment.right);
+        next_temporary = reserved;
+        compile_assignment(assignment);
+        return;
+    }
+    copy_variables = has_assignment(node);
+    compile_result(node);
+}
+
+// temporaries of the unit go after every slot, the variables of blocks reuse the ones below
+void RegisterCompiler::finish()
+{
+    const auto locals = static_cast<uint32_t>(program.frame_size);
+    const auto place = [locals](uint32_t &reg) {
+        if (is_temporary(reg))
+            reg = locals + (reg & ~temporary);
+    };
+    for (auto i = unit_start; i < output.instructions.size(); i++) {
+        auto &instruction = output.instructions[i];
+        switch (instruction.type) {
+        case RegisterInstruction::Type::LoadNumber:
+        case RegisterInstruction::Type::LoadValue:
+            place(instruction.dst);
+            break;
+        case RegisterInstruction::Type::Jump:
+            break;
+        case RegisterInstruction::Type::JumpIfFalse:
+            place(instruction.data.operands.a);
+            break;
+        default:
+            place(instruction.dst);
+            place(instruction.data.operands.a);
+            place(instruction.data.operands.b);
+        }
+    }
+    if (output.result != OLRuntime::RegisterProgram::no_result)
+        place(output.result);
+    output.registers_count = std::max<size_t>(output.registers_count, locals + temporaries_count);
+    output.entry = unit_start;
+    output.instructions.push_back({.type = RegisterInstruction::Type::End});
+}
+
+void compile_registers(const std::vector<ASTNode *> &ast, OLRuntime::Program &program,
+                       OLRuntime::RegisterProgram &output)
+{
+    RegisterCompiler compiler(program, output);
+    for (const auto &node : ast)
+        compiler.compile(node);
+    compiler.finish();
+}
+
+OLRuntime::RegisterProgram compile_registers(const std::vector<ASTNode *> &ast,
+                                             OLRuntime::Program &program)
+{
+    OLRuntime::RegisterProgram output;
+    compile_registers(ast, program, output);
+    return output;
+}
@@ -1,74 +1,680 @@
 #include "runtime.h"
 
+#include <ast_arena.h>
+#include <bytecode_file.h>
+#include <cassert>
+#include <functional>
+#include <ir.h>
+#include <ir_passes.h>
+#include <jit.h>
+#include <optimizer.h>
+#include <parallel_lexer.h>
+#include <parallel_parser.h>
 #include <parser.h>
+#include <peephole.h>
+#include <register_compiler.h>
+#include <source_file.h>
+#include <trace.h>
+#include <utility>
 
-void OLRuntime::OLRuntime::execute()
+std::optional<size_t> OLRuntime::max_stack_depth(const std::span<const Instruction> instructions)
 {
-    for (const auto &[type, data] : program.instructions) {
-        switch (type) {
-        case Instruction::Type::LoadNumber:
-            stack.push_back(data.number);
+    // depth before each instruction, and after the last one, unknown until a path reaches it
+    constexpr auto unknown = SIZE_MAX;
+    std::vector<size_t> depths(instructions.size() + 1, unknown);
+    depths[0] = 0;
+    std::vector<size_t> pending{0};
+    const auto reach = [&](const size_t target, const size_t depth) {
+        if (target > instructions.size())
+            return false;
+        if (depths[target] == unknown) {
+            depths[target] = depth;
+            pending.push_back(target);
+        }
+        return depths[target] == depth;
+    };
+    size_t max = 0;
+    while (!pending.empty()) {
+        const auto at = pending.back();
+        pending.pop_back();
+        if (at == instructions.size())
+            continue;
+        const auto &instruction = instructions[at];
+        size_t pops = 0;
+        size_t pushes = 0;
+        switch (instruction.type) {
+        case Instruction::Type::Invalid:
+        case Instruction::Type::Jump:
+        case Instruction::Type::End:
             break;
+        case Instruction::Type::LoadNumber:
+        case Instruction::Type::LoadValue:
         case Instruction::Type::LoadLocal:
-            stack.push_back(local_vars.at(data.index));
+            pushes = 1;
             break;
         case Instruction::Type::StoreLocal:
-            if (data.index >= local_vars.size())
-                local_vars.resize(data.index + 1);
-            local_vars[data.index] = stack.back();
-            stack.pop_back();
+        case Instruction::Type::JumpIfFalse:
+            pops = 1;
+            break;
+        case Instruction::Type::Add:
+        case Instruction::Type::Sub:
+        case Instruction::Type::Mul:
+        case Instruction::Type::Div:
+        case Instruction::Type::Equal:
+            pops = 2;
+            pushes = 1;
+            break;
+        case Instruction::Type::AddNumber:
+        case Instruction::Type::SubNumber:
+        case Instruction::Type::MulNumber:
+        case Instruction::Type::DivNumber:
+        case Instruction::Type::AddLocal:
+        case Instruction::Type::SubLocal:
+        case Instruction::Type::MulLocal:
+        case Instruction::Type::DivLocal:
+        case Instruction::Type::StoreLocalKeep:
+            pops = 1;
+            pushes = 1;
             break;
-        case Instruction::Type::Add: {
-            const auto x = stack.back();
-            stack.pop_back();
-            const auto y = stack.back();
-            stack.pop_back();
-            stack.push_back(x + y);
+        default:
+            return std::nullopt;
+        }
+        if (depths[at] < pops)
+            return std::nullopt;
+        const auto depth = depths[at] - pops + pushes;
+        max = std::max(max, depth);
+        if (instruction.type == Instruction::Type::End)
+            continue;
+        if (instruction.is_jump() && !reach(instruction.data.index, depth))
+            return std::nullopt;
+        if (instruction.type != Instruction::Type::Jump && !reach(at + 1, depth))
+            return std::nullopt;
+    }
+    return max;
+}
+
+// jumps back to a loop header after which the interpreter records a trace of the loop
+static constexpr uint32_t hot_loop_iterations = 64;
+// recordings of a loop that fail before it is left to the interpreter
+static constexpr uint32_t max_recordings = 4;
+
+// stack size of instructions a compiler produced, which are always balanced
+static size_t stack_size_of(const std::span<const OLRuntime::Instruction> instructions)
+{
+    const auto depth = OLRuntime::max_stack_depth(instructions);
+    if (!depth.has_value())
+        throw std::runtime_error("Unbalanced operand stack");
+    return *depth;
+}
+
+void OLRuntime::Program::link(const Program &part, const size_t shared_atoms)
+{
+    const auto atom_of = [&](const uint32_t atom) {
+        return atom < shared_atoms ? atom : atoms.intern(part.atoms.name(atom));
+    };
+    std::vector<size_t> slots(part.frame_size, no_slot);
+    for (const auto &[atom, slot] : part.imports) {
+        assert(is_declared(atom_of(atom)));
+        slots[slot] = local_vars[atom_of(atom)];
+    }
+    // top-level variables of the part in the order it created their slots
+    std::vector<uint32_t> slot_atoms(part.frame_size, Token::no_atom);
+    for (uint32_t atom = 0; atom < part.local_vars.size(); atom++) {
+        if (part.local_vars[atom] != no_slot && slots[part.local_vars[atom]] == no_slot)
+            slot_atoms[part.local_vars[atom]] = atom;
+    }
+    for (size_t slot = 0; slot < slots.size(); slot++) {
+        if (slot_atoms[slot] != Token::no_atom)
+            slots[slot] = declare(atom_of(slot_atoms[slot]));
+    }
+    // the others belonged to variables of its blocks
+    auto next_slot = locals_count;
+    for (auto &slot : slots) {
+        if (slot == no_slot)
+            slot = next_slot++;
+    }
+    frame_size = std::max(frame_size, next_slot);
+
+    const auto base = instructions.size();
+    instructions.reserve(instructions.size() + part.instructions.size());
+    for (auto instruction : part.instructions) {
+        if (instruction.uses_local())
+            instruction.data.index = slots[instruction.data.index];
+        else if (instruction.is_jump())
+            instruction.data.index += base;
+        instructions.push_back(instruction);
+    }
+}
+
+OLRuntime::OLRuntime::OLRuntime(const Backend backend)
+    : backend(backend)
+{}
+
+OLRuntime::OLRuntime::OLRuntime(Program program)
+    : program(std::move(program))
+{
+    this->program.stack_size = stack_size_of(this->program.instructions);
+}
+
+OLRuntime::OLRuntime::OLRuntime(Program program, RegisterProgram registers)
+    : backend(Backend::Registers)
+      , program(std::move(program))
+      , register_program(std::move(registers))
+{}
+
+OLRuntime::OLRuntime::~OLRuntime() = default;
+
+void OLRuntime::OLRuntime::execute()
+{
+    if (backend == Backend::Registers) {
+        execute_registers();
+        return;
+    }
+    // sized once from what the compiler computed, stores never grow the frame
+    if (local_vars.size() < program.frame_size)
+        local_vars.resize(program.frame_size);
+    if (stack.size() < program.stack_size + 1)
+        stack.resize(program.stack_size + 1);
+    stack_depth = 0;
+    if (tracing && loops.size() != code().size())
+        loops.assign(code().size(), {});
+    size_t start = 0;
+    if (jit && !profiling) {
+        if (native == nullptr)
+            native = NativeCode::compile(code());
+        if (native != nullptr) {
+            start = native->run(local_vars.data(), stack.data(), stack_depth);
+            if (start == code().size())
+                return;
         }
-        break;
-        case Instruction::Type::Sub: {
-            const auto x = stack.back();
-            stack.pop_back();
-            const auto y = stack.back();
-            stack.pop_back();
-            stack.push_back(y - x);
+    }
+    const auto threaded = threaded_dispatch && dispatch == Dispatch::Threaded;
+    if (profiling)
+        threaded ? execute_stack<true, true>(start) : execute_stack<true, false>(start);
+    else if (tracing)
+        threaded ? execute_stack<false, true, true>(start)
+                 : execute_stack<false, false, true>(start);
+    else
+        threaded ? execute_stack<false, true>(start) : execute_stack<false, false>(start);
+}
+
+void OLRuntime::OLRuntime::set_jit(const bool enabled)
+{
+    jit = enabled && NativeCode::supported;
+}
+
+void OLRuntime::OLRuntime::set_tracing(const bool enabled)
+{
+    tracing = enabled && NativeCode::supported;
+}
+
+size_t OLRuntime::OLRuntime::enter_loop(const size_t header)
+{
+    auto &loop = loops[header];
+    if (loop.abandoned)
+        return header;
+    if (loop.trace == nullptr) {
+        if (++loop.iterations < hot_loop_iterations)
+            return header;
+        auto trace = record_trace(code(), header, local_vars);
+        if (trace.has_value()) {
+            optimize_trace(*trace);
+            loop.trace = NativeTrace::compile(*trace);
         }
-        break;
-        case Instruction::Type::Mul: {
-            const auto x = stack.back();
-            stack.pop_back();
-            const auto y = stack.back();
-            stack.pop_back();
-            stack.push_back(x * y);
+        // the next iterations are recorded until one of them makes a trace
+        if (loop.trace == nullptr) {
+            loop.abandoned = ++loop.failures == max_recordings;
+            return header;
         }
-        break;
-        case Instruction::Type::Div: {
-            const auto x = stack.back();
-            stack.pop_back();
-            const auto y = stack.back();
-            stack.pop_back();
-            stack.push_back(y / x);
+    }
+    const auto next = loop.trace->run(local_vars.data());
+    // a local the trace reads is no longer a number
+    if (next == header) {
+        loop.abandoned = true;
+        loop.trace.reset();
+    }
+    return next;
+}
+
+void OLRuntime::OLRuntime::set_dispatch(const Dispatch kind)
+{
+    dispatch = kind;
+}
+
+void OLRuntime::OLRuntime::set_profiling(const bool enabled)
+{
+    profiling = enabled;
+    if (enabled && pair_counts.empty())
+        pair_counts.resize(Instruction::types_count * Instruction::types_count);
+}
+
+uint64_t OLRuntime::OLRuntime::pair_count(const Instruction::Type first,
+                                          const Instruction::Type second) const
+{
+    if (pair_counts.empty())
+        return 0;
+    return pair_counts[static_cast<size_t>(first) * Instruction::types_count
+                       + static_cast<size_t>(second)];
+}
+
+// One handler per instruction type, reached either through the switch at `dispatch` or, for
+// threaded code, straight from the end of the previous handler. NEXT() ends every handler.
+// The top operand lives in `top` rather than on the stack, and the stack pointer `sp` points
+// past the others: a push spills `top` to *sp, a binary operator combines *--sp with it. With
+// NDEBUG undefined every access is checked against the depth computed by max_stack_depth().
+template<bool profile, bool threaded, bool trace>
+void OLRuntime::OLRuntime::execute_stack(const size_t start)
+{
+    Value *const base = stack.data();
+    [[maybe_unused]] Value *const limit = base + program.stack_size;
+    Value *sp = base + stack_depth;
+    Value top = *sp;
+    Value *const locals = local_vars.data();
+
+    [[maybe_unused]] auto previous = Instruction::Type::Invalid;
+    const auto instructions = code();
+    const Instruction *current = nullptr;
+    size_t next = start;
+
+    const auto count_pair = [&](const Instruction::Type type) {
+        if (previous != Instruction::Type::Invalid)
+            pair_counts[static_cast<size_t>(previous) * Instruction::types_count
+                        + static_cast<size_t>(type)]++;
+        previous = type;
+    };
+
+#if defined(__GNUC__) || defined(__clang__)
+    if constexpr (threaded) {
+        // indexed by Instruction::Type
+        static const void *const type_handlers[] = {
+            &&invalid, &&load_number, &&load_value, &&load_local, &&store_local, &&add, &&sub,
+            &&mul, &&div, &&equal, &&jump, &&jump_if_false, &&add_number, &&sub_number,
+            &&mul_number, &&div_number, &&add_local, &&sub_local, &&mul_local, &&div_local,
+            &&store_local_keep, &&end,
+        };
+        static_assert(std::size(type_handlers) == Instruction::types_count);
+        if (handlers.size() != instructions.size() + 1 || handlers_source != type_handlers) {
+            handlers.clear();
+            handlers_source = type_handlers;
+            handlers.reserve(instructions.size() + 1);
+            for (const auto &instruction : instructions)
+                handlers.push_back(type_handlers[static_cast<size_t>(instruction.type)]);
+            // running past the last instruction, or jumping there, ends the program
+            handlers.push_back(&&end);
         }
-        break;
-        case Instruction::Type::End:
+    }
+#define NEXT() \
+    do { \
+        if constexpr (threaded) { \
+            current = instructions.data() + next; \
+            if constexpr (profile) { \
+                if (next < instructions.size()) \
+                    count_pair(current->type); \
+            } \
+            goto *handlers[next++]; \
+        } else { \
+            goto dispatch; \
+        } \
+    } while (false)
+#else
+#define NEXT() goto dispatch
+#endif
+
+    NEXT();
+[[maybe_unused]] dispatch:
+    if (next == instructions.size())
+        goto end;
+    current = &instructions[next++];
+    if constexpr (profile)
+        count_pair(current->type);
+    switch (current->type) {
+    case Instruction::Type::LoadNumber:
+        goto load_number;
+    case Instruction::Type::LoadValue:
+        goto load_value;
+    case Instruction::Type::LoadLocal:
+        goto load_local;
+    case Instruction::Type::StoreLocal:
+        goto store_local;
+    case Instruction::Type::Add:
+        goto add;
+    case Instruction::Type::Sub:
+        goto sub;
+    case Instruction::Type::Mul:
+        goto mul;
+    case Instruction::Type::Div:
+        goto div;
+    case Instruction::Type::Equal:
+        goto equal;
+    case Instruction::Type::Jump:
+        goto jump;
+    case Instruction::Type::JumpIfFalse:
+        goto jump_if_false;
+    case Instruction::Type::AddNumber:
+        goto add_number;
+    case Instruction::Type::SubNumber:
+        goto sub_number;
+    case Instruction::Type::MulNumber:
+        goto mul_number;
+    case Instruction::Type::DivNumber:
+        goto div_number;
+    case Instruction::Type::AddLocal:
+        goto add_local;
+    case Instruction::Type::SubLocal:
+        goto sub_local;
+    case Instruction::Type::MulLocal:
+        goto mul_local;
+    case Instruction::Type::DivLocal:
+        goto div_local;
+    case Instruction::Type::StoreLocalKeep:
+        goto store_local_keep;
+    case Instruction::Type::End:
+        goto end;
+    default:
+        goto invalid;
+    }
+
+invalid:
+    NEXT();
+load_number:
+    assert(sp < limit);
+    *sp++ = top;
+    top = Value::computed(current->data.number);
+    NEXT();
+load_value:
+    assert(sp < limit);
+    *sp++ = top;
+    top = Value::from_raw_bits(current->data.value);
+    NEXT();
+load_local:
+    assert(sp < limit);
+    *sp++ = top;
+    top = locals[current->data.index];
+    NEXT();
+store_local:
+    assert(sp > base);
+    locals[current->data.index] = top;
+    top = *--sp;
+    NEXT();
+add:
+    assert(sp - base >= 2);
+    top = arithmetic(*--sp, top, std::plus());
+    NEXT();
+sub:
+    assert(sp - base >= 2);
+    top = arithmetic(*--sp, top, std::minus());
+    NEXT();
+mul:
+    assert(sp - base >= 2);
+    top = arithmetic(*--sp, top, std::multiplies());
+    NEXT();
+div:
+    assert(sp - base >= 2);
+    top = arithmetic(*--sp, top, std::divides());
+    NEXT();
+equal:
+    assert(sp - base >= 2);
+    top = Value::boolean(Value::equals(*--sp, top));
+    NEXT();
+jump:
+    next = current->data.index;
+    if constexpr (trace) {
+        if (next <= static_cast<size_t>(current - instructions.data()))
+            next = enter_loop(next);
+    }
+    NEXT();
+jump_if_false:
+    assert(sp > base);
+    if (top.is_falsy())
+        next = current->data.index;
+    top = *--sp;
+    NEXT();
+add_number:
+    assert(sp > base);
+    top = arithmetic(top, current->data.number, std::plus());
+    NEXT();
+sub_number:
+    assert(sp > base);
+    top = arithmetic(top, current->data.number, std::minus());
+    NEXT();
+mul_number:
+    assert(sp > base);
+    top = arithmetic(top, current->data.number, std::multiplies());
+    NEXT();
+div_number:
+    assert(sp > base);
+    top = arithmetic(top, current->data.number, std::divides());
+    NEXT();
+add_local:
+    assert(sp > base);
+    top = arithmetic(top, locals[current->data.index], std::plus());
+    NEXT();
+sub_local:
+    assert(sp > base);
+    top = arithmetic(top, locals[current->data.index], std::minus());
+    NEXT();
+mul_local:
+    assert(sp > base);
+    top = arithmetic(top, locals[current->data.index], std::multiplies());
+    NEXT();
+div_local:
+    assert(sp > base);
+    top = arithmetic(top, locals[current->data.index], std::divides());
+    NEXT();
+store_local_keep:
+    assert(sp > base);
+    locals[current->data.index] = top;
+    NEXT();
+end:
+    // the top operand goes back on the stack, where getLastValue() finds it
+    *sp = top;
+    stack_depth = static_cast<size_t>(sp - base);
+#undef NEXT
+}
+
+void OLRuntime::OLRuntime::execute_registers()
+{
+    // the slots of the variables keep what earlier units stored there
+    if (registers.size() < register_program.registers_count)
+        registers.resize(register_program.registers_count);
+    const auto r = registers.data();
+    const auto instructions = register_program.instructions.data();
+    for (auto next = register_program.entry;;) {
+        const auto &[type, dst, data] = instructions[next++];
+        switch (type) {
+        case RegisterInstruction::Type::LoadNumber:
+            r[dst] = Value::computed(data.number);
+            break;
+        case RegisterInstruction::Type::LoadValue:
+            r[dst] = Value::from_raw_bits(data.value);
+            break;
+        case RegisterInstruction::Type::Move:
+            r[dst] = r[data.operands.a];
+            break;
+        case RegisterInstruction::Type::Add:
+            r[dst] = arithmetic(r[data.operands.a], r[data.operands.b], std::plus());
+            break;
+        case RegisterInstruction::Type::Sub:
+            r[dst] = arithmetic(r[data.operands.a], r[data.operands.b], std::minus());
+            break;
+        case RegisterInstruction::Type::Mul:
+            r[dst] = arithmetic(r[data.operands.a], r[data.operands.b], std::multiplies());
+            break;
+        case RegisterInstruction::Type::Div:
+            r[dst] = arithmetic(r[data.operands.a], r[data.operands.b], std::divides());
+            break;
+        case RegisterInstruction::Type::Equal:
+            r[dst] = Value::boolean(Value::equals(r[data.operands.a], r[data.operands.b]));
+            break;
+        case RegisterInstruction::Type::Jump:
+            next = data.operands.a;
+            break;
+        case RegisterInstruction::Type::JumpIfFalse:
+            if (r[data.operands.a].is_falsy())
+                next = data.operands.b;
+            break;
+        case RegisterInstruction::Type::End:
             return;
         default: ;
         }
     }
 }
 
+std::span<const OLRuntime::Instruction> OLRuntime::OLRuntime::code() const
+{
+    if (bytecode != nullptr)
+        return bytecode->instructions();
+    return program.instructions;
+}
+
+void OLRuntime::OLRuntime::detach_bytecode()
+{
+    if (bytecode == nullptr)
+        return;
+    const auto instructions = bytecode->instructions();
+    program.instructions.assign(instructions.begin(), instructions.end());
+    bytecode.reset();
+}
+
+void OLRuntime::OLRuntime::load(std::vector<ASTNode *> &ast, AstArena *const arena)
+{
+    detach_bytecode();
+    handlers.clear();
+    native.reset();
+    loops.clear();
+    optimize(ast, arena);
+    if (backend == Backend::Registers) {
+        compile_registers(ast, program, register_program);
+        return;
+    }
+    auto ir = build_ir(ast, program);
+    optimize_ir(ir);
+    lower_ir(ir, program);
+    peephole(program);
+    program.stack_size = stack_size_of(program.instructions);
+}
+
 void OLRuntime::OLRuntime::run(const std::string &source)
 {
-    for (const auto AST = parse(source); auto &node : AST) {
-        node->compile(program);
-        delete node;
+    // the tree is released before returning, so it can borrow the source text
+    Lexer lexer(source, Lexer::Mode::View);
+    lexer.intern_into(program.atoms);
+    AstArena arena;
+    auto ast = parse(lexer, arena);
+    load(ast, &arena);
+    execute();
+}
+
+void OLRuntime::OLRuntime::run_parallel(const std::string &source, const size_t threads)
+{
+    const auto tokens = lex_parallel(source, Lexer::Mode::View, threads, 1 << 16, &program.atoms);
+    auto ast = parse_parallel(tokens, threads);
+    try {
+        load(ast, nullptr);
+    } catch (...) {
+        destroy_ast(ast);
+        throw;
+    }
+    destroy_ast(ast);
+    execute();
+}
+
+void OLRuntime::OLRuntime::run_file(const std::string &path)
+{
+    const SourceFile file(path);
+    Lexer lexer(file.text(), Lexer::Mode::View);
+    lexer.intern_into(program.atoms);
+    AstArena arena;
+    auto ast = parse(lexer, arena);
+    load(ast, &arena);
+    execute();
+}
+
+void OLRuntime::OLRuntime::run_stream(const int fd, const size_t chunk_size)
+{
+    Lexer lexer(fd, chunk_size);
+    lexer.intern_into(program.atoms);
+    AstArena arena;
+    auto ast = parse(lexer, arena);
+    load(ast, &arena);
+    execute();
+}
+
+void OLRuntime::OLRuntime::run_bytecode(std::shared_ptr<const BytecodeFile> file)
+{
+    program = Program();
+    file->load_symbols(program);
+    bytecode = std::move(file);
+    handlers.clear();
+    native.reset();
+    loops.clear();
+    execute();
+}
+
+void OLRuntime::OLRuntime::run_bytecode(const std::string &path)
+{
+    if (backend != Backend::Stack)
+        throw std::runtime_error("Bytecode files hold programs of the stack machine");
+    run_bytecode(std::make_shared<const BytecodeFile>(path));
+}
+
+void OLRuntime::OLRuntime::run_cached(const std::string &source_path,
+                                      const std::string &cache_path)
+{
+    const SourceFile source(source_path);
+    if (backend == Backend::Stack) {
+        std::shared_ptr<const BytecodeFile> cached;
+        try {
+            cached = std::make_shared<const BytecodeFile>(cache_path);
+        } catch (const std::runtime_error &) {
+            // a missing or damaged cache is replaced below
+        }
+        if (cached != nullptr && cached->source_hash() == hash_text(source.text())) {
+            run_bytecode(std::move(cached));
+            return;
+        }
     }
+    Lexer lexer(source.text(), Lexer::Mode::View);
+    lexer.intern_into(program.atoms);
+    AstArena arena;
+    auto ast = parse(lexer, arena);
+    load(ast, &arena);
+    if (backend == Backend::Stack)
+        save_bytecode(cache_path, source.text());
     execute();
 }
 
+void OLRuntime::OLRuntime::save_bytecode(const std::string &path,
+                                         const std::string_view source) const
+{
+    if (backend != Backend::Stack)
+        throw std::runtime_error("Bytecode files hold programs of the stack machine");
+    if (bytecode != nullptr) {
+        auto copy = program;
+        const auto instructions = bytecode->instructions();
+        copy.instructions.assign(instructions.begin(), instructions.end());
+        write_bytecode(path, copy, hash_text(source));
+        return;
+    }
+    write_bytecode(path, program, hash_text(source));
+}
+
 std::optional<double> OLRuntime::OLRuntime::getLastValue() const
 {
-    if (stack.empty())
+    const auto result = last_result();
+    if (!result.has_value())
+        return std::nullopt;
+    return result->to_number();
+}
+
+std::optional<OLRuntime::Value> OLRuntime::OLRuntime::last_result() const
+{
+    if (backend == Backend::Registers) {
+        if (register_program.result == RegisterProgram::no_result)
+            return std::nullopt;
+        return registers[register_program.result];
+    }
+    if (stack_depth == 0)
         return std::nullopt;
-    return stack.back();
-}
\ No newline at end of file
+    return stack[stack_depth];
+}
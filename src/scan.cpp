@@ -0,0 +1,228 @@
+#include "scan.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+static bool is_whitespace(const char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static size_t skip_whitespace_scalar(const std::string_view source, size_t from)
+{
+    while (from < source.size() && is_whitespace(source[from]))
+        from++;
+    return from;
+}
+
+static size_t find_either_scalar(
+    const std::string_view source, size_t from, const char a, const char b)
+{
+    while (from < source.size() && source[from] != a && source[from] != b)
+        from++;
+    return from;
+}
+
+static Scan::Newlines count_newlines_scalar(
+    const std::string_view source, const size_t from, const size_t to)
+{
+    Scan::Newlines result;
+    for (size_t i = from; i < to; i++) {
+        if (source[i] == '\n') {
+            result.count++;
+            result.last = i;
+        }
+    }
+    return result;
+}
+
+#ifdef SCAN_X86
+static __m128i whitespace_mask_sse2(const __m128i bytes)
+{
+    const auto space = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '));
+    // '\t'..'\r' are the bytes whose unsigned distance from '\t' is at most 4
+    const auto shifted = _mm_sub_epi8(bytes, _mm_set1_epi8('\t'));
+    const auto control = _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(4)), shifted);
+    return _mm_or_si128(space, control);
+}
+
+static size_t skip_whitespace_sse2(const std::string_view source, size_t from)
+{
+    for (; from + 16 <= source.size(); from += 16) {
+        const auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source.data() + from));
+        const unsigned mask = ~_mm_movemask_epi8(whitespace_mask_sse2(bytes)) & 0xFFFF;
+        if (mask != 0)
+            return from + __builtin_ctz(mask);
+    }
+    return skip_whitespace_scalar(source, from);
+}
+
+static size_t find_either_sse2(
+    const std::string_view source, size_t from, const char a, const char b)
+{
+    const auto va = _mm_set1_epi8(a);
+    const auto vb = _mm_set1_epi8(b);
+    for (; from + 16 <= source.size(); from += 16) {
+        const auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source.data() + from));
+        const unsigned mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, va), _mm_cmpeq_epi8(bytes, vb)));
+        if (mask != 0)
+            return from + __builtin_ctz(mask);
+    }
+    return find_either_scalar(source, from, a, b);
+}
+
+static Scan::Newlines count_newlines_sse2(
+    const std::string_view source, size_t from, const size_t to)
+{
+    Scan::Newlines result;
+    const auto newline = _mm_set1_epi8('\n');
+    for (; from + 16 <= to; from += 16) {
+        const auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source.data() + from));
+        const unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+        if (mask != 0) {
+            result.count += __builtin_popcount(mask);
+            result.last = from + 31 - __builtin_clz(mask);
+        }
+    }
+    if (const auto tail = count_newlines_scalar(source, from, to); tail.count > 0) {
+        result.count += tail.count;
+        result.last = tail.last;
+    }
+    return result;
+}
+
+__attribute__((target("avx2"))) static __m256i whitespace_mask_avx2(const __m256i bytes)
+{
+    const auto space = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' '));
+    const auto shifted = _mm256_sub_epi8(bytes, _mm256_set1_epi8('\t'));
+    const auto control =
+        _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8(4)), shifted);
+    return _mm256_or_si256(space, control);
+}
+
+__attribute__((target("avx2"))) static size_t skip_whitespace_avx2(
+    const std::string_view source, size_t from)
+{
+    for (; from + 32 <= source.size(); from += 32) {
+        const auto bytes =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source.data() + from));
+        const unsigned mask = ~static_cast<unsigned>(
+            _mm256_movemask_epi8(whitespace_mask_avx2(bytes)));
+        if (mask != 0)
+            return from + __builtin_ctz(mask);
+    }
+    return skip_whitespace_sse2(source, from);
+}
+
+__attribute__((target("avx2"))) static size_t find_either_avx2(
+    const std::string_view source, size_t from, const char a, const char b)
+{
+    const auto va = _mm256_set1_epi8(a);
+    const auto vb = _mm256_set1_epi8(b);
+    for (; from + 32 <= source.size(); from += 32) {
+        const auto bytes =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source.data() + from));
+        const auto mask = static_cast<unsigned>(_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, va), _mm256_cmpeq_epi8(bytes, vb))));
+        if (mask != 0)
+            return from + __builtin_ctz(mask);
+    }
+    return find_either_sse2(source, from, a, b);
+}
+
+__attribute__((target("avx2"))) static Scan::Newlines count_newlines_avx2(
+    const std::string_view source, size_t from, const size_t to)
+{
+    Scan::Newlines result;
+    const auto newline = _mm256_set1_epi8('\n');
+    for (; from + 32 <= to; from += 32) {
+        const auto bytes =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source.data() + from));
+        const auto mask =
+            static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline)));
+        if (mask != 0) {
+            result.count += __builtin_popcount(mask);
+            result.last = from + 31 - __builtin_clz(mask);
+        }
+    }
+    if (const auto tail = count_newlines_sse2(source, from, to); tail.count > 0) {
+        result.count += tail.count;
+        result.last = tail.last;
+    }
+    return result;
+}
+#endif
+
+struct Kernels
+{
+    Scan::Isa isa;
+    size_t (*skip_whitespace)(std::string_view, size_t);
+    size_t (*find_either)(std::string_view, size_t, char, char);
+    Scan::Newlines (*count_newlines)(std::string_view, size_t, size_t);
+};
+
+static Kernels kernels_for(const Scan::Isa isa)
+{
+    switch (isa) {
+#ifdef SCAN_X86
+    case Scan::Isa::AVX2:
+        return {isa, skip_whitespace_avx2, find_either_avx2, count_newlines_avx2};
+    case Scan::Isa::SSE2:
+        return {isa, skip_whitespace_sse2, find_either_sse2, count_newlines_sse2};
+#endif
+    default:
+        return {
+            Scan::Isa::Scalar,
+            skip_whitespace_scalar,
+            find_either_scalar,
+            count_newlines_scalar,
+        };
+    }
+}
+
+static Kernels &kernels()
+{
+    static Kernels active = kernels_for(Scan::detect_isa());
+    return active;
+}
+
+Scan::Isa Scan::detect_isa()
+{
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+        return Isa::AVX2;
+    return Isa::SSE2;
+#else
+    return Isa::Scalar;
+#endif
+}
+
+Scan::Isa Scan::active_isa()
+{
+    return kernels().isa;
+}
+
+void Scan::set_isa(const Isa isa)
+{
+    kernels() = kernels_for(std::min(isa, detect_isa()));
+}
+
+size_t Scan::skip_whitespace(const std::string_view source, const size_t from)
+{
+    return kernels().skip_whitespace(source, from);
+}
+
+size_t Scan::find_either(const std::string_view source, const size_t from, const char a, const char b)
+{
+    return kernels().find_either(source, from, a, b);
+}
+
+Scan::Newlines Scan::count_newlines(const std::string_view source, const size_t from, const size_t to)
+{
+    return kernels().count_newlines(source, from, to);
+}
@@ -0,0 +1,46 @@
+#include "source_file.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::runtime_error file_error(const std::string &message, const std::string &path)
+{
+    return std::runtime_error(message + " '" + path + "': " + std::strerror(errno));
+}
+
+SourceFile::SourceFile(const std::string &path)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw file_error("Failed to open", path);
+    struct stat info{};
+    if (fstat(fd, &info) < 0) {
+        const auto error = file_error("Failed to stat", path);
+        close(fd);
+        throw error;
+    }
+    size = info.st_size;
+    // mmap rejects empty mappings, an empty file is just an empty view
+    if (size > 0) {
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            const auto error = file_error("Failed to map", path);
+            close(fd);
+            throw error;
+        }
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(mapping);
+    }
+    close(fd);
+}
+
+SourceFile::~SourceFile()
+{
+    if (data != nullptr)
+        munmap(const_cast<char *>(data), size);
+}
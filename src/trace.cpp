@@ -0,0 +1,345 @@
+#include "trace.h"
+
+#include <bit>
+#include <functional>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+
+using OLRuntime::Instruction;
+using OLRuntime::Value;
+
+// instructions an iteration runs at most to be recorded
+static constexpr size_t max_trace_length = 4096;
+static constexpr uint32_t none = UINT32_MAX;
+
+namespace {
+// An operand on the stack while recording: the value the interpreter would compute, and the op
+// of the trace computing it, or for a comparison the ops of its two sides.
+struct Operand
+{
+    Value value;
+    uint32_t op = none;
+    bool comparison = false;
+    uint32_t a = none;
+    uint32_t b = none;
+};
+
+class Recorder
+{
+    const std::span<const Instruction> instructions;
+    Trace trace;
+    std::vector<Value> locals;
+    // op of the value the iteration stored last in every local, none before it stores one
+    std::vector<uint32_t> stored;
+    std::vector<Operand> stack;
+
+    uint32_t add(const TraceOp &op)
+    {
+        trace.ops.push_back(op);
+        return static_cast<uint32_t>(trace.ops.size() - 1);
+    }
+    Operand number(const double number)
+    {
+        return {Value::computed(number), add({.kind = TraceOp::Kind::Number, .number = number})};
+    }
+    std::optional<Operand> load(const size_t slot)
+    {
+        if (slot >= locals.size())
+            return std::nullopt;
+        if (stored[slot] != none)
+            return Operand{locals[slot], stored[slot]};
+        if (!locals[slot].is_number())
+            return std::nullopt;
+        return Operand{locals[slot], add({.kind = TraceOp::Kind::Local, .slot = slot})};
+    }
+    bool store(const size_t slot, const Operand &operand)
+    {
+        if (slot >= locals.size() || operand.comparison)
+            return false;
+        locals[slot] = operand.value;
+        stored[slot] = operand.op;
+        add({.kind = TraceOp::Kind::Store, .a = operand.op, .slot = slot});
+        return true;
+    }
+    // the top operand, which has to be a number
+    std::optional<Operand> pop()
+    {
+        if (stack.empty() || stack.back().comparison)
+            return std::nullopt;
+        const auto operand = stack.back();
+        stack.pop_back();
+        return operand;
+    }
+    Operand arithmetic(const Instruction::Type type, const Operand &a, const Operand &b)
+    {
+        TraceOp op{.a = a.op, .b = b.op};
+        Value value;
+        switch (type) {
+        case Instruction::Type::Add:
+        case Instruction::Type::AddNumber:
+        case Instruction::Type::AddLocal:
+            op.kind = TraceOp::Kind::Add;
+            value = OLRuntime::arithmetic(a.value, b.value, std::plus());
+            break;
+        case Instruction::Type::Sub:
+        case Instruction::Type::SubNumber:
+        case Instruction::Type::SubLocal:
+            op.kind = TraceOp::Kind::Sub;
+            value = OLRuntime::arithmetic(a.value, b.value, std::minus());
+            break;
+        case Instruction::Type::Mul:
+        case Instruction::Type::MulNumber:
+        case Instruction::Type::MulLocal:
+            op.kind = TraceOp::Kind::Mul;
+            value = OLRuntime::arithmetic(a.value, b.value, std::multiplies());
+            break;
+        default:
+            op.kind = TraceOp::Kind::Div;
+            value = OLRuntime::arithmetic(a.value, b.value, std::divides());
+        }
+        return {value, add(op)};
+    }
+
+    // records the instruction at `at`, returns the next one or nullopt when the trace fails
+    std::optional<size_t> record(size_t at);
+
+public:
+    Recorder(const std::span<const Instruction> instructions, const size_t header,
+             const std::span<const Value> locals)
+        : instructions(instructions)
+        , locals(locals.begin(), locals.end())
+        , stored(locals.size(), none)
+    {
+        trace.header = header;
+    }
+
+    std::optional<Trace> record();
+};
+
+std::optional<size_t> Recorder::record(const size_t at)
+{
+    const auto &instruction = instructions[at];
+    switch (instruction.type) {
+    case Instruction::Type::Invalid:
+        break;
+    case Instruction::Type::LoadNumber:
+        stack.push_back(number(instruction.data.number));
+        break;
+    case Instruction::Type::LoadLocal: {
+        const auto operand = load(instruction.data.index);
+        if (!operand.has_value())
+            return std::nullopt;
+        stack.push_back(*operand);
+        break;
+    }
+    case Instruction::Type::StoreLocal:
+    case Instruction::Type::StoreLocalKeep: {
+        if (stack.empty() || !store(instruction.data.index, stack.back()))
+            return std::nullopt;
+        if (instruction.type == Instruction::Type::StoreLocal)
+            stack.pop_back();
+        break;
+    }
+    case Instruction::Type::Add:
+    case Instruction::Type::Sub:
+    case Instruction::Type::Mul:
+    case Instruction::Type::Div: {
+        const auto b = pop();
+        const auto a = pop();
+        if (!a.has_value() || !b.has_value())
+            return std::nullopt;
+        stack.push_back(arithmetic(instruction.type, *a, *b));
+        break;
+    }
+    case Instruction::Type::AddNumber:
+    case Instruction::Type::SubNumber:
+    case Instruction::Type::MulNumber:
+    case Instruction::Type::DivNumber: {
+        const auto a = pop();
+        if (!a.has_value())
+            return std::nullopt;
+        stack.push_back(arithmetic(instruction.type, *a, number(instruction.data.number)));
+        break;
+    }
+    case Instruction::Type::AddLocal:
+    case Instruction::Type::SubLocal:
+    case Instruction::Type::MulLocal:
+    case Instruction::Type::DivLocal: {
+        const auto a = pop();
+        const auto b = load(instruction.data.index);
+        if (!a.has_value() || !b.has_value())
+            return std::nullopt;
+        stack.push_back(arithmetic(instruction.type, *a, *b));
+        break;
+    }
+    case Instruction::Type::Equal: {
+        const auto b = pop();
+        const auto a = pop();
+        if (!a.has_value() || !b.has_value())
+            return std::nullopt;
+        const auto equal = Value::equals(a->value, b->value);
+        stack.push_back({Value::boolean(equal), none, true, a->op, b->op});
+        break;
+    }
+    case Instruction::Type::JumpIfFalse: {
+        if (stack.empty())
+            return std::nullopt;
+        const auto condition = stack.back();
+        stack.pop_back();
+        // the guards leave with nothing on the stack the interpreter would have to hold
+        if (!stack.empty())
+            return std::nullopt;
+        // a number is false when it equals 0
+        TraceOp guard{.kind = TraceOp::Kind::Guard, .a = condition.a, .b = condition.b};
+        if (!condition.comparison) {
+            guard.a = condition.op;
+            guard.b = number(0).op;
+        }
+        guard.equal = condition.comparison ? condition.value.as_boolean()
+                                           : condition.value.as_number() == 0;
+        const auto jumps = condition.comparison != guard.equal;
+        const auto next = jumps ? instruction.data.index : at + 1;
+        guard.slot = jumps ? at + 1 : instruction.data.index;
+        if (next < trace.header)
+            return std::nullopt;
+        add(guard);
+        return next;
+    }
+    case Instruction::Type::Jump:
+        // the jump back to the header ends the iteration, any other one into another loop
+        if (instruction.data.index <= at && instruction.data.index != trace.header)
+            return std::nullopt;
+        return instruction.data.index;
+    default:
+        return std::nullopt;
+    }
+    return at + 1;
+}
+
+std::optional<Trace> Recorder::record()
+{
+    auto at = trace.header;
+    for (size_t length = 0; length < max_trace_length; length++) {
+        if (at >= instructions.size())
+            return std::nullopt;
+        const auto closes_loop = instructions[at].type == Instruction::Type::Jump
+                                 && instructions[at].data.index == trace.header;
+        const auto next = record(at);
+        if (!next.has_value())
+            return std::nullopt;
+        if (closes_loop)
+            return stack.empty() ? std::optional(std::move(trace)) : std::nullopt;
+        at = *next;
+    }
+    return std::nullopt;
+}
+} // namespace
+
+std::optional<Trace> record_trace(const std::span<const Instruction> instructions,
+                                  const size_t header, const std::span<const Value> locals)
+{
+    return Recorder(instructions, header, locals).record();
+}
+
+void fold_constants(Trace &trace)
+{
+    auto &ops = trace.ops;
+    const auto is_number = [&ops](const uint32_t op) {
+        return ops[op].kind == TraceOp::Kind::Number;
+    };
+    for (auto &op : ops) {
+        if (op.is_arithmetic() && is_number(op.a) && is_number(op.b)) {
+            const auto a = ops[op.a].number;
+            const auto b = ops[op.b].number;
+            switch (op.kind) {
+            case TraceOp::Kind::Add:
+                op.number = a + b;
+                break;
+            case TraceOp::Kind::Sub:
+                op.number = a - b;
+                break;
+            case TraceOp::Kind::Mul:
+                op.number = a * b;
+                break;
+            default:
+                op.number = a / b;
+            }
+            op.kind = TraceOp::Kind::Number;
+        } else if (op.kind == TraceOp::Kind::Guard && is_number(op.a) && is_number(op.b)
+                   && (ops[op.a].number == ops[op.b].number) == op.equal) {
+            op.kind = TraceOp::Kind::Nop;
+        }
+    }
+}
+
+void eliminate_redundant_guards(Trace &trace)
+{
+    auto &ops = trace.ops;
+    std::vector<uint32_t> replacement(ops.size());
+    std::unordered_map<size_t, uint32_t> first_reads;
+    std::unordered_map<uint64_t, uint32_t> numbers;
+    std::set<std::tuple<uint32_t, uint32_t, bool>> guards;
+    for (uint32_t index = 0; index < ops.size(); index++) {
+        auto &op = ops[index];
+        replacement[index] = index;
+        op.a = replacement[op.a];
+        op.b = replacement[op.b];
+        // a read checks the type of its local, or a number is materialized, once
+        if (op.kind == TraceOp::Kind::Local || op.kind == TraceOp::Kind::Number) {
+            const auto [first, inserted]
+                = op.kind == TraceOp::Kind::Local
+                      ? first_reads.emplace(op.slot, index)
+                      : numbers.emplace(std::bit_cast<uint64_t>(op.number), index);
+            if (!inserted) {
+                replacement[index] = first->second;
+                op.kind = TraceOp::Kind::Nop;
+            }
+        } else if (op.kind == TraceOp::Kind::Guard) {
+            const auto key = std::make_tuple(std::min(op.a, op.b), std::max(op.a, op.b), op.equal);
+            if (!guards.insert(key).second)
+                op.kind = TraceOp::Kind::Nop;
+        }
+    }
+}
+
+void eliminate_dead_ops(Trace &trace)
+{
+    auto &ops = trace.ops;
+    std::vector<bool> live(ops.size());
+    // operands come before their users, so one walk backwards sees every use first
+    for (size_t index = ops.size(); index-- > 0;) {
+        auto &op = ops[index];
+        switch (op.kind) {
+        case TraceOp::Kind::Guard:
+            live[op.a] = live[op.b] = true;
+            break;
+        case TraceOp::Kind::Store:
+            live[op.a] = true;
+            break;
+        case TraceOp::Kind::Add:
+        case TraceOp::Kind::Sub:
+        case TraceOp::Kind::Mul:
+        case TraceOp::Kind::Div:
+            if (live[index])
+                live[op.a] = live[op.b] = true;
+            else
+                op.kind = TraceOp::Kind::Nop;
+            break;
+        case TraceOp::Kind::Local:
+        case TraceOp::Kind::Number:
+            if (!live[index])
+                op.kind = TraceOp::Kind::Nop;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void optimize_trace(Trace &trace)
+{
+    fold_constants(trace);
+    eliminate_redundant_guards(trace);
+    eliminate_dead_ops(trace);
+}
@@ -0,0 +1,371 @@
+#include "jit.h"
+#include "runtime.h"
+#include "runtime_scenarios.h"
+#include "trace.h"
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// scripts besides the runtime scenarios, some of them leave the machine code for the interpreter
+static const std::vector<std::string> scripts = {
+    "var x = 5\nvar y = x * 2 + 1\ny - x / 2",
+    "var i = 3\nvar total = 0\nwhile (i) {\n    var j = i\n    {\n        var k = j * 2\n"
+    "        total = total + k\n    }\n    i = i - 1\n}\ntotal",
+    "var x = 2\nx == 2",
+    "var x = 2\n(x == 2) + 1",
+    "var x = 2\nvar b = x == 2\nwhile (b) {\n    x = x + 1\n    b = x == 3\n}\nx",
+    "var z = 0\nvar n = z / z\nn * 2 + 1",
+    "var z = 0\nvar n = z / z\nif (n) { z = 1 } else { z = 2 }\nz",
+    "var i = 10000\nvar x = 0\nvar y = 1\nwhile (i) {\n    x = x + y * 2 - i / 3\n"
+    "    y = y + 1 - x / 1000\n    i = i - 1\n}\nx + y",
+    "var a = 1\nvar b = a == 1\nvar c = b + a\nc * 3",
+};
+
+// Random statements over the variables v0 to v3. Loops count down counters of their own, so
+// every script ends, and comparisons mix booleans into the arithmetic now and then.
+class ScriptGenerator
+{
+    std::mt19937 rng;
+    size_t max_iterations;
+
+    size_t below(const size_t n) { return rng() % n; }
+
+    std::string expression(const int depth)
+    {
+        if (depth == 0 || below(3) == 0) {
+            if (below(2) == 0)
+                return "v" + std::to_string(below(4));
+            return std::to_string(below(7));
+        }
+        static constexpr std::string_view operators[] = {" + ", " - ", " * ", " / ", " == "};
+        const auto op = operators[below(10) == 0 ? 4 : below(4)];
+        return "(" + expression(depth - 1) + std::string(op) + expression(depth - 1) + ")";
+    }
+
+    std::string statements(const int depth, const std::string &indent)
+    {
+        std::string source;
+        const auto count = 1 + below(3);
+        for (size_t i = 0; i < count; i++) {
+            const auto kind = depth == 0 ? 0 : below(4);
+            if (kind == 2) {
+                source += indent + "if (" + expression(2) + ") {\n"
+                          + statements(depth - 1, indent + "    ") + indent + "} else {\n"
+                          + statements(depth - 1, indent + "    ") + indent + "}\n";
+            } else if (kind == 3) {
+                const auto counter = "c" + std::to_string(depth);
+                const auto iterations = std::to_string(1 + below(max_iterations));
+                source += indent + "var " + counter + " = " + iterations + "\n" + indent
+                          + "while (" + counter + ") {\n"
+                          + statements(depth - 1, indent + "    ") + indent + "    " + counter
+                          + " = " + counter + " - 1\n" + indent + "}\n";
+            } else {
+                source += indent + "v" + std::to_string(below(4)) + " = " + expression(3) + "\n";
+            }
+        }
+        return source;
+    }
+
+public:
+    explicit ScriptGenerator(const unsigned seed, const size_t max_iterations = 20)
+        : rng(seed)
+        , max_iterations(max_iterations)
+    {}
+
+    std::string script()
+    {
+        std::string source;
+        for (int i = 0; i < 4; i++)
+            source += "var v" + std::to_string(i) + " = " + std::to_string(below(5)) + "\n";
+        return source + statements(3, "") + "v0 + v1 * 3 + v2 * 5 + v3 * 7\n";
+    }
+};
+
+// the last result of `source` as a raw word
+static std::optional<uint64_t> run_with(const std::string &source, const bool jit,
+                                        const bool tracing)
+{
+    OLRuntime::OLRuntime runtime;
+    runtime.set_jit(jit);
+    runtime.set_tracing(tracing);
+    runtime.run(source);
+    return runtime.last_result().transform(&OLRuntime::Value::raw_bits);
+}
+
+// the last result of `source` through the interpreter and through the JIT
+static std::pair<std::optional<uint64_t>, std::optional<uint64_t>>
+run_both(const std::string &source)
+{
+    return {run_with(source, false, false), run_with(source, true, false)};
+}
+
+// how a scenario runs besides through the interpreter alone
+struct Engine
+{
+    const char *name;
+    bool jit;
+    bool tracing;
+};
+
+static void PrintTo(const Engine &engine, std::ostream *out)
+{
+    *out << engine.name;
+}
+
+// the last result of every step of `scenario` as a raw word
+static std::vector<std::optional<uint64_t>> run_steps(const Scenario &scenario,
+                                                      const Engine &engine)
+{
+    OLRuntime::OLRuntime runtime;
+    runtime.set_jit(engine.jit);
+    runtime.set_tracing(engine.tracing);
+    std::vector<std::optional<uint64_t>> results;
+    for (const auto &step : scenario.steps) {
+        runtime.run(step.source);
+        results.push_back(runtime.last_result().transform(&OLRuntime::Value::raw_bits));
+    }
+    return results;
+}
+
+class engine_scenarios : public testing::TestWithParam<std::tuple<Scenario, Engine>>
+{};
+
+TEST_P(engine_scenarios, matches_interpreter)
+{
+    if (!OLRuntime::NativeCode::supported)
+        GTEST_SKIP() << "no JIT for this platform";
+    const auto &[scenario, engine] = GetParam();
+    EXPECT_EQ(run_steps(scenario, engine), run_steps(scenario, {"interpreter", false, false}));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    jit_tests, engine_scenarios,
+    testing::Combine(testing::ValuesIn(runtime_scenarios()),
+                     testing::Values(Engine{"jit", true, false}, Engine{"tracing", false, true},
+                                     Engine{"jit_and_tracing", true, true})),
+    [](const auto &info) {
+        return std::get<0>(info.param).name + "_" + std::get<1>(info.param).name;
+    });
+
+TEST(jit_tests, matches_interpreter)
+{
+    if (!OLRuntime::NativeCode::supported)
+        GTEST_SKIP() << "no JIT for this platform";
+    for (const auto &source : scripts) {
+        const auto [interpreted, compiled] = run_both(source);
+        EXPECT_EQ(interpreted, compiled) << source;
+    }
+}
+
+TEST(jit_tests, random_scripts_match_interpreter)
+{
+    if (!OLRuntime::NativeCode::supported)
+        GTEST_SKIP() << "no JIT for this platform";
+    for (unsigned seed = 0; seed < 200; seed++) {
+        const auto source = ScriptGenerator(seed).script();
+        const auto [interpreted, compiled] = run_both(source);
+        EXPECT_EQ(interpreted, compiled) << source;
+    }
+}
+
+TEST(jit_tests, stops_for_the_interpreter)
+{
+    if (!OLRuntime::NativeCode::supported)
+        GTEST_SKIP() << "no JIT for this platform";
+    using Type = OLRuntime::Instruction::Type;
+    // 1 + (1 == 1) leaves the code at the Add, the interpreter runs it and what follows
+    const std::vector<OLRuntime::Instruction> instructions = {
+        {.type = Type::LoadNumber, .data = {.number = 1}},
+        {.type = Type::LoadNumber, .data = {.number = 1}},
+        {.type = Type::LoadNumber, .data = {.number = 1}},
+        {.type = Type::Equal},
+        {.type = Type::Add},
+        {.type = Type::StoreLocal, .data = {.index = 0}},
+        {.type = Type::LoadLocal, .data = {.index = 0}},
+    };
+    const auto code = OLRuntime::NativeCode::compile(instructions);
+    std::vector<OLRuntime::Value> locals(1);
+    std::vector<OLRuntime::Value> stack(4);
+    size_t depth = 0;
+    EXPECT_EQ(code->run(locals.data(), stack.data(), depth), 4);
+    EXPECT_EQ(depth, 2);
+    EXPECT_EQ(stack[1], OLRuntime::Value::number(1));
+    EXPECT_EQ(stack[2], OLRuntime::Value::boolean(true));
+
+    OLRuntime::OLRuntime runtime(OLRuntime::Program{.instructions = instructions, .frame_size = 1});
+    runtime.set_jit(true);
+    runtime.execute();
+    EXPECT_EQ(runtime.last_result(), OLRuntime::Value::number(2));
+    // a program that runs to the end stays in the code
+    EXPECT_EQ(OLRuntime::NativeCode::compile(std::span(instructions).subspan(0, 3))
+                  ->run(locals.data(), stack.data(), depth),
+              3);
+    EXPECT_EQ(depth, 3);
+}
+
+TEST(jit_tests, chunks_run_again)
+{
+    OLRuntime::OLRuntime interpreted;
+    OLRuntime::OLRuntime compiled;
+    compiled.set_jit(true);
+    for (const auto *source :
+         {"var i = 4\nvar x = 1", "while (i) {\n    x = x * 3\n    i = i - 1\n}", "x + i"}) {
+        interpreted.run(source);
+        compiled.run(source);
+        EXPECT_EQ(interpreted.last_result(), compiled.last_result()) << source;
+    }
+    EXPECT_EQ(compiled.getLastValue(), 81.0);
+}
+
+// while (i) { sum = sum + i; i = i - 1 } over the locals i and sum
+static const std::vector<OLRuntime::Instruction> countdown = {
+    {.type = OLRuntime::Instruction::Type::LoadLocal, .data = {.index = 0}},
+    {.type = OLRuntime::Instruction::Type::JumpIfFalse, .data = {.index = 9}},
+    {.type = OLRuntime::Instruction::Type::LoadLocal, .data = {.index = 1}},
+    {.type = OLRuntime::Instruction::Type::AddLocal, .data = {.index = 0}},
+    {.type = OLRuntime::Instruction::Type::StoreLocal, .data = {.index = 1}},
+    {.type = OLRuntime::Instruction::Type::LoadLocal, .data = {.index = 0}},
+    {.type = OLRuntime::Instruction::Type::SubNumber, .data = {.number = 1}},
+    {.type = OLRuntime::Instruction::Type::StoreLocal, .data = {.index = 0}},
+    {.type = OLRuntime::Instruction::Type::Jump, .data = {.index = 0}},
+};
+
+static size_t count_ops(const Trace &trace, const TraceOp::Kind kind)
+{
+    return std::ranges::count(trace.ops, kind, &TraceOp::kind);
+}
+
+TEST(trace_tests, records_a_loop)
+{
+    using Value = OLRuntime::Value;
+    std::vector<Value> locals = {Value::number(5), Value::number(0)};
+    auto trace = record_trace(countdown, 0, locals);
+    ASSERT_TRUE(trace.has_value());
+    EXPECT_EQ(trace->header, 0);
+    EXPECT_EQ(count_ops(*trace, TraceOp::Kind::Local), 4);
+    EXPECT_EQ(count_ops(*trace, TraceOp::Kind::Guard), 1);
+    EXPECT_EQ(count_ops(*trace, TraceOp::Kind::Store), 2);
+    // the recording ran nothing
+    EXPECT_EQ(locals[0], Value::number(5));
+
+    // i is read three times, its type only has to be checked once
+    optimize_trace(*trace);
+    EXPECT_EQ(count_ops(*trace, TraceOp::Kind::Local), 2);
+    EXPECT_EQ(count_ops(*trace, TraceOp::Kind::Guard), 1);
+
+    // a loop that has to leave right away, or reads a boolean, is not recorded
+    EXPECT_FALSE(record_trace(countdown, 0, std::vector{Value::number(0), Value::number(0)}));
+    EXPECT_FALSE(record_trace(countdown, 0, std::vector{Value::number(1), Value::boolean(true)}));
+    EXPECT_FALSE(record_trace(countdown, 2, locals));
+}
+
+TEST(trace_tests, folds_constants)
+{
+    using Kind = TraceOp::Kind;
+    Trace trace{.ops = {
+                    {.kind = Kind::Number, .number = 2},
+                    {.kind = Kind::Number, .number = 3},
+                    {.kind = Kind::Mul, .a = 0, .b = 1},
+                    {.kind = Kind::Local, .slot = 0},
+                    {.kind = Kind::Add, .a = 3, .b = 2},
+                    {.kind = Kind::Guard, .a = 2, .b = 1, .equal = false, .slot = 7},
+                    {.kind = Kind::Guard, .a = 2, .b = 1, .equal = true, .slot = 7},
+                    {.kind = Kind::Store, .a = 4, .slot = 0},
+                }};
+    fold_constants(trace);
+    EXPECT_EQ(trace.ops[2].kind, Kind::Number);
+    EXPECT_EQ(trace.ops[2].number, 6);
+    EXPECT_EQ(trace.ops[4].kind, Kind::Add);
+    // 6 != 3 always holds, 6 == 3 never does and stays to leave the loop
+    EXPECT_EQ(trace.ops[5].kind, Kind::Nop);
+    EXPECT_EQ(trace.ops[6].kind, Kind::Guard);
+}
+
+TEST(trace_tests, eliminates_redundant_guards_and_dead_ops)
+{
+    using Kind = TraceOp::Kind;
+    Trace trace{.ops = {
+                    {.kind = Kind::Local, .slot = 0},
+                    {.kind = Kind::Number, .number = 0},
+                    {.kind = Kind::Guard, .a = 0, .b = 1, .equal = false, .slot = 9},
+                    {.kind = Kind::Local, .slot = 0},
+                    {.kind = Kind::Number, .number = 0},
+                    {.kind = Kind::Guard, .a = 4, .b = 3, .equal = false, .slot = 9},
+                    {.kind = Kind::Number, .number = 1},
+                    {.kind = Kind::Add, .a = 3, .b = 6},
+                    {.kind = Kind::Store, .a = 3, .slot = 1},
+                }};
+    eliminate_redundant_guards(trace);
+    EXPECT_EQ(trace.ops[3].kind, Kind::Nop);
+    EXPECT_EQ(trace.ops[4].kind, Kind::Nop);
+    EXPECT_EQ(trace.ops[5].kind, Kind::Nop);
+    EXPECT_EQ(trace.ops[8].a, 0);
+    eliminate_dead_ops(trace);
+    EXPECT_EQ(trace.ops[6].kind, Kind::Nop);
+    EXPECT_EQ(trace.ops[7].kind, Kind::Nop);
+    EXPECT_EQ(trace.ops[0].kind, Kind::Local);
+    EXPECT_EQ(trace.ops[1].kind, Kind::Number);
+    EXPECT_EQ(trace.ops[2].kind, Kind::Guard);
+}
+
+TEST(trace_tests, runs_until_a_guard_fails)
+{
+    if (!OLRuntime::NativeCode::supported)
+        GTEST_SKIP() << "no JIT for this platform";
+    using Value = OLRuntime::Value;
+    std::vector<Value> locals = {Value::number(5), Value::number(0)};
+    auto trace = record_trace(countdown, 0, locals);
+    ASSERT_TRUE(trace.has_value());
+    optimize_trace(*trace);
+    const auto code = OLRuntime::NativeTrace::compile(*trace);
+    ASSERT_NE(code, nullptr);
+    // the loop ends when i is 0, with the value the iteration stored
+    EXPECT_EQ(code->run(locals.data()), 9);
+    EXPECT_EQ(locals[0], Value::number(0));
+    EXPECT_EQ(locals[1], Value::number(15));
+
+    // locals that are not numbers leave it before anything ran
+    locals = {Value::boolean(true), Value::number(0)};
+    EXPECT_EQ(code->run(locals.data()), 0);
+    EXPECT_EQ(locals[0], Value::boolean(true));
+    EXPECT_EQ(locals[1], Value::number(0));
+}
+
+TEST(trace_tests, runs_out_of_registers)
+{
+    if (!OLRuntime::NativeCode::supported)
+        GTEST_SKIP() << "no JIT for this platform";
+    Trace trace;
+    for (size_t slot = 0; slot < 16; slot++)
+        trace.ops.push_back({.kind = TraceOp::Kind::Local, .slot = slot});
+    EXPECT_EQ(OLRuntime::NativeTrace::compile(trace), nullptr);
+    trace.ops.pop_back();
+    EXPECT_NE(OLRuntime::NativeTrace::compile(trace), nullptr);
+}
+
+TEST(trace_tests, matches_interpreter)
+{
+    if (!OLRuntime::NativeCode::supported)
+        GTEST_SKIP() << "no JIT for this platform";
+    auto sources = scripts;
+    // loops with a branch that changes, and a local that stops being a number
+    sources.push_back("var i = 1000\nvar a = 0\nvar b = 0\nwhile (i) {\n"
+                      "    if (i == 300) { a = a + 1000 } else { b = b + 1 }\n    i = i - 1\n}\n"
+                      "a * 10000 + b");
+    sources.push_back("var i = 200\nvar flag = 0\nvar n = 0\nwhile (i) {\n    n = n + flag\n"
+                      "    i = i - 1\n    if (i == 100) { flag = i == 100 } else { n = n * 1 }\n}\n"
+                      "n");
+    for (unsigned seed = 0; seed < 200; seed++)
+        sources.push_back(ScriptGenerator(seed, 200).script());
+    for (const auto &source : sources) {
+        const auto interpreted = run_with(source, false, false);
+        EXPECT_EQ(interpreted, run_with(source, false, true)) << source;
+        EXPECT_EQ(interpreted, run_with(source, true, true)) << source;
+    }
+    EXPECT_EQ(run_with(sources[scripts.size()], false, true),
+              OLRuntime::Value::number(10000999).raw_bits());
+    EXPECT_EQ(run_with(sources[scripts.size() + 1], false, true),
+              OLRuntime::Value::number(100).raw_bits());
+}
@@ -1,5 +1,7 @@
 #include "lexer.h"
+#include "parallel_lexer.h"
 #include <gtest/gtest.h>
+#include <unistd.h>
 
 std::vector<Token> tokenize(const std::string &input)
 {
@@ -58,6 +60,38 @@ TEST(lexer_tests, real_numbers)
     EXPECT_EQ(actual, expected);
 }
 
+TEST(lexer_tests, number_boundaries)
+{
+    const auto actual = tokenize("1e5;x 1.5.5 12ab nan 2*x");
+    const std::vector<Token> expected = {
+        Token{Token::Type::Number, "1e5", 1, 1},
+        Token{Token::Type::Semicolon, ";", 1, 4},
+        Token{Token::Type::Identifier, "x", 1, 5},
+        Token{Token::Type::Number, "1.5", 1, 7},
+        Token{Token::Type::Number, ".5", 1, 10},
+        Token{Token::Type::Identifier, "12ab", 1, 13},
+        Token{Token::Type::Identifier, "nan", 1, 18},
+        Token{Token::Type::Number, "2", 1, 22},
+        Token{Token::Type::Asterisk, "*", 1, 23},
+        Token{Token::Type::Identifier, "x", 1, 24},
+        Token{Token::Type::EndOfFile},
+    };
+    EXPECT_EQ(actual, expected);
+}
+
+TEST(lexer_tests, keyword_prefixes_are_identifiers)
+{
+    const auto actual = tokenize("variable iff functions nul");
+    const std::vector<Token> expected = {
+        Token{Token::Type::Identifier, "variable", 1, 1},
+        Token{Token::Type::Identifier, "iff", 1, 10},
+        Token{Token::Type::Identifier, "functions", 1, 14},
+        Token{Token::Type::Identifier, "nul", 1, 24},
+        Token{Token::Type::EndOfFile},
+    };
+    EXPECT_EQ(actual, expected);
+}
+
 TEST(lexer_tests, strings)
 {
     const auto actual = tokenize("\"Hello world\"");
@@ -78,6 +112,19 @@ TEST(lexer_tests, string_with_escape_sequence)
     EXPECT_EQ(actual, expected);
 }
 
+TEST(lexer_tests, positions_after_strings)
+{
+    const auto actual = tokenize("\"a\\\"b\" x \"multi\nline\" y");
+    const std::vector<Token> expected = {
+        Token{Token::Type::String, "a\"b", 1, 1},
+        Token{Token::Type::Identifier, "x", 1, 8},
+        Token{Token::Type::String, "multi\nline", 1, 10},
+        Token{Token::Type::Identifier, "y", 2, 7},
+        Token{Token::Type::EndOfFile},
+    };
+    EXPECT_EQ(actual, expected);
+}
+
 TEST(lexer_tests, multiple_lines)
 {
     const auto actual = tokenize("test\nlol\n123");
@@ -101,6 +148,20 @@ TEST(lexer_tests, comments)
     EXPECT_EQ(actual, expected);
 }
 
+TEST(lexer_tests, long_comments)
+{
+    std::string source;
+    for (int i = 0; i < 100; i++)
+        source += "// license header line " + std::to_string(i) + "\n";
+    source += "/* " + std::string(200, '*') + "\n */ x";
+    const auto actual = tokenize(source);
+    const std::vector<Token> expected = {
+        Token{Token::Type::Identifier, "x", 102, 5},
+        Token{Token::Type::EndOfFile},
+    };
+    EXPECT_EQ(actual, expected);
+}
+
 TEST(lexer_tests, multi_line_comments)
 {
     const auto actual = tokenize("test /*\nthis is a comment\n*/lol");
@@ -167,3 +228,148 @@ TEST(lexer_tests, punctuation)
     };
     EXPECT_EQ(actual, expected);
 }
+
+TEST(lexer_tests, view_mode_tokens_refer_to_source)
+{
+    const std::string source = "var x = 3.14 + \"plain\"";
+    Lexer lexer(source, Lexer::Mode::View);
+    for (auto token = lexer.next(); token.type != Token::Type::EndOfFile; token = lexer.next()) {
+        EXPECT_TRUE(token.value.empty());
+        EXPECT_GE(token.text().data(), source.data());
+        EXPECT_LE(token.text().data() + token.text().size(), source.data() + source.size());
+    }
+}
+
+TEST(lexer_tests, view_mode_materializes_escaped_strings)
+{
+    const std::string source = R"("plain" "Hello \"world\"")";
+    Lexer lexer(source, Lexer::Mode::View);
+    const auto plain = lexer.next();
+    const auto escaped = lexer.next();
+    EXPECT_EQ(plain, (Token{Token::Type::String, "plain", 1, 1}));
+    EXPECT_EQ(plain.text().data(), source.data() + 1);
+    EXPECT_EQ(escaped.type, Token::Type::String);
+    EXPECT_EQ(escaped.text(), "Hello \"world\"");
+    EXPECT_EQ(escaped.text().data(), escaped.value.data());
+}
+
+TEST(lexer_tests, peek_ahead)
+{
+    Lexer lexer("var x = 1");
+    EXPECT_EQ(lexer.peek(2), (Token{Token::Type::Equals, "=", 1, 7}));
+    EXPECT_EQ(lexer.peek(), (Token{Token::Type::Var, "var", 1, 1}));
+    EXPECT_EQ(lexer.next(), (Token{Token::Type::Var, "var", 1, 1}));
+    EXPECT_EQ(lexer.peek(3).type, Token::Type::EndOfFile);
+    EXPECT_EQ(lexer.next(), (Token{Token::Type::Identifier, "x", 1, 5}));
+    EXPECT_EQ(lexer.current(), (Token{Token::Type::Identifier, "x", 1, 5}));
+}
+
+TEST(lexer_tests, each_byte_is_scanned_once)
+{
+    const std::string source = "function f(a) { /* sum */ a + 1.5e3 } // done\n\"s\\n\"";
+    Lexer lexer(source);
+    while (true) {
+        for (size_t i = 0; i < 4; i++)
+            lexer.peek(i);
+        if (lexer.next().type == Token::Type::EndOfFile)
+            break;
+    }
+    EXPECT_EQ(lexer.bytes_scanned(), source.size());
+}
+
+TEST(lexer_tests, streaming_matches_whole_source)
+{
+    const std::string source =
+        "var x = 1.5e3 // comment\n"
+        "/* a longer\n block comment */ if (x === 2) { \"str\\\"ing\" }\n"
+        "function add(a, b) { a + b }";
+    const auto expected = tokenize(source);
+    for (const size_t chunk_size : {1, 2, 3, 7, 64}) {
+        int fds[2];
+        ASSERT_EQ(pipe(fds), 0);
+        ASSERT_EQ(write(fds[1], source.data(), source.size()), source.size());
+        close(fds[1]);
+        Lexer lexer(fds[0], chunk_size);
+        std::vector<Token> actual;
+        while (true) {
+            actual.push_back(lexer.next());
+            if (actual.back().type == Token::Type::EndOfFile)
+                break;
+        }
+        close(fds[0]);
+        EXPECT_EQ(actual, expected) << "chunk size " << chunk_size;
+        // tokens across the edge of the window are scanned again
+        EXPECT_GE(lexer.bytes_scanned(), source.size());
+        EXPECT_LE(lexer.bytes_scanned(), 3 * source.size());
+    }
+}
+
+TEST(lexer_tests, streaming_long_tokens_in_linear_time)
+{
+    const std::string text(1 << 20, 'a');
+    const auto source = "\"" + text + "\" /* " + text + " */ x";
+    char path[] = "/tmp/objects_script_XXXXXX";
+    const int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    unlink(path);
+    ASSERT_EQ(write(fd, source.data(), source.size()), source.size());
+    ASSERT_EQ(lseek(fd, 0, SEEK_SET), 0);
+    Lexer lexer(fd, 4096);
+    const auto string = lexer.next();
+    EXPECT_EQ(string.type, Token::Type::String);
+    EXPECT_EQ(string.text(), text);
+    EXPECT_EQ(lexer.next(), (Token{Token::Type::Identifier, "x", 1, text.size() * 2 + 11}));
+    EXPECT_EQ(lexer.next().type, Token::Type::EndOfFile);
+    close(fd);
+    // a window growing by one chunk would scan them about 256 times over
+    EXPECT_LE(lexer.bytes_scanned(), 4 * source.size());
+}
+
+TEST(lexer_tests, identifiers_are_interned)
+{
+    AtomTable atoms;
+    Lexer lexer("x y x var", Lexer::Mode::View);
+    lexer.intern_into(atoms);
+    const auto x = lexer.next();
+    const auto y = lexer.next();
+    const auto x_again = lexer.next();
+    const auto keyword = lexer.next();
+    EXPECT_EQ(x.atom, x_again.atom);
+    EXPECT_NE(x.atom, y.atom);
+    EXPECT_EQ(keyword.atom, Token::no_atom);
+    EXPECT_EQ(atoms.size(), 2);
+    EXPECT_EQ(atoms.name(y.atom), "y");
+}
+
+TEST(lexer_tests, quotes_end_words)
+{
+    const auto actual = tokenize("ab\"cd\"");
+    const std::vector<Token> expected = {
+        Token{Token::Type::Identifier, "ab", 1, 1},
+        Token{Token::Type::String, "cd", 1, 3},
+        Token{Token::Type::EndOfFile},
+    };
+    EXPECT_EQ(actual, expected);
+}
+
+TEST(lexer_tests, split_points_avoid_strings_and_comments)
+{
+    const std::string source = "a\n\"b\nc\"\n/* d\ne */\n// f\ng\n";
+    const auto splits = find_split_points(source, source.size());
+    const std::vector<size_t> expected = {0, 2, 8, 18, 23, 25};
+    EXPECT_EQ(splits, expected);
+}
+
+TEST(lexer_tests, parallel_matches_serial)
+{
+    std::string source;
+    for (int i = 0; i < 200; i++) {
+        source += "var x" + std::to_string(i) + " = " + std::to_string(i) + ".5e1 * (y - 2)\n";
+        source += "\"multi\nline \\\" // string\" /* comment\n \" */ z // \"\n";
+    }
+    const auto expected = tokenize(source);
+    for (const size_t threads : {1, 2, 3, 8, 64}) {
+        const auto actual = lex_parallel(source, Lexer::Mode::View, threads, 16);
+        EXPECT_EQ(actual, expected) << threads << " threads";
+    }
+}
@@ -1,4 +1,8 @@
 #include "ast.h"
+#include "ast_arena.h"
+#include "flat_ast.h"
+#include "parallel_lexer.h"
+#include "parallel_parser.h"
 #include "parser.h"
 #include <gtest/gtest.h>
 #include <vector>
@@ -136,12 +140,12 @@ TEST(parser_tests, multiline_expression)
         "- 3\n"
         "2 + 3",
         new BinaryExpression(
-            new SingleNode({Token::Type::Number, "1", 1, 1}),
             new BinaryExpression(
+                new SingleNode({Token::Type::Number, "1", 1, 1}),
                 new SingleNode({Token::Type::Number, "2", 1, 5}),
-                new SingleNode({Token::Type::Number, "3", 2, 3}),
-                {Token::Type::Minus, "-", 2, 1}),
-            {Token::Type::Plus, "+", 1, 3}),
+                {Token::Type::Plus, "+", 1, 3}),
+            new SingleNode({Token::Type::Number, "3", 2, 3}),
+            {Token::Type::Minus, "-", 2, 1}),
         new BinaryExpression(
             new SingleNode({Token::Type::Number, "2", 3, 1}),
             new SingleNode({Token::Type::Number, "3", 3, 5}),
@@ -324,6 +328,21 @@ TEST(parser_tests, while_statement)
     END();
 }
 
+TEST(parser_tests, scope_block_statement)
+{
+    BEGIN(
+        "{ var y = x }\ny",
+        new ScopeBlock({
+            new BinaryExpression(
+                new VarDeclaration({Token::Type::Identifier, "y", 1, 7}),
+                new SingleNode({Token::Type::Identifier, "x", 1, 11}),
+                {Token::Type::Equals, "=", 1, 9}),
+        }),
+        new SingleNode({Token::Type::Identifier, "y", 2, 1}));
+    EXPECT_EQ(expected, actual);
+    END();
+}
+
 TEST(parser_tests, array_accesser)
 {
     BEGIN(
@@ -359,3 +378,212 @@ TEST(parser_tests, constructor)
     EXPECT_EQ(expected, actual);
     END();
 }
+
+TEST(parser_tests, view_mode_matches_copy_mode)
+{
+    const std::string source = "var x = 1 + 2 * 3\nfunction f(a) { a.b[0] }";
+    auto copied = parse(source);
+    auto viewed = parse(source, Lexer::Mode::View);
+    EXPECT_EQ(copied, viewed);
+    destroy_ast(copied);
+    destroy_ast(viewed);
+}
+
+TEST(parser_tests, parse_parallel_lexed_tokens)
+{
+    const std::string source = "var x = 1 + 2 * 3\nif (x == 7) { x = 0 }\nfunction f(a) { a }";
+    Lexer lexer(lex_parallel(source, Lexer::Mode::View, 4, 8));
+    auto replayed = parse(lexer);
+    auto serial = parse(source);
+    EXPECT_EQ(replayed, serial);
+    destroy_ast(replayed);
+    destroy_ast(serial);
+}
+
+TEST(parser_tests, operator_precedence_4)
+{
+    BEGIN(
+        "1 - 2 * 3 - 4",
+        new BinaryExpression(
+            new BinaryExpression(
+                new SingleNode({Token::Type::Number, "1", 1, 1}),
+                new BinaryExpression(
+                    new SingleNode({Token::Type::Number, "2", 1, 5}),
+                    new SingleNode({Token::Type::Number, "3", 1, 9}),
+                    {Token::Type::Asterisk, "*", 1, 7}),
+                {Token::Type::Minus, "-", 1, 3}),
+            new SingleNode({Token::Type::Number, "4", 1, 13}),
+            {Token::Type::Minus, "-", 1, 11}));
+    EXPECT_EQ(expected, actual);
+    END();
+}
+
+TEST(parser_tests, long_expression_chain)
+{
+    std::string source = "x = 1";
+    for (int i = 0; i < 20000; i++)
+        source += i % 3 == 0 ? " * 2" : " + 3";
+    const auto ast = parse(source);
+    ASSERT_EQ(ast.size(), 1);
+    EXPECT_EQ(ast[0]->type, ASTNode::Type::BinaryExpression);
+    destroy_ast(ast);
+}
+
+TEST(parser_tests, parse_into_arena)
+{
+    const std::string source =
+        "var long_variable_name_without_sso = \"esc\\\"aped\"\n"
+        "function f(a, b) { if (a == b) { a = 0 } else { b = 1 } }\n"
+        "while (x) { f(x[0], y.z) }";
+    auto heap = parse(source);
+    AstArena arena;
+    Lexer lexer(source);
+    const auto arena_ast = parse(lexer, arena);
+    EXPECT_EQ(heap, arena_ast);
+    destroy_ast(heap);
+}
+
+TEST(parser_tests, flat_ast_matches_pointer_tree)
+{
+    const std::string source =
+        "var x = 1 + 2 * 3\n"
+        "function f(a, b) { if (a == b) { a = 0 } else { b = \"s\" } }\n"
+        "while (x) { f(x[0], y.z) }\n"
+        "new Point(1, 2)";
+    const auto ast = parse(source);
+    const auto flat = flatten(ast);
+    Lexer lexer(source);
+    EXPECT_EQ(flat, parse_flat(lexer));
+    EXPECT_EQ(flat.roots.size(), ast.size());
+    EXPECT_EQ(flat.token(flat.roots[0]), (Token{Token::Type::Equals, "=", 1, 7}));
+
+    auto changed = parse("var x = 1 + 2 * 4");
+    EXPECT_NE(flatten({ast[0]}), flatten(changed));
+    destroy_ast(changed);
+    destroy_ast(ast);
+}
+
+TEST(parser_tests, incremental_reparse)
+{
+    IncrementalParser parser("var a = 1\n"
+                             "function f(x) { x = x + 1 }\n"
+                             "var b = a * 2\n"
+                             "while (b) { f(b) }\n"
+                             "var c = 3");
+    const auto matches_fresh_parse = [&] {
+        auto fresh = parse(parser.text());
+        EXPECT_EQ(parser.ast(), fresh);
+        destroy_ast(fresh);
+    };
+    matches_fresh_parse();
+    const auto last = parser.ast().back();
+
+    // inside the function body, on the same line
+    EXPECT_LE(parser.edit(parser.text().find("x + 1"), 5, "x * 2"), 2u);
+    matches_fresh_parse();
+    EXPECT_EQ(parser.ast().back(), last);
+
+    // new lines move the reused statements down
+    EXPECT_LE(parser.edit(parser.text().find("var b"), 0, "var z = 0\n\n"), 3u);
+    matches_fresh_parse();
+    EXPECT_EQ(parser.ast().back(), last);
+
+    // joining two statements into one expression
+    EXPECT_LE(parser.edit(parser.text().find("\nwhile"), 1, " + "), 3u);
+    matches_fresh_parse();
+
+    parser.edit(parser.text().size(), 0, "\nvar d = c");
+    matches_fresh_parse();
+    EXPECT_EQ(parser.ast().size(), 6u);
+
+    EXPECT_THROW(parser.edit(0, 0, ") "), std::runtime_error);
+    matches_fresh_parse();
+}
+
+TEST(parser_tests, deep_nesting)
+{
+    constexpr auto depth = 5000;
+    auto source = std::string(depth, '(') + "1" + std::string(depth, ')');
+    for (int i = 0; i < depth; i++)
+        source += " = x";
+    const auto ast = parse(source);
+    ASSERT_EQ(ast.size(), 1);
+    EXPECT_EQ(ast[0]->type, ASTNode::Type::BinaryExpression);
+    destroy_ast(ast);
+
+    const auto limit = max_parse_depth();
+    set_max_parse_depth(100);
+    EXPECT_THROW(parse(std::string(200, '(') + "1" + std::string(200, ')')), std::runtime_error);
+    EXPECT_THROW(parse("function f(a) { " + std::string(200, '(')), std::runtime_error);
+    std::string chain = "x";
+    for (int i = 0; i < 200; i++)
+        chain += " = x";
+    EXPECT_THROW(parse(chain), std::runtime_error);
+    AstArena arena;
+    Lexer lexer("while (x) { if (x) { " + std::string(200, '[') + " } }");
+    EXPECT_THROW(parse(lexer, arena), std::runtime_error);
+    set_max_parse_depth(limit);
+}
+
+TEST(parser_tests, missing_operand)
+{
+    for (const auto source : {"+ 1", "* 2", "== 3", "{ / 2 }", ".x", "[0]", "x = 1 +", "1 * 2 -"})
+        EXPECT_THROW(parse(source), std::runtime_error) << source;
+    AstArena arena;
+    Lexer lexer("if (x) { = 1 }");
+    EXPECT_THROW(parse(lexer, arena), std::runtime_error);
+}
+
+TEST(parser_tests, unterminated_input)
+{
+    for (const auto source :
+         {"(1 + 2", "{ 1", "if (1) ", "if (1", "while (x", "while (x) 1", "f(1, 2", "x[0",
+          "function f(a", "function f(a) 1", "function (a) { a }", "var 1", "if 1", "()",
+          "(1 2)", "if () 1", "x[]", "if (1) 2 3"})
+        EXPECT_THROW(parse(source), std::runtime_error) << source;
+    AstArena arena;
+    Lexer lexer("while (1) { (2");
+    EXPECT_THROW(parse(lexer, arena), std::runtime_error);
+}
+
+TEST(parser_tests, blocks_only_start_statements)
+{
+    for (const auto source :
+         {"1 + {2}", "var x = {2}", "f({1})", "({1})", "x[{0}]", "if ({x}) { 1 }"})
+        EXPECT_THROW(parse(source), std::runtime_error) << source;
+    const auto ast = parse("{ { 1 } }\nwhile (x) { { y } }");
+    ASSERT_EQ(ast.size(), 2);
+    EXPECT_EQ(ast[0]->type, ASTNode::Type::ScopeBlock);
+    destroy_ast(ast);
+}
+
+TEST(parser_tests, parse_top_level_units_in_parallel)
+{
+    const std::string source = "var x = 1\n"
+                               "function f(a) { if (a) { a = g(a[1]) } }\n"
+                               "function g(b) { b }\n"
+                               "if (x) function h(c) { c }\n"
+                               "else x\n"
+                               "var y = x\n"
+                               "function k(z) { x } + 1\n"
+                               "x = function m(z) { x }\n"
+                               "y";
+    const auto tokens = lex_parallel(source, Lexer::Mode::View, 1, 1 << 16);
+    const auto units = find_top_level_units(tokens);
+    std::vector<Token::Type> starts;
+    for (size_t i = 0; i + 1 < units.size(); i++)
+        starts.push_back(tokens[units[i]].type);
+    EXPECT_EQ(starts,
+              (std::vector{Token::Type::Var, Token::Type::Function, Token::Type::Function,
+                  Token::Type::If, Token::Type::Function}));
+    EXPECT_EQ(units.back(), tokens.size() - 1);
+
+    auto parallel = parse_parallel(tokens, 4);
+    auto serial = parse(source);
+    EXPECT_EQ(parallel, serial);
+    destroy_ast(parallel);
+    destroy_ast(serial);
+
+    EXPECT_THROW(parse_parallel(lex_parallel("function f(a) { a }\n)", Lexer::Mode::View, 1), 2),
+                 std::runtime_error);
+}
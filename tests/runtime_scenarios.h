@@ -0,0 +1,29 @@
+#pragma once
+
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A script of the runtime tests, in steps that each run on top of the variables of the previous
+// ones. The runtime tests check the interpreter against `expected`, the JIT tests check the
+// machine code and the traces against the interpreter.
+struct Scenario
+{
+    struct Step
+    {
+        std::string source;
+        std::optional<double> expected;
+    };
+    std::string name;
+    std::vector<Step> steps;
+};
+
+// keeps gtest from printing the bytes of long sources
+inline void PrintTo(const Scenario &scenario, std::ostream *out)
+{
+    *out << scenario.name;
+}
+
+// defined in runtime_tests.cpp
+const std::vector<Scenario> &runtime_scenarios();
@@ -1,46 +1,712 @@
+#include "bytecode_file.h"
+#include "flat_ast.h"
+#include "ir_passes.h"
+#include "optimizer.h"
+#include "parallel_parser.h"
+#include "parser.h"
+#include "peephole.h"
+#include "register_compiler.h"
 #include "runtime.h"
+#include "runtime_scenarios.h"
+#include <bit>
+#include <fstream>
+#include <functional>
 #include <gtest/gtest.h>
+#include <limits>
+#include <unistd.h>
 
-TEST(runtime_tests, add_numbers)
+// a chain of 20000 terms, longer than the parse depth limit
+static std::string long_chain()
+{
+    std::string source = "var x = 0\nx";
+    for (int i = 0; i < 20000; i++)
+        source += i % 2 == 0 ? " + 3" : " - 1";
+    return source;
+}
+
+static std::string deeply_nested()
+{
+    constexpr auto depth = 3000;
+    std::string source = "var x = 1\n";
+    for (int i = 0; i < depth; i++)
+        source += "(x + ";
+    return source + "1" + std::string(depth, ')');
+}
+
+const std::vector<Scenario> &runtime_scenarios()
+{
+    static const std::vector<Scenario> scenarios = {
+        {"add_numbers", {{"1 + 1", 2}}},
+        {"subtract_numbers", {{"5 - 1", 4}}},
+        {"add_and_subtract_numbers", {{"1 + 1 - 1", 1}}},
+        {"multiply_numbers", {{"2 * 2", 4}}},
+        {"divide_numbers", {{"4 / 2", 2}}},
+        {"operators_group_to_the_left",
+         {{"10 - 2 - 3", 5}, {"8 / 4 / 2", 1}, {"var a = 1\nvar b = 2\na = b = 3\na + b", 6}}},
+        {"long_expression_chain", {{long_chain(), 20000}}},
+        {"declare_variable", {{"var x = 10\nx", 10}}},
+        {"multiple_variables", {{"var x = 10\nvar y = 4\nvar z = x - y\nz * y", 24}}},
+        {"deeply_nested_expression", {{deeply_nested(), 3001}}},
+        {"loops_and_branches",
+         {{"var i = 5\n"
+           "var sum = 0\n"
+           "while (i) {\n"
+           "    sum = sum + i\n"
+           "    i = i - 1\n"
+           "}\n"
+           "sum",
+           15},
+          {"if (sum == 15) { sum = 1 } else { sum = 2 }\nsum + i", 1},
+          {"if (sum === 2) sum = 7\nsum", 1}}},
+        {"branch_values",
+         {{"if (1 == 1) { 5 } else { 6 }", 5},
+          {"7\nif (0) { 8 }", 7},
+          {"var i = 3 var s = 0 while (i) { s = s + i i = i - 1 } s", 6},
+          {"while (i == 0) { i = 1 }", 6}}},
+        // getLastValue() reads booleans as 0 or 1 and null as 0
+        {"literals",
+         {{"true", 1},
+          {"var f = false\nf", 0},
+          {"null == null", 1},
+          {"true == 1", 0},
+          {"true + true", 2},
+          {"if (f) { 1 } else { null }", 0},
+          {"var b = true\nwhile (b) { b = false }\nb", 0}}},
+        // variables of a block in a loop body are new on every iteration
+        {"block_in_loop_body",
+         {{"var i = 3\n"
+           "var sum = 0\n"
+           "while (i) {\n"
+           "    var twice\n"
+           "    sum = sum + twice\n"
+           "    twice = i * 2\n"
+           "    sum = sum + twice\n"
+           "    i = i - 1\n"
+           "}\n"
+           "sum",
+           12}}},
+    };
+    return scenarios;
+}
+
+class interpreter_scenarios : public testing::TestWithParam<Scenario>
+{};
+
+TEST_P(interpreter_scenarios, runs)
 {
     OLRuntime::OLRuntime runtime;
-    runtime.run("1 + 1");
-    ASSERT_EQ(runtime.getLastValue(), 2.0);
+    for (const auto &step : GetParam().steps) {
+        runtime.run(step.source);
+        EXPECT_EQ(runtime.getLastValue(), step.expected) << step.source;
+    }
 }
 
-TEST(runtime_tests, subtract_numbers)
+INSTANTIATE_TEST_SUITE_P(runtime_tests, interpreter_scenarios, testing::ValuesIn(runtime_scenarios()),
+                         [](const auto &info) { return info.param.name; });
+
+class parallel_scenarios : public testing::TestWithParam<Scenario>
+{};
+
+TEST_P(parallel_scenarios, runs)
 {
     OLRuntime::OLRuntime runtime;
-    runtime.run("5 - 1");
-    ASSERT_EQ(runtime.getLastValue(), 4.0);
+    for (const auto &step : GetParam().steps) {
+        runtime.run_parallel(step.source, 3);
+        EXPECT_EQ(runtime.getLastValue(), step.expected) << step.source;
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(runtime_tests, parallel_scenarios, testing::ValuesIn(runtime_scenarios()),
+                         [](const auto &info) { return info.param.name; });
+
+class register_scenarios : public testing::TestWithParam<Scenario>
+{};
+
+TEST_P(register_scenarios, runs)
+{
+    OLRuntime::OLRuntime runtime(OLRuntime::OLRuntime::Backend::Registers);
+    for (const auto &step : GetParam().steps) {
+        runtime.run(step.source);
+        EXPECT_EQ(runtime.getLastValue(), step.expected) << step.source;
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(runtime_tests, register_scenarios, testing::ValuesIn(runtime_scenarios()),
+                         [](const auto &info) { return info.param.name; });
+
+class flat_ast_scenarios : public testing::TestWithParam<Scenario>
+{};
+
+// every step runs after the ones before it in a program compiled from the flat tree
+TEST_P(flat_ast_scenarios, runs)
+{
+    std::string source;
+    for (const auto &step : GetParam().steps) {
+        source += step.source + "\n";
+        const auto ast = parse(source);
+        OLRuntime::Program program;
+        flatten(ast).compile(program);
+        destroy_ast(ast);
+        OLRuntime::OLRuntime runtime(std::move(program));
+        runtime.execute();
+        EXPECT_EQ(runtime.getLastValue(), step.expected) << step.source;
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(runtime_tests, flat_ast_scenarios, testing::ValuesIn(runtime_scenarios()),
+                         [](const auto &info) { return info.param.name; });
+
+TEST(runtime_tests, flat_ast_rejects_what_it_cannot_compile)
+{
+    for (const auto source : {"var x = 1\nx.y", "f(1)", "new x", "\"text\"", "var a = 1\na[0]"}) {
+        const auto ast = parse(source);
+        const auto flat = flatten(ast);
+        destroy_ast(ast);
+        OLRuntime::Program program;
+        EXPECT_THROW(flat.compile(program), std::runtime_error) << source;
+        EXPECT_TRUE(program.instructions.empty()) << source;
+    }
 }
 
-TEST(runtime_tests, add_and_subtract_numbers)
+TEST(runtime_tests, run_file)
 {
+    char path[] = "/tmp/objects_script_XXXXXX";
+    const int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    const std::string source = "var x = 6\nx * 7";
+    ASSERT_EQ(write(fd, source.data(), source.size()), source.size());
+    close(fd);
     OLRuntime::OLRuntime runtime;
-    runtime.run("1 + 1 - 1");
-    ASSERT_EQ(runtime.getLastValue(), 1.0);
+    runtime.run_file(path);
+    unlink(path);
+    ASSERT_EQ(runtime.getLastValue(), 42.0);
 }
 
-TEST(runtime_tests, multiply_numbers)
+TEST(runtime_tests, run_stream)
 {
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    const std::string source = "var x = 6\nx * 7";
+    ASSERT_EQ(write(fds[1], source.data(), source.size()), source.size());
+    close(fds[1]);
     OLRuntime::OLRuntime runtime;
-    runtime.run("2 * 2");
-    ASSERT_EQ(runtime.getLastValue(), 4.0);
+    runtime.run_stream(fds[0], 4);
+    close(fds[0]);
+    ASSERT_EQ(runtime.getLastValue(), 42.0);
+}
+
+TEST(runtime_tests, flat_ast_compiles_like_pointer_tree)
+{
+    const std::string source = "var x = 10\nvar y = x * 2 - 4 / 2\ny + x";
+    const auto ast = parse(source);
+    OLRuntime::Program tree_program;
+    for (const auto &node : ast)
+        node->compile(tree_program);
+    OLRuntime::Program flat_program;
+    flatten(ast).compile(flat_program);
+    destroy_ast(ast);
+    ASSERT_EQ(flat_program.instructions.size(), tree_program.instructions.size());
+    for (size_t i = 0; i < tree_program.instructions.size(); i++) {
+        EXPECT_EQ(flat_program.instructions[i].type, tree_program.instructions[i].type);
+        EXPECT_EQ(flat_program.instructions[i].data.index, tree_program.instructions[i].data.index);
+    }
+    OLRuntime::OLRuntime runtime(std::move(flat_program));
+    runtime.execute();
+    ASSERT_EQ(runtime.getLastValue(), 28.0);
+}
+
+TEST(runtime_tests, chained_assignment_keeps_value)
+{
+    const std::string source = "var a = 1\nvar b = 2\na = b = 3\na + b";
+    const auto ast = parse(source);
+    OLRuntime::Program tree_program;
+    for (const auto &node : ast)
+        node->compile(tree_program);
+    OLRuntime::Program flat_program;
+    flatten(ast).compile(flat_program);
+    OLRuntime::Program parallel_program;
+    compile_parallel(ast, parallel_program, 2);
+    destroy_ast(ast);
+    // the inner assignment stores b and leaves 3 for a
+    EXPECT_EQ(tree_program.instructions[5].type, OLRuntime::Instruction::Type::StoreLocalKeep);
+    EXPECT_EQ(tree_program.instructions[6].type, OLRuntime::Instruction::Type::StoreLocal);
+    for (auto program : {tree_program, flat_program, parallel_program}) {
+        OLRuntime::OLRuntime runtime(std::move(program));
+        runtime.execute();
+        EXPECT_EQ(runtime.getLastValue(), 6.0);
+    }
+
+    for (const auto backend : {OLRuntime::OLRuntime::Backend::Stack,
+                               OLRuntime::OLRuntime::Backend::Registers}) {
+        OLRuntime::OLRuntime runtime(backend);
+        runtime.run_parallel(source, 2);
+        EXPECT_EQ(runtime.getLastValue(), 6.0);
+        runtime.run("var c = 0\n(c = 4) + c");
+        EXPECT_EQ(runtime.getLastValue(), 8.0);
+        // the second assignment happens after the first one was read
+        runtime.run("(c = 4) + (c = 5) + c");
+        EXPECT_EQ(runtime.getLastValue(), 14.0);
+    }
 }
 
-TEST(runtime_tests, divide_numbers)
+TEST(runtime_tests, compile_in_parallel)
 {
+    const std::string source = "var a = 2\n"
+                               "var b = a * 3\n"
+                               "var c = b - a\n"
+                               "a = c\n"
+                               "var d = c / (a + b)\n"
+                               "d * 8";
+    const auto ast = parse(source);
+    OLRuntime::Program serial;
+    for (const auto &node : ast)
+        node->compile(serial);
+    OLRuntime::Program parallel;
+    parallel.atoms.intern("z");
+    parallel.declare(0);
+    compile_parallel(ast, parallel, 3);
+    destroy_ast(ast);
+    ASSERT_EQ(parallel.instructions.size(), serial.instructions.size());
+    EXPECT_EQ(parallel.locals_count, serial.locals_count + 1);
+    for (size_t i = 0; i < serial.instructions.size(); i++) {
+        EXPECT_EQ(parallel.instructions[i].type, serial.instructions[i].type);
+        if (serial.instructions[i].uses_local()) {
+            EXPECT_EQ(parallel.instructions[i].data.index, serial.instructions[i].data.index + 1);
+        }
+    }
+
+    // a = c stores 4, so d is 4 / (4 + 6)
     OLRuntime::OLRuntime runtime;
-    runtime.run("4 / 2");
-    ASSERT_EQ(runtime.getLastValue(), 2.0);
+    runtime.run_parallel(source, 4);
+    ASSERT_EQ(runtime.getLastValue(), 3.2);
+}
+
+static OLRuntime::Program compile_source(const std::string &source, const bool optimized)
+{
+    OLRuntime::Program program;
+    auto ast = parse(source);
+    if (optimized)
+        optimize(ast);
+    for (const auto &node : ast)
+        node->compile(program);
+    destroy_ast(ast);
+    return program;
+}
+
+static double evaluate(OLRuntime::Program program)
+{
+    OLRuntime::OLRuntime runtime(std::move(program));
+    runtime.execute();
+    return runtime.getLastValue().value();
+}
+
+TEST(runtime_tests, optimize_constant_expressions)
+{
+    const std::string source = "var rate = 2 * 3 + 4\n"
+                               "var base = (8 / 2)\n"
+                               "var x = base * 1 - 0\n"
+                               "x = x\n"
+                               "x * rate / 1 + (1 + 1) * (x + -0)";
+    auto plain = compile_source(source, false);
+    auto optimized = compile_source(source, true);
+    // x * 10 + 2 * (x + -0) is all that is left of the last line, x could be a boolean
+    EXPECT_EQ(optimized.instructions.size(), plain.instructions.size() - 14);
+    EXPECT_EQ(evaluate(std::move(optimized)), evaluate(std::move(plain)));
+
+    // x + 0 is 0 for x = -0, so only x - 0 is dropped
+    const std::string negative_zero = "var n = 0 * -1\n"
+                                      "n = n\n"
+                                      "var a = 1 / (n * 2 + 0)\n"
+                                      "var b = 1 / (n * 2 - 0)\n"
+                                      "a - b";
+    EXPECT_EQ(evaluate(compile_source(negative_zero, true)), std::numeric_limits<double>::infinity());
+    EXPECT_EQ(compile_source(negative_zero, true).instructions.size(),
+              compile_source(negative_zero, false).instructions.size() - 4);
+
+    // the identities turn booleans and null into numbers, so they stay
+    const std::pair<std::string, double> tagged[] = {
+        {"true * 1", 1},
+        {"var t = true\nt = t\nt - 0", 1},
+        {"null + -0", 0},
+    };
+    for (const auto &[source, expected] : tagged) {
+        OLRuntime::OLRuntime runtime(compile_source(source, true));
+        runtime.execute();
+        EXPECT_EQ(runtime.last_result(), OLRuntime::Value::number(expected)) << source;
+    }
+}
+
+TEST(runtime_tests, block_scopes_reuse_slots)
+{
+    const std::string source = "var a = 1\n"
+                               "{\n"
+                               "    var b = a + 1\n"
+                               "    var a = b * 10\n"
+                               "    a = a + b\n"
+                               "}\n"
+                               "{\n"
+                               "    var c = 5\n"
+                               "    a = a + c\n"
+                               "}\n"
+                               "a";
+    auto program = compile_source(source, false);
+    // b and the inner a are gone once their block ends, c takes the slot of b
+    EXPECT_EQ(program.locals_count, 1);
+    EXPECT_EQ(program.frame_size, 3);
+    EXPECT_EQ(program.instructions[15].type, OLRuntime::Instruction::Type::StoreLocal);
+    EXPECT_EQ(program.instructions[15].data.index, 1);
+    EXPECT_EQ(evaluate(std::move(program)), 6.0);
+
+    OLRuntime::OLRuntime stack;
+    stack.run(source);
+    EXPECT_EQ(stack.getLastValue(), 6.0);
+    OLRuntime::OLRuntime registers(OLRuntime::OLRuntime::Backend::Registers);
+    registers.run(source);
+    EXPECT_EQ(registers.getLastValue(), 6.0);
+    // the result of a block outlives the variable it was read from
+    registers.run("{\n    var d = 4\n    d\n}\n{\n    var e = 9\n}");
+    EXPECT_EQ(registers.getLastValue(), 4.0);
+}
+
+TEST(runtime_tests, threaded_dispatch_matches_switch)
+{
+    const std::string source = "var i = 6\n"
+                               "var x = 1\n"
+                               "while (i) {\n"
+                               "    x = x * 2 - i / 2\n"
+                               "    if (x == 5) { x = 0 }\n"
+                               "    i = i - 1\n"
+                               "}\n"
+                               "x";
+    OLRuntime::OLRuntime switched;
+    switched.set_dispatch(OLRuntime::OLRuntime::Dispatch::Switch);
+    switched.set_profiling(true);
+    switched.run(source);
+    OLRuntime::OLRuntime threaded;
+    threaded.set_dispatch(OLRuntime::OLRuntime::Dispatch::Threaded);
+    threaded.set_profiling(true);
+    threaded.run(source);
+    EXPECT_EQ(threaded.getLastValue(), switched.getLastValue());
+    for (size_t first = 0; first < OLRuntime::Instruction::types_count; first++) {
+        for (size_t second = 0; second < OLRuntime::Instruction::types_count; second++) {
+            const auto a = static_cast<OLRuntime::Instruction::Type>(first);
+            const auto b = static_cast<OLRuntime::Instruction::Type>(second);
+            EXPECT_EQ(threaded.pair_count(a, b), switched.pair_count(a, b));
+        }
+    }
+
+    // handlers are translated again once more code is loaded
+    threaded.run("x + 1");
+    switched.run("x + 1");
+    EXPECT_EQ(threaded.getLastValue(), switched.getLastValue());
+
+    // and when profiling switches to the other instantiation of the machine
+    const auto expected = threaded.getLastValue();
+    for (const auto profiling : {false, true, false}) {
+        threaded.set_profiling(profiling);
+        threaded.execute();
+        EXPECT_EQ(threaded.getLastValue(), expected);
+    }
 }
 
-TEST(runtime_tests, declare_variable)
+TEST(runtime_tests, max_stack_depth)
 {
+    using Type = OLRuntime::Instruction::Type;
+    const auto program = compile_source("var x = 2\n1 + x * 3\nx", false);
+    // 1, x and 3 are on the stack when the multiplication runs
+    EXPECT_EQ(OLRuntime::max_stack_depth(program.instructions), 3);
+    EXPECT_EQ(OLRuntime::OLRuntime(program).getLastValue(), std::nullopt);
+    EXPECT_EQ(evaluate(program), 2.0);
+
+    const std::vector<OLRuntime::Instruction> underflow = {
+        {.type = Type::LoadNumber, .data = {.number = 1}},
+        {.type = Type::Add},
+    };
+    EXPECT_EQ(OLRuntime::max_stack_depth(underflow), std::nullopt);
+    // a loop pushing on every iteration never reaches its header with the same depth
+    const std::vector<OLRuntime::Instruction> growing = {
+        {.type = Type::LoadNumber, .data = {.number = 1}},
+        {.type = Type::Jump, .data = {.index = 0}},
+    };
+    EXPECT_EQ(OLRuntime::max_stack_depth(growing), std::nullopt);
+    EXPECT_THROW(OLRuntime::OLRuntime{OLRuntime::Program{.instructions = growing}},
+                 std::runtime_error);
+    const std::vector<OLRuntime::Instruction> balanced = {
+        {.type = Type::LoadNumber, .data = {.number = 1}},
+        {.type = Type::JumpIfFalse, .data = {.index = 4}},
+        {.type = Type::LoadNumber, .data = {.number = 2}},
+        {.type = Type::StoreLocal, .data = {.index = 0}},
+        {.type = Type::LoadLocal, .data = {.index = 0}},
+    };
+    EXPECT_EQ(OLRuntime::max_stack_depth(balanced), 1);
+}
+
+TEST(runtime_tests, nan_boxed_values)
+{
+    using OLRuntime::Value;
+    const auto nan = std::numeric_limits<double>::quiet_NaN();
+    for (const auto number : {0.0, -0.0, 1.5, -1e308, std::numeric_limits<double>::infinity(),
+                              -std::numeric_limits<double>::infinity(), nan, -nan}) {
+        const auto value = Value::number(number);
+        EXPECT_EQ(value.tag(), Value::Tag::Number);
+        EXPECT_EQ(std::bit_cast<uint64_t>(value.to_number()),
+                  std::bit_cast<uint64_t>(number != number ? nan : number));
+    }
+    // a NaN payload never reads as another kind
+    const auto tagged_nan = std::bit_cast<double>(Value::null().raw_bits());
+    EXPECT_EQ(Value::number(tagged_nan).tag(), Value::Tag::Number);
+
+    EXPECT_EQ(Value::integer(-7).as_integer(), -7);
+    EXPECT_EQ(Value::integer(INT32_MIN).as_integer(), INT32_MIN);
+    EXPECT_TRUE(Value::boolean(true).as_boolean());
+    EXPECT_EQ(Value::null().tag(), Value::Tag::Null);
+    int object = 0;
+    EXPECT_EQ(Value::pointer(&object).as_pointer(), &object);
+    EXPECT_EQ(Value::pointer(&object).tag(), Value::Tag::Pointer);
+
+    EXPECT_TRUE(Value::equals(Value::integer(3), Value::number(3)));
+    EXPECT_FALSE(Value::integer(3) == Value::number(3));
+    EXPECT_FALSE(Value::equals(Value::number(nan), Value::number(nan)));
+    EXPECT_FALSE(Value::equals(Value::boolean(false), Value::null()));
+    EXPECT_TRUE(Value::null().is_falsy());
+    EXPECT_TRUE(Value::number(-0.0).is_falsy());
+    EXPECT_FALSE(Value::number(nan).is_falsy());
+    EXPECT_EQ(arithmetic(Value::integer(2), Value::boolean(true), std::plus()), Value::number(3));
+    EXPECT_EQ(arithmetic(Value::number(6), 4.0, std::divides()), Value::number(1.5));
+
+    // comparisons are booleans, arithmetic stays on numbers
     OLRuntime::OLRuntime runtime;
-    runtime.run(
-        "var x = 10\n"
-        "x");
-    ASSERT_EQ(runtime.getLastValue(), 10.0);
-}
\ No newline at end of file
+    runtime.run("var x = 2\nx == 2");
+    EXPECT_EQ(runtime.last_result(), Value::boolean(true));
+    runtime.run("(x == 2) + 1");
+    EXPECT_EQ(runtime.last_result(), Value::number(2));
+    runtime.run("0 / 0");
+    EXPECT_EQ(runtime.last_result()->tag(), Value::Tag::Number);
+
+    // literals keep their kind on both machines
+    for (const auto backend : {OLRuntime::OLRuntime::Backend::Stack,
+                               OLRuntime::OLRuntime::Backend::Registers}) {
+        OLRuntime::OLRuntime literals(backend);
+        literals.run("var t = true\nt");
+        EXPECT_EQ(literals.last_result(), Value::boolean(true));
+        EXPECT_EQ(literals.getLastValue(), 1.0);
+        literals.run("null");
+        EXPECT_EQ(literals.last_result(), Value::null());
+        literals.run("if (t == true) { false }");
+        EXPECT_EQ(literals.last_result(), Value::boolean(false));
+    }
+}
+
+static size_t count_values(const IrProgram &ir, const IrValue::Op op)
+{
+    size_t count = 0;
+    for (const auto &block : ir.blocks) {
+        for (const auto value : block.values)
+            count += ir.values[value].op == op;
+    }
+    return count;
+}
+
+TEST(runtime_tests, optimize_ir)
+{
+    const auto ast = parse("var k = 3\n"
+                           "var i = 4\n"
+                           "var s = 0\n"
+                           "k * 5\n"
+                           "while (i) {\n"
+                           "    var t = i\n"
+                           "    s = s + (k + 1) * (1 + k) + t\n"
+                           "    i = i - 1\n"
+                           "}\n"
+                           "s");
+    OLRuntime::Program program;
+    auto ir = build_ir(ast, program);
+    destroy_ast(ast);
+    ASSERT_EQ(count_values(ir, IrValue::Op::Add), 4);
+    ASSERT_EQ(count_values(ir, IrValue::Op::Mul), 2);
+    const auto mul = [&ir] {
+        for (uint32_t value = 0; value < ir.values.size(); value++) {
+            if (ir.values[value].op == IrValue::Op::Mul && !ir.values[value].operands.empty()
+                && ir.values[ir.values[value].operands[0]].op == IrValue::Op::Add)
+                return value;
+        }
+        return IrProgram::none;
+    }();
+    ASSERT_NE(mul, IrProgram::none);
+    EXPECT_NE(ir.values[mul].block, 0);
+
+    optimize_ir(ir);
+    // k + 1 is computed once, before the loop, and the unused k * 5 is gone
+    EXPECT_EQ(count_values(ir, IrValue::Op::Add), 3);
+    EXPECT_EQ(count_values(ir, IrValue::Op::Mul), 1);
+    EXPECT_EQ(ir.values[mul].block, 0);
+    for (const auto operand : ir.values[mul].operands)
+        EXPECT_EQ(ir.values[operand].block, 0);
+
+    lower_ir(ir, program);
+    OLRuntime::OLRuntime runtime(std::move(program));
+    runtime.execute();
+    EXPECT_EQ(runtime.getLastValue(), 74.0);
+}
+
+TEST(runtime_tests, register_machine_matches_stack_machine)
+{
+    std::string nested = "var x = 1\n";
+    for (int i = 0; i < 3000; i++)
+        nested += "(x + ";
+    nested += "1" + std::string(3000, ')');
+    const std::vector<std::string> sources = {
+        "4 / 2 - 8",
+        "var x = 10\nvar y = 4\nvar z = x - y\nz * y",
+        "var a = 3\n(a + 1) * (a - 1) / 2\nvar b = a * a",
+        "var a = 3\nvar b = a\nb",
+        "var a = 3\na = 5",
+        "var a = 3\nvar b = 2 * a + 1",
+        nested,
+    };
+    for (const auto &source : sources) {
+        OLRuntime::OLRuntime stack;
+        stack.run(source);
+        OLRuntime::OLRuntime registers(OLRuntime::OLRuntime::Backend::Registers);
+        registers.run(source);
+        EXPECT_EQ(registers.getLastValue(), stack.getLastValue()) << source;
+    }
+
+    // later runs see the variables and the result of earlier ones
+    const std::vector<std::string> runs = {
+        "var x = 10", "x + 1", "var y = x * 2", "{ var z = 3 }", "x = y - x\nx", "y = 0",
+        "if (x == 10) { x = x + 1 }\nx", "var w = 5", "while (y == 0) { y = w }", "y",
+    };
+    OLRuntime::OLRuntime stack;
+    OLRuntime::OLRuntime registers(OLRuntime::OLRuntime::Backend::Registers);
+    for (const auto &source : runs) {
+        stack.run(source);
+        registers.run(source);
+        EXPECT_EQ(registers.getLastValue(), stack.getLastValue()) << source;
+    }
+    EXPECT_EQ(registers.getLastValue(), 5.0);
+
+    // the arithmetic reads and writes the slots of the variables directly
+    const auto ast = parse("var a = 3\nvar b = 4\nvar c = a * b + a");
+    OLRuntime::Program program;
+    const auto compiled = compile_registers(ast, program);
+    destroy_ast(ast);
+    ASSERT_EQ(compiled.instructions.size(), 5);
+    EXPECT_EQ(compiled.instructions[3].type, OLRuntime::RegisterInstruction::Type::Add);
+    EXPECT_EQ(compiled.instructions[3].dst, program.local_vars[program.atoms.intern("c")]);
+    EXPECT_EQ(compiled.registers_count, 4);
+}
+
+TEST(runtime_tests, peephole_fuses_profiled_pairs)
+{
+    using Type = OLRuntime::Instruction::Type;
+    const std::string source = "var x = 10\nvar y = x * 2 + 3 / x - x\nvar z = y\nz / 4 - y";
+    auto plain = compile_source(source, false);
+    OLRuntime::OLRuntime profiled(plain);
+    profiled.set_profiling(true);
+    profiled.execute();
+    EXPECT_EQ(profiled.pair_count(Type::LoadNumber, Type::Mul), 1);
+    EXPECT_EQ(profiled.pair_count(Type::LoadLocal, Type::Sub), 2);
+    EXPECT_EQ(profiled.pair_count(Type::StoreLocal, Type::LoadLocal), 3);
+
+    auto fused = plain;
+    peephole(fused);
+    const std::vector<Type> expected = {
+        Type::LoadNumber, Type::StoreLocalKeep, Type::MulNumber, Type::LoadNumber, Type::DivLocal,
+        Type::Add, Type::SubLocal, Type::StoreLocalKeep, Type::StoreLocalKeep, Type::DivNumber,
+        Type::SubLocal,
+    };
+    ASSERT_EQ(fused.instructions.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); i++)
+        EXPECT_EQ(fused.instructions[i].type, expected[i]) << i;
+    EXPECT_EQ(evaluate(std::move(fused)), evaluate(std::move(plain)));
+
+    OLRuntime::Program copy;
+    copy.instructions = {{.type = Type::LoadLocal, .data = {.index = 0}},
+                         {.type = Type::StoreLocal, .data = {.index = 0}}};
+    peephole(copy);
+    EXPECT_TRUE(copy.instructions.empty());
+}
+
+static void write_file(const std::string &path, const std::string &text)
+{
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << text;
+}
+
+TEST(runtime_tests, run_bytecode_file)
+{
+    const std::string source = "var x = 6\nvar y = x * 7\ny - 2";
+    const std::string path = testing::TempDir() + "bytecode.olc";
+    OLRuntime::OLRuntime compiled;
+    compiled.run(source);
+    compiled.save_bytecode(path, source);
+
+    OLRuntime::OLRuntime loaded;
+    loaded.run_bytecode(path);
+    EXPECT_EQ(loaded.getLastValue(), 40.0);
+    EXPECT_EQ(BytecodeFile(path).source_hash(), hash_text(source));
+    // more source can be run on top of the loaded variables
+    loaded.run("y / 2");
+    EXPECT_EQ(loaded.getLastValue(), 21.0);
+
+    std::ifstream in(path, std::ios::binary);
+    std::string bytes(std::istreambuf_iterator<char>(in), {});
+    in.close();
+    bytes[bytes.size() - 1] ^= 1;
+    write_file(path, bytes);
+    EXPECT_THROW(BytecodeFile{path}, std::runtime_error);
+    write_file(path, bytes.substr(0, 16));
+    EXPECT_THROW(BytecodeFile{path}, std::runtime_error);
+
+    // the machine indexes its handlers by type, a file must not bring unknown ones
+    OLRuntime::Program unknown;
+    unknown.instructions.push_back(
+        {.type = static_cast<OLRuntime::Instruction::Type>(OLRuntime::Instruction::types_count)});
+    write_bytecode(path, unknown, 0);
+    EXPECT_THROW(BytecodeFile{path}, std::runtime_error);
+
+    // nor values other than the literals, it could forge a pointer
+    OLRuntime::OLRuntime literal;
+    literal.run("var t = true\nt");
+    literal.save_bytecode(path, "");
+    OLRuntime::OLRuntime reloaded;
+    reloaded.run_bytecode(path);
+    EXPECT_EQ(reloaded.last_result(), OLRuntime::Value::boolean(true));
+    OLRuntime::Program pointer;
+    pointer.instructions.push_back(
+        {.type = OLRuntime::Instruction::Type::LoadValue,
+         .data = {.value = OLRuntime::Value::pointer(&pointer).raw_bits()}});
+    pointer.stack_size = 1;
+    write_bytecode(path, pointer, 0);
+    EXPECT_THROW(BytecodeFile{path}, std::runtime_error);
+    std::remove(path.c_str());
+}
+
+TEST(runtime_tests, run_cached_compiles_once_per_source)
+{
+    const std::string source_path = testing::TempDir() + "cached.ol";
+    const std::string cache_path = testing::TempDir() + "cached.olc";
+    std::remove(cache_path.c_str());
+    write_file(source_path, "var x = 6\nx * 7");
+    OLRuntime::OLRuntime first;
+    first.run_cached(source_path, cache_path);
+    EXPECT_EQ(first.getLastValue(), 42.0);
+    ASSERT_EQ(BytecodeFile(cache_path).source_hash(), hash_text("var x = 6\nx * 7"));
+
+    // the cache is trusted as long as the source hash matches, a stand-in proves it is used
+    OLRuntime::OLRuntime stand_in;
+    stand_in.run("43");
+    stand_in.save_bytecode(cache_path, "var x = 6\nx * 7");
+    OLRuntime::OLRuntime second;
+    second.run_cached(source_path, cache_path);
+    EXPECT_EQ(second.getLastValue(), 43.0);
+
+    // an edited source no longer matches the hash in the cache, which is written again
+    write_file(source_path, "var x = 6\nx * 8");
+    OLRuntime::OLRuntime third;
+    third.run_cached(source_path, cache_path);
+    EXPECT_EQ(third.getLastValue(), 48.0);
+    EXPECT_EQ(BytecodeFile(cache_path).source_hash(), hash_text("var x = 6\nx * 8"));
+    std::remove(source_path.c_str());
+    std::remove(cache_path.c_str());
+}
@@ -0,0 +1,42 @@
+#include "scan.h"
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+
+static std::string random_source(const size_t size)
+{
+    static constexpr std::string_view alphabet = " \t\n\r*/\"\\ab1";
+    std::mt19937 rng(42);
+    std::string source(size, ' ');
+    for (auto &c : source)
+        c = alphabet[rng() % alphabet.size()];
+    return source;
+}
+
+TEST(scan_tests, kernels_match_scalar)
+{
+    const auto source = random_source(1000);
+    for (const auto isa : {Scan::Isa::SSE2, Scan::Isa::AVX2}) {
+        for (size_t from = 0; from <= source.size(); from += 7) {
+            Scan::set_isa(Scan::Isa::Scalar);
+            const auto whitespace = Scan::skip_whitespace(source, from);
+            const auto quote = Scan::find_either(source, from, '"', '\\');
+            const auto newlines = Scan::count_newlines(source, from, source.size());
+            Scan::set_isa(isa);
+            EXPECT_EQ(Scan::skip_whitespace(source, from), whitespace);
+            EXPECT_EQ(Scan::find_either(source, from, '"', '\\'), quote);
+            EXPECT_EQ(Scan::count_newlines(source, from, source.size()).count, newlines.count);
+            EXPECT_EQ(Scan::count_newlines(source, from, source.size()).last, newlines.last);
+        }
+    }
+    Scan::set_isa(Scan::detect_isa());
+}
+
+TEST(scan_tests, long_whitespace_runs)
+{
+    const std::string source = std::string(100, ' ') + "\n\n" + std::string(50, '\t') + "x";
+    EXPECT_EQ(Scan::skip_whitespace(source, 0), source.size() - 1);
+    const auto newlines = Scan::count_newlines(source, 0, source.size());
+    EXPECT_EQ(newlines.count, 2);
+    EXPECT_EQ(newlines.last, 101);
+}